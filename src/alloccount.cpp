@@ -0,0 +1,81 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <alloccount.h>
+
+#ifdef CWS_ALLOC_COUNT
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static thread_local uint64_t allocations = 0;
+static std::atomic<uint64_t> processAllocated{0};
+
+void *operator new(std::size_t size) {
+	allocations++;
+	processAllocated.fetch_add(1, std::memory_order_relaxed);
+	void *ptr = malloc(size > 0 ? size : 1);
+	if ( ptr == nullptr ) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void *operator new[](std::size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+	free(ptr);
+}
+
+uint64_t threadAllocations() {
+	return allocations;
+}
+
+uint64_t processAllocations() {
+	return processAllocated.load(std::memory_order_relaxed);
+}
+
+#else
+
+uint64_t threadAllocations() {
+	return 0;
+}
+
+uint64_t processAllocations() {
+	return 0;
+}
+
+#endif
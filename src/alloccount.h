@@ -0,0 +1,30 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+// Heap allocations made by the calling thread through operator new. Only
+// counted when configured with --enable-alloc-count, 0 otherwise.
+uint64_t threadAllocations();
+// Same for all threads, for work handed between them
+uint64_t processAllocations();
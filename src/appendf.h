@@ -0,0 +1,41 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <string>
+
+// printf to the end of out, lines longer than 512 bytes are cut
+static inline void appendf(std::string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static inline void appendf(std::string &out, const char *fmt, ...) {
+	char buff[512];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(buff, sizeof(buff), fmt, args);
+	va_end(args);
+	if ( len > 0 ) {
+		out.append(buff, std::min<size_t>(len, sizeof(buff) - 1));
+	}
+}
@@ -0,0 +1,545 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Measures the driver end to end: indiserver runs it against cws_simulator
+// while clients attached to indiserver time every update of the weather
+// parameters. The simulator stamps its send time into rain, so the latency
+// covers the fetch, decoding, the XML of IDSetNumber and the fan-out to all
+// clients. Polling is stepped up until the driver no longer keeps up.
+//
+//   bench_indi -c 10 -o results.txt
+//
+// Starts both programs from the working directory unless told otherwise,
+// the driver keeps its configuration in a temporary directory.
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+	int clients = 1;
+	double start = 10;
+	double max = 5000;
+	double step = 10;
+	double latencyBound = 250;
+	int serverPort = 17624;
+	int devicePort = 18080;
+	const char *indiserver = "indiserver";
+	const char *driver = "./indi_aagcloudwatcher_solo";
+	const char *simulator = "./cws_simulator";
+	const char *device = "Cloudwatcher Solo";
+	const char *output = nullptr;
+};
+
+// One client attached to indiserver
+struct Client {
+	int fd = -1;
+	std::string in;
+	uint64_t updates = 0;
+};
+
+// Resources of a process as read from /proc
+struct Usage {
+	double cpu = 0;
+	long rss = 0;
+};
+
+static const double STAMP_WRAP = 1e8;
+
+static pid_t spawn(const std::vector<const char *> &args) {
+	pid_t pid = fork();
+	if ( pid == 0 ) {
+		std::vector<char *> argv;
+		for (const char *arg : args) {
+			argv.push_back(const_cast<char *>(arg));
+		}
+		argv.push_back(nullptr);
+		execvp(argv[0], argv.data());
+		fprintf(stderr, "Could not start %s: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+	return pid;
+}
+
+static int connectTo(int port, double seconds) {
+	auto deadline = Clock::now() + std::chrono::duration<double>(seconds);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	do {
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if ( fd >= 0 && connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0 ) {
+			return fd;
+		}
+		if ( fd >= 0 ) {
+			close(fd);
+		}
+		usleep(50000);
+	} while ( Clock::now() < deadline );
+	return -1;
+}
+
+static bool sendAll(int fd, const std::string &data) {
+	size_t sent = 0;
+	while ( sent < data.size() ) {
+		ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if ( n < 0 && errno == EINTR ) {
+			continue;
+		}
+		if ( n <= 0 ) {
+			return false;
+		}
+		sent += n;
+	}
+	return true;
+}
+
+static std::string newNumber(const Options &options, const char *property, const char *element, double value) {
+	char buf[512];
+	snprintf(buf, sizeof(buf), "<newNumberVector device='%s' name='%s'><oneNumber name='%s'>%g</oneNumber></newNumberVector>\n",
+			options.device, property, element, value);
+	return buf;
+}
+
+// The driver runs as a child of indiserver
+static pid_t findChild(pid_t parent) {
+	DIR *dir = opendir("/proc");
+	if ( dir == nullptr ) {
+		return -1;
+	}
+	pid_t child = -1;
+	struct dirent *entry;
+	while ( child < 0 && (entry = readdir(dir)) != nullptr ) {
+		char path[300];
+		snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+		FILE *fp = fopen(path, "r");
+		if ( fp == nullptr ) {
+			continue;
+		}
+		char line[512];
+		if ( fgets(line, sizeof(line), fp) != nullptr ) {
+			// The name in parentheses may contain spaces
+			const char *rest = strrchr(line, ')');
+			int ppid = 0;
+			if ( rest != nullptr && sscanf(rest + 2, "%*c %d", &ppid) == 1 && ppid == parent ) {
+				child = atoi(entry->d_name);
+			}
+		}
+		fclose(fp);
+	}
+	closedir(dir);
+	return child;
+}
+
+static Usage readUsage(pid_t pid) {
+	Usage usage;
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *fp = fopen(path, "r");
+	if ( fp == nullptr ) {
+		return usage;
+	}
+	char line[1024];
+	if ( fgets(line, sizeof(line), fp) != nullptr ) {
+		const char *rest = strrchr(line, ')');
+		unsigned long utime = 0;
+		unsigned long stime = 0;
+		long rss = 0;
+		// Fields from the state on, utime and stime are 14 and 15, rss 24
+		if ( rest != nullptr && sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d "
+					"%*d %*d %*u %*u %ld", &utime, &stime, &rss) == 3 ) {
+			usage.cpu = static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+			usage.rss = rss * (sysconf(_SC_PAGESIZE) / 1024);
+		}
+	}
+	fclose(fp);
+	return usage;
+}
+
+static double stampNow() {
+	return fmod(std::chrono::duration<double, std::milli>(std::chrono::system_clock::now().time_since_epoch()).count(),
+			STAMP_WRAP);
+}
+
+// Takes the complete setNumberVector messages of the weather parameters out
+// of what the client received, returns the stamps they carried
+static void parseUpdates(Client &client, std::vector<double> &stamps) {
+	size_t pos = 0;
+	for (;;) {
+		size_t start = client.in.find("<setNumberVector", pos);
+		if ( start == std::string::npos ) {
+			// Keep what could be the start of the next message
+			size_t keep = std::min<size_t>(client.in.size(), 16);
+			client.in.erase(0, client.in.size() - keep);
+			return;
+		}
+		size_t end = client.in.find("</setNumberVector>", start);
+		if ( end == std::string::npos ) {
+			client.in.erase(0, start);
+			return;
+		}
+		size_t head = client.in.find('>', start);
+		std::string tag = client.in.substr(start, head - start);
+		if ( tag.find("name=\"WEATHER_PARAMETERS\"") != std::string::npos ||
+				tag.find("name='WEATHER_PARAMETERS'") != std::string::npos ) {
+			size_t rain = client.in.find("WEATHER_RAIN", head);
+			if ( rain != std::string::npos && rain < end ) {
+				size_t value = client.in.find('>', rain);
+				stamps.push_back(strtod(client.in.c_str() + value + 1, nullptr));
+				client.updates++;
+			}
+		}
+		pos = end;
+	}
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+	if ( sorted.empty() ) {
+		return 0;
+	}
+	return sorted[std::min(sorted.size() - 1, static_cast<size_t>(sorted.size() * p / 100))];
+}
+
+class Bench {
+	public:
+		explicit Bench(const Options &options) : m_options(options) {}
+		~Bench();
+		bool start();
+		// Polls at rate for the given time, returns whether the driver kept up
+		bool measure(double rate, double seconds);
+		double getMaxRate() const { return m_maxRate; }
+
+	private:
+		bool setup();
+		// Reads from all clients until the deadline, collecting the latency
+		// of every update if asked to
+		void receive(Clock::time_point deadline, std::vector<double> *latencies);
+		void sampleRss(double elapsed);
+
+		Options m_options;
+		std::vector<Client> m_clients;
+		pid_t m_simulator = -1;
+		pid_t m_server = -1;
+		pid_t m_driver = -1;
+		char m_configDir[64] = "";
+		FILE *m_out = nullptr;
+		Clock::time_point m_begin;
+		Clock::time_point m_lastRss;
+		double m_maxRate = 0;
+};
+
+Bench::~Bench() {
+	for (Client &client : m_clients) {
+		if ( client.fd >= 0 ) {
+			close(client.fd);
+		}
+	}
+	for (pid_t pid : {m_server, m_simulator}) {
+		if ( pid > 0 ) {
+			kill(pid, SIGTERM);
+			waitpid(pid, nullptr, 0);
+		}
+	}
+	if ( m_configDir[0] != '\0' ) {
+		std::string config = std::string(m_configDir) + "/config.xml";
+		unlink(config.c_str());
+		unlink((config + ".default").c_str());
+		rmdir(m_configDir);
+	}
+	if ( m_out != nullptr ) {
+		fclose(m_out);
+	}
+}
+
+bool Bench::start() {
+	if ( m_options.output != nullptr ) {
+		m_out = fopen(m_options.output, "w");
+		if ( m_out == nullptr ) {
+			fprintf(stderr, "Could not open %s: %s\n", m_options.output, strerror(errno));
+			return false;
+		}
+		time_t now = time(nullptr);
+		char date[64];
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", gmtime(&now));
+		fprintf(m_out, "# bench_indi %s, %d client%s, %.0f s per step\n", date, m_options.clients,
+				m_options.clients == 1 ? "" : "s", m_options.step);
+		fprintf(m_out, "# rss seconds driver[kB] indiserver[kB]\n");
+		fprintf(m_out, "# step rate[Hz] polls/s driver[ms/poll] server[ms/poll] p50[ms] p95[ms] p99[ms] max[ms] rss[kB] kept\n");
+	}
+
+	// The driver must neither read nor overwrite the configuration of the
+	// user running the benchmark
+	strcpy(m_configDir, "/tmp/bench_indi.XXXXXX");
+	if ( mkdtemp(m_configDir) == nullptr ) {
+		fprintf(stderr, "Could not create a configuration directory: %s\n", strerror(errno));
+		m_configDir[0] = '\0';
+		return false;
+	}
+	std::string config = std::string(m_configDir) + "/config.xml";
+	setenv("INDICONFIG", config.c_str(), 1);
+
+	std::string devicePort = std::to_string(m_options.devicePort);
+	std::string serverPort = std::to_string(m_options.serverPort);
+	m_simulator = spawn({m_options.simulator, "-t", "-p", devicePort.c_str()});
+	int probe = connectTo(m_options.devicePort, 5);
+	if ( probe < 0 ) {
+		fprintf(stderr, "Simulator does not answer on port %d\n", m_options.devicePort);
+		return false;
+	}
+	close(probe);
+	m_server = spawn({m_options.indiserver, "-p", serverPort.c_str(), "-r", "0", m_options.driver});
+	m_begin = Clock::now();
+
+	m_clients.resize(m_options.clients);
+	for (Client &client : m_clients) {
+		client.fd = connectTo(m_options.serverPort, 10);
+		if ( client.fd < 0 || ! sendAll(client.fd, "<getProperties version='1.7'/>\n") ) {
+			fprintf(stderr, "Could not attach to indiserver on port %d\n", m_options.serverPort);
+			return false;
+		}
+	}
+	for (int i = 0; i < 50 && m_driver < 0; i++) {
+		m_driver = findChild(m_server);
+		usleep(100000);
+	}
+	if ( m_driver < 0 ) {
+		fprintf(stderr, "Driver did not start\n");
+		return false;
+	}
+	return setup();
+}
+
+// Connects the device with the cache off, so every poll is a fetch, and
+// waits for its first update
+bool Bench::setup() {
+	// Properties are only defined once indiserver asked the driver for them
+	receive(Clock::now() + std::chrono::seconds(2), nullptr);
+	char url[128];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/cgi-bin/cgiLastData", m_options.devicePort);
+	std::string commands = "<newTextVector device='" + std::string(m_options.device) + "' name='CWS_ADDRESS'>"
+		"<oneText name='ADDRESS'>" + url + "</oneText></newTextVector>\n";
+	commands += newNumber(m_options, "CWS_FETCH_CACHE", "TTL", 0);
+	commands += newNumber(m_options, "CWS_FAST_POLL", "PERIOD", 1);
+	commands += "<newSwitchVector device='" + std::string(m_options.device) + "' name='CONNECTION'>"
+		"<oneSwitch name='CONNECT'>On</oneSwitch></newSwitchVector>\n";
+	if ( ! sendAll(m_clients[0].fd, commands) ) {
+		fprintf(stderr, "Lost indiserver\n");
+		return false;
+	}
+	auto deadline = Clock::now() + std::chrono::seconds(30);
+	while ( m_clients[0].updates == 0 && Clock::now() < deadline ) {
+		receive(Clock::now() + std::chrono::milliseconds(100), nullptr);
+	}
+	if ( m_clients[0].updates == 0 ) {
+		fprintf(stderr, "Device %s did not connect\n", m_options.device);
+		return false;
+	}
+	return true;
+}
+
+void Bench::receive(Clock::time_point deadline, std::vector<double> *latencies) {
+	std::vector<struct pollfd> fds(m_clients.size());
+	std::vector<double> stamps;
+	char buf[65536];
+	for (;;) {
+		auto now = Clock::now();
+		if ( now >= deadline ) {
+			return;
+		}
+		if ( now - m_lastRss >= std::chrono::seconds(1) ) {
+			sampleRss(std::chrono::duration<double>(now - m_begin).count());
+			m_lastRss = now;
+		}
+		for (size_t i = 0; i < m_clients.size(); i++) {
+			fds[i].fd = m_clients[i].fd;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+		int timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+		if ( poll(fds.data(), fds.size(), std::min(timeout, 1000) + 1) <= 0 ) {
+			continue;
+		}
+		for (size_t i = 0; i < m_clients.size(); i++) {
+			if ( ! ( fds[i].revents & ( POLLIN | POLLHUP | POLLERR ) ) ) {
+				continue;
+			}
+			Client &client = m_clients[i];
+			ssize_t n = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if ( n <= 0 ) {
+				continue;
+			}
+			client.in.append(buf, n);
+			stamps.clear();
+			parseUpdates(client, stamps);
+			if ( latencies == nullptr || stamps.empty() ) {
+				continue;
+			}
+			double received = stampNow();
+			for (double stamp : stamps) {
+				latencies->push_back(fmod(received - stamp + STAMP_WRAP, STAMP_WRAP));
+			}
+		}
+	}
+}
+
+void Bench::sampleRss(double elapsed) {
+	if ( m_out == nullptr ) {
+		return;
+	}
+	fprintf(m_out, "rss %.0f %ld %ld\n", elapsed, readUsage(m_driver).rss, readUsage(m_server).rss);
+	fflush(m_out);
+}
+
+bool Bench::measure(double rate, double seconds) {
+	if ( ! sendAll(m_clients[0].fd, newNumber(m_options, "CWS_FAST_POLL", "PERIOD", 1 / rate)) ) {
+		return false;
+	}
+	// The first second settles the new rate
+	receive(Clock::now() + std::chrono::seconds(1), nullptr);
+
+	std::vector<double> latencies;
+	uint64_t updates = m_clients[0].updates;
+	Usage driver = readUsage(m_driver);
+	Usage server = readUsage(m_server);
+	auto begin = Clock::now();
+	receive(begin + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds)), &latencies);
+	double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+	updates = m_clients[0].updates - updates;
+	Usage driverEnd = readUsage(m_driver);
+	Usage serverEnd = readUsage(m_server);
+
+	std::sort(latencies.begin(), latencies.end());
+	double achieved = updates / elapsed;
+	double driverCpu = updates > 0 ? (driverEnd.cpu - driver.cpu) * 1000 / updates : 0;
+	double serverCpu = updates > 0 ? (serverEnd.cpu - server.cpu) * 1000 / updates : 0;
+	double p99 = percentile(latencies, 99);
+	bool kept = achieved >= rate * 0.9 && p99 <= m_options.latencyBound && ! latencies.empty();
+	if ( kept ) {
+		m_maxRate = achieved;
+	}
+	const char *format = "%9.0f %9.1f %11.3f %11.3f %8.2f %8.2f %8.2f %8.2f %9ld %s\n";
+	printf(format, rate, achieved, driverCpu, serverCpu, percentile(latencies, 50), percentile(latencies, 95), p99,
+			latencies.empty() ? 0 : latencies.back(), driverEnd.rss, kept ? "yes" : "no");
+	fflush(stdout);
+	if ( m_out != nullptr ) {
+		fprintf(m_out, "step ");
+		fprintf(m_out, format, rate, achieved, driverCpu, serverCpu, percentile(latencies, 50), percentile(latencies, 95),
+				p99, latencies.empty() ? 0 : latencies.back(), driverEnd.rss, kept ? "yes" : "no");
+		fflush(m_out);
+	}
+	return kept;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-c clients] [-r rate] [-m rate] [-t seconds] [-L ms] [-o file]\n"
+			"       [-i indiserver] [-d driver] [-s simulator] [-D device] [-p port] [-P port]\n", name);
+	fprintf(stderr, "  -r  first polling rate in Hz, doubled each step up to -m\n");
+	fprintf(stderr, "  -L  p99 latency a rate is still sustained with, default 250 ms\n");
+	fprintf(stderr, "  -o  also write the steps and RSS once a second to file\n");
+	fprintf(stderr, "  -p  port of indiserver, -P of the simulator\n");
+}
+
+int main(int argc, char *argv[]) {
+	Options options;
+	int opt;
+	while ( (opt = getopt(argc, argv, "c:r:m:t:L:o:i:d:s:D:p:P:")) != -1 ) {
+		switch ( opt ) {
+			case 'c':
+				options.clients = atoi(optarg);
+				break;
+			case 'r':
+				options.start = atof(optarg);
+				break;
+			case 'm':
+				options.max = atof(optarg);
+				break;
+			case 't':
+				options.step = atof(optarg);
+				break;
+			case 'L':
+				options.latencyBound = atof(optarg);
+				break;
+			case 'o':
+				options.output = optarg;
+				break;
+			case 'i':
+				options.indiserver = optarg;
+				break;
+			case 'd':
+				options.driver = optarg;
+				break;
+			case 's':
+				options.simulator = optarg;
+				break;
+			case 'D':
+				options.device = optarg;
+				break;
+			case 'p':
+				options.serverPort = atoi(optarg);
+				break;
+			case 'P':
+				options.devicePort = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if ( optind != argc || options.clients <= 0 || options.start <= 0 || options.step <= 0 ) {
+		usage(argv[0]);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	Bench bench(options);
+	if ( ! bench.start() ) {
+		return 1;
+	}
+	printf("%9s %9s %11s %11s %8s %8s %8s %8s %9s %s\n", "rate[Hz]", "polls/s", "driver[ms]", "server[ms]",
+			"p50[ms]", "p95[ms]", "p99[ms]", "max[ms]", "rss[kB]", "kept up");
+	for (double rate = options.start; rate <= options.max; rate *= 2) {
+		if ( ! bench.measure(rate, options.step) ) {
+			break;
+		}
+	}
+	printf("Max sustained rate: %.1f polls/s with %d client%s\n", bench.getMaxRate(), options.clients,
+			options.clients == 1 ? "" : "s");
+	return 0;
+}
@@ -0,0 +1,139 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Plays a capture back through the replay transport and the decoder as
+// fast as they go. Reports the throughput, with -d also every decoded
+// sample as CSV, so the results of two builds can be compared with diff.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <parser.h>
+#include <transport.h>
+#include <unistd.h>
+#include <vector>
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-d] [-c] [-r rounds] capture\n", name);
+	fprintf(stderr, "  -d  print every decoded sample as CSV\n");
+	fprintf(stderr, "  -c  decode the critical fields only\n");
+	fprintf(stderr, "  -r  play the capture this many times, default 1\n");
+}
+
+static void printValue(double value) {
+	if ( std::isnan(value) ) {
+		printf(",");
+	} else {
+		printf(",%g", value);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	bool dump = false;
+	DecodeScope scope = DECODE_ALL;
+	int rounds = 1;
+	int opt;
+	while ( ( opt = getopt(argc, argv, "dcr:") ) != -1 ) {
+		switch (opt) {
+			case 'd':
+				dump = true;
+				break;
+			case 'c':
+				scope = DECODE_CRITICAL;
+				break;
+			case 'r':
+				rounds = std::max(1, atoi(optarg));
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if ( optind + 1 != argc ) {
+		usage(argv[0]);
+		return 1;
+	}
+	const char *path = argv[optind];
+
+	CaptureReader capture;
+	std::string error;
+	if ( ! capture.open(path, error) ) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	size_t bytes = 0;
+	for (size_t i = 0; i < capture.size(); i++) {
+		bytes += capture[i].length;
+	}
+
+	ReplayTransport transport;
+	transport.setSpeed(0);
+	CloudwatcherData data;
+	PayloadSchema schema;
+	CloudwatcherParser parser;
+	std::vector<double> latencies;
+	latencies.reserve(capture.size() * rounds);
+	size_t decoded = 0;
+	size_t failed = 0;
+	if ( dump ) {
+		printf("index,ok,date,safe,switch,clouds,temp,wind,gust,rain,lightmpsas,hum,dewp,rawir,abspress,relpress\n");
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++) {
+		if ( ! transport.load(path, error) ) {
+			fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		for (size_t i = 0; i < capture.size(); i++) {
+			auto begin = std::chrono::steady_clock::now();
+			data.clear();
+			parser.reset(&data, scope, nullptr, &schema);
+			bool ok = transport.get("", parser, error, transport.cancelToken()) && parser.finish();
+			latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+			ok ? decoded++ : failed++;
+			if ( dump && round == 0 ) {
+				printf("%zu,%d,%s,%d,%d", i, ok ? 1 : 0, ok ? data.date.c_str() : "", ok && data.safe ? 1 : 0, ok ? data.sw : 0);
+				for (double value : {data.clouds, data.temp, data.wind, data.gust, data.rain, data.lightmpsas,
+						data.hum, data.dewp, data.rawir, data.abspress, data.relpress}) {
+					printValue(ok ? value : NAN);
+				}
+				printf("\n");
+			}
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if ( latencies.empty() ) {
+		fprintf(stderr, "%s holds no payloads\n", path);
+		return 1;
+	}
+	std::sort(latencies.begin(), latencies.end());
+	fprintf(dump ? stderr : stdout, "%zu payloads (%zu decoded, %zu failed) in %.3f s: %.0f payloads/s, %.1f MB/s, "
+			"p50 %.2f us, p99 %.2f us, %.1f%% by layout\n",
+			latencies.size(), decoded, failed, seconds, latencies.size() / seconds, bytes * rounds / seconds / 1e6,
+			latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100],
+			schema.hits + schema.misses > 0 ? 100. * schema.hits / (schema.hits + schema.misses) : 0.);
+	return 0;
+}
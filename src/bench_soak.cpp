@@ -0,0 +1,190 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Soaks the transport and decoder with back-to-back polls, e.g. against
+// cws_simulator with faults injected, and fails if resources or latency
+// keep growing. Every window of polls is sampled for RSS, heap in use,
+// allocations per poll, open descriptors and poll latency. The connection
+// is dropped and a request aborted at fixed intervals, so reconnects and
+// cancellations are soaked as well.
+//
+//   cws_simulator -s reset -e 1 &
+//   bench_soak -n 2000000 http://127.0.0.1:8080/cgi-bin/cgiLastData
+//
+// Allocations are only counted when configured with --enable-alloc-count.
+
+#include <algorithm>
+#include <alloccount.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <parser.h>
+#include <soak.h>
+#include <transport.h>
+#include <unistd.h>
+#include <vector>
+
+struct Options {
+	long cycles = 1000000;
+	long window = 10000;
+	long reconnect = 1000;
+	long abort = 997;
+	const char *transport = "native";
+	// Growth tolerated from the first to the last third of the run
+	double rssKB = 1024;
+	double heapKB = 256;
+	double latency = 25;
+};
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-n polls] [-w polls] [-r polls] [-a polls] [-t curl|native]\n"
+			"       [-m kB] [-h kB] [-l percent] URL\n", name);
+	fprintf(stderr, "  -w  polls per sample, default 10000\n");
+	fprintf(stderr, "  -r  drop the connection every that many polls, -a abort a request\n");
+	fprintf(stderr, "  -m  RSS and -h heap growth tolerated, default 1024 and 256 kB\n");
+	fprintf(stderr, "  -l  latency growth tolerated, default 25%% but at least 1 ms\n");
+}
+
+int main(int argc, char *argv[]) {
+	Options options;
+	int opt;
+	while ( (opt = getopt(argc, argv, "n:w:r:a:t:m:h:l:")) != -1 ) {
+		switch ( opt ) {
+			case 'n':
+				options.cycles = atol(optarg);
+				break;
+			case 'w':
+				options.window = atol(optarg);
+				break;
+			case 'r':
+				options.reconnect = atol(optarg);
+				break;
+			case 'a':
+				options.abort = atol(optarg);
+				break;
+			case 't':
+				options.transport = optarg;
+				break;
+			case 'm':
+				options.rssKB = atof(optarg);
+				break;
+			case 'h':
+				options.heapKB = atof(optarg);
+				break;
+			case 'l':
+				options.latency = atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if ( optind + 1 != argc || options.cycles <= 0 || options.window <= 0 ) {
+		usage(argv[0]);
+		return 1;
+	}
+	const char *url = argv[optind];
+
+	std::unique_ptr<Transport> transport;
+	if ( strcmp(options.transport, "curl") == 0 ) {
+		transport = std::make_unique<CurlTransport>();
+	} else {
+		transport = std::make_unique<HttpTransport>();
+	}
+	// Polled like the driver does, into a reused sample with the learned
+	// layout
+	CloudwatcherParser parser;
+	CloudwatcherData data;
+	PayloadSchema schema;
+	std::string raw;
+	std::string error;
+	std::vector<double> latencies;
+	latencies.reserve(options.window);
+	std::vector<SoakSample> samples;
+	std::vector<struct pollfd> fds;
+
+	printf("%10s %9s %9s %11s %5s %9s %9s %7s\n", "polls", "rss[kB]", "heap[kB]", "allocs/poll", "fds",
+			"mean[ms]", "p99[ms]", "failed");
+	long failed = 0;
+	uint64_t allocations = threadAllocations();
+	for (long cycle = 1; cycle <= options.cycles; cycle++) {
+		if ( options.reconnect > 0 && cycle % options.reconnect == 0 ) {
+			transport->reset();
+		}
+		data.clear();
+		parser.reset(&data, DECODE_ALL, &raw, &schema);
+		auto start = std::chrono::steady_clock::now();
+		if ( options.abort > 0 && cycle % options.abort == 0 ) {
+			// Started and dropped before it completes, like a disconnect
+			if ( transport->start(url, parser, error, transport->cancelToken()) ) {
+				fds.clear();
+				int timeout = -1;
+				transport->collect(fds, timeout);
+				transport->abort();
+			}
+		} else if ( ! transport->get(url, parser, error, transport->cancelToken()) || ! parser.finish() ) {
+			failed++;
+		}
+		latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+		if ( cycle % options.window != 0 && cycle != options.cycles ) {
+			continue;
+		}
+		SoakSample sample;
+		sample.cycles = cycle;
+		sample.rss = soakStatusKB("VmRSS:");
+		sample.heap = soakHeapKB();
+		sample.allocations = static_cast<double>(threadAllocations() - allocations) / latencies.size();
+		sample.fds = soakOpenFds();
+		double sum = 0;
+		for (double latency : latencies) {
+			sum += latency;
+		}
+		sample.mean = sum / latencies.size();
+		std::sort(latencies.begin(), latencies.end());
+		sample.p99 = latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+		sample.failed = failed;
+		samples.push_back(sample);
+		printf("%10ld %9.0f %9.0f %11.2f %5.0f %9.3f %9.3f %7ld\n", sample.cycles, sample.rss, sample.heap,
+				sample.allocations, sample.fds, sample.mean, sample.p99, sample.failed);
+		fflush(stdout);
+		latencies.clear();
+		failed = 0;
+		allocations = threadAllocations();
+	}
+
+	if ( samples.size() < 6 ) {
+		fprintf(stderr, "Too few samples to look for trends, lower -w\n");
+		return 1;
+	}
+	printf("\n");
+	bool growing = false;
+	growing |= soakGrows(stdout, samples, &SoakSample::rss, "rss[kB]", options.rssKB, false);
+	growing |= soakGrows(stdout, samples, &SoakSample::heap, "heap[kB]", options.heapKB, false);
+	growing |= soakGrows(stdout, samples, &SoakSample::allocations, "allocs/poll", 0.5, false);
+	growing |= soakGrows(stdout, samples, &SoakSample::fds, "fds", 0.5, false);
+	growing |= soakGrows(stdout, samples, &SoakSample::mean, "mean[ms]", options.latency, true);
+	growing |= soakGrows(stdout, samples, &SoakSample::p99, "p99[ms]", options.latency, true);
+	printf("%s\n", growing ? "FAILED" : "PASSED");
+	return growing ? 1 : 0;
+}
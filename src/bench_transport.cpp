@@ -0,0 +1,153 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Compares the transports against a device or simulator. Every transport is
+// measured in a fresh process so startup cost and memory are not shared.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <transport.h>
+#include <unistd.h>
+#include <vector>
+
+static long readStatusKB(const char *key) {
+	FILE *fp = fopen("/proc/self/status", "r");
+	if ( fp == nullptr ) {
+		return -1;
+	}
+	char line[256];
+	long value = -1;
+	size_t len = strlen(key);
+	while ( fgets(line, sizeof(line), fp) != nullptr ) {
+		if ( strncmp(line, key, len) == 0 ) {
+			value = strtol(line + len, nullptr, 10);
+			break;
+		}
+	}
+	fclose(fp);
+	return value;
+}
+
+static double cpuSeconds() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static int run(const char *name, const char *url, int polls) {
+	auto start = std::chrono::steady_clock::now();
+	std::unique_ptr<Transport> transport;
+	if ( strcmp(name, "native") == 0 ) {
+		transport = std::make_unique<HttpTransport>();
+	} else {
+		transport = std::make_unique<CurlTransport>();
+	}
+
+	std::string body;
+	StringSink sink(body);
+	std::string error;
+	if ( ! transport->get(url, sink, error, transport->cancelToken()) ) {
+		fprintf(stderr, "%s: %s\n", name, error.c_str());
+		return 1;
+	}
+	double startup = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	std::vector<double> latencies;
+	latencies.reserve(polls);
+	int failures = 0;
+	double cpu = cpuSeconds();
+	for (int i = 0; i < polls; i++) {
+		auto t0 = std::chrono::steady_clock::now();
+		if ( ! transport->get(url, sink, error, transport->cancelToken()) ) {
+			failures++;
+			continue;
+		}
+		latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+	}
+	cpu = cpuSeconds() - cpu;
+
+	double mean = 0;
+	for (double l : latencies) {
+		mean += l;
+	}
+	mean = latencies.empty() ? 0 : mean / latencies.size();
+	std::sort(latencies.begin(), latencies.end());
+	double p95 = latencies.empty() ? 0 : latencies[(latencies.size() * 95) / 100];
+
+	printf("%-8s %10.2f %9ld %9ld %12.1f %9.3f %9.3f %8d\n", name, startup,
+			readStatusKB("VmRSS:"), readStatusKB("VmHWM:"), cpu * 1e6 / polls, mean, p95, failures);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int polls = 1000;
+	const char *only = nullptr;
+	int opt;
+	while ( (opt = getopt(argc, argv, "n:t:")) != -1 ) {
+		switch ( opt ) {
+			case 'n':
+				polls = atoi(optarg);
+				break;
+			case 't':
+				only = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n polls] [-t curl|native] URL\n", argv[0]);
+				return 1;
+		}
+	}
+	if ( optind >= argc || polls <= 0 ) {
+		fprintf(stderr, "Usage: %s [-n polls] [-t curl|native] URL\n", argv[0]);
+		return 1;
+	}
+	const char *url = argv[optind];
+
+	if ( only != nullptr ) {
+		return run(only, url, polls);
+	}
+
+	printf("%-8s %10s %9s %9s %12s %9s %9s %8s\n", "transport", "start[ms]", "rss[kB]",
+			"peak[kB]", "cpu/poll[us]", "mean[ms]", "p95[ms]", "failed");
+	fflush(stdout);
+	int rc = 0;
+	for (const char *name : {"curl", "native"}) {
+		pid_t pid = fork();
+		if ( pid == 0 ) {
+			char count[32];
+			snprintf(count, sizeof(count), "%d", polls);
+			execl("/proc/self/exe", argv[0], "-n", count, "-t", name, url, (char *)nullptr);
+			_exit(127);
+		}
+		int status = 0;
+		waitpid(pid, &status, 0);
+		if ( ! WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+			rc = 1;
+		}
+	}
+	return rc;
+}
@@ -0,0 +1,181 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <capture.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr size_t INITIAL_CAPACITY = 1 << 20;
+
+static size_t padded(size_t length) {
+	return (length + 7) & ~static_cast<size_t>(7);
+}
+
+CaptureWriter::~CaptureWriter() {
+	close();
+}
+
+// A new capture every time, an old one at path is replaced
+bool CaptureWriter::open(const std::string &path, std::string &error) {
+	close();
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if ( m_fd < 0 ) {
+		error = "Could not open " + path + ": " + strerror(errno);
+		return false;
+	}
+	if ( ! grow(INITIAL_CAPACITY) ) {
+		error = "Could not map " + path + ": " + strerror(errno);
+		::close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+	CaptureHeader *header = reinterpret_cast<CaptureHeader *>(m_map);
+	memcpy(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+	header->version = CAPTURE_VERSION;
+	header->end = sizeof(CaptureHeader);
+	m_path = path;
+	return true;
+}
+
+void CaptureWriter::close() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if ( m_fd < 0 ) {
+		return;
+	}
+	size_t end = reinterpret_cast<CaptureHeader *>(m_map)->end;
+	munmap(m_map, m_capacity);
+	m_map = nullptr;
+	m_capacity = 0;
+	if ( ftruncate(m_fd, end) != 0 ) {
+		// Still readable, the rest is past end
+	}
+	::close(m_fd);
+	m_fd = -1;
+}
+
+bool CaptureWriter::running() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_fd >= 0;
+}
+
+bool CaptureWriter::grow(size_t size) {
+	if ( ftruncate(m_fd, size) != 0 ) {
+		return false;
+	}
+	void *map = m_map == nullptr ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0) :
+			mremap(m_map, m_capacity, size, MREMAP_MAYMOVE);
+	if ( map == MAP_FAILED ) {
+		return false;
+	}
+	m_map = static_cast<char *>(map);
+	m_capacity = size;
+	return true;
+}
+
+// Writing is a copy into the page cache, the kernel takes it to disk
+void CaptureWriter::add(double time, double latency, bool ok, const std::string &body) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if ( m_fd < 0 ) {
+		return;
+	}
+	CaptureHeader *header = reinterpret_cast<CaptureHeader *>(m_map);
+	size_t end = header->end;
+	size_t need = end + sizeof(CaptureEntry) + padded(body.size());
+	if ( need > m_capacity ) {
+		size_t capacity = m_capacity;
+		while ( capacity < need ) {
+			capacity *= 2;
+		}
+		if ( ! grow(capacity) ) {
+			return;
+		}
+		header = reinterpret_cast<CaptureHeader *>(m_map);
+	}
+	CaptureEntry entry;
+	entry.time = time;
+	entry.latency = latency;
+	entry.length = body.size();
+	entry.ok = ok ? 1 : 0;
+	memcpy(m_map + end, &entry, sizeof(entry));
+	memcpy(m_map + end + sizeof(entry), body.data(), body.size());
+	header->end = need;
+}
+
+CaptureReader::~CaptureReader() {
+	close();
+}
+
+bool CaptureReader::open(const std::string &path, std::string &error) {
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if ( fd < 0 ) {
+		error = "Could not open " + path + ": " + strerror(errno);
+		return false;
+	}
+	struct stat st;
+	if ( fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CaptureHeader) ) {
+		::close(fd);
+		error = path + " is no capture";
+		return false;
+	}
+	m_mapSize = st.st_size;
+	m_map = mmap(nullptr, m_mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if ( m_map == MAP_FAILED ) {
+		m_map = nullptr;
+		error = "Could not map " + path + ": " + strerror(errno);
+		return false;
+	}
+
+	const char *data = static_cast<const char *>(m_map);
+	const CaptureHeader *header = static_cast<const CaptureHeader *>(m_map);
+	if ( memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 || header->version != CAPTURE_VERSION ) {
+		close();
+		error = path + " is no capture";
+		return false;
+	}
+	size_t end = std::min<size_t>(header->end, m_mapSize);
+	size_t pos = sizeof(CaptureHeader);
+	while ( pos + sizeof(CaptureEntry) <= end ) {
+		CaptureEntry entry;
+		memcpy(&entry, data + pos, sizeof(entry));
+		if ( pos + sizeof(entry) + entry.length > end ) {
+			break;
+		}
+		m_entries.push_back({entry.time, entry.latency, entry.ok != 0, data + pos + sizeof(entry), entry.length});
+		pos += sizeof(entry) + padded(entry.length);
+	}
+	return true;
+}
+
+void CaptureReader::close() {
+	if ( m_map != nullptr ) {
+		munmap(m_map, m_mapSize);
+		m_map = nullptr;
+	}
+	m_entries.clear();
+}
@@ -0,0 +1,99 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Log of every payload fetched from the device with its timing, for
+// ReplayTransport. A header followed by entries, each an entry header and
+// the body padded to 8 bytes. end in the header only moves past an entry
+// once it is complete, so a capture cut short by a crash stays readable.
+struct CaptureHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t end;
+};
+
+struct CaptureEntry {
+	// Seconds since the epoch when the request was started
+	double time;
+	// Seconds until the transfer finished
+	double latency;
+	uint32_t length;
+	// 0 if the transfer failed, the body is the error then
+	uint32_t ok;
+};
+
+#define CAPTURE_MAGIC "CWSCAPT"
+#define CAPTURE_VERSION 1u
+
+// Appends to a memory mapped file that grows as needed
+class CaptureWriter {
+	public:
+		~CaptureWriter();
+
+		bool open(const std::string &path, std::string &error);
+		// Cuts the file to what was captured
+		void close();
+		bool running();
+
+		// Single writer, only waits for a concurrent open() or close()
+		void add(double time, double latency, bool ok, const std::string &body);
+
+	private:
+		bool grow(size_t size);
+
+		std::mutex m_mutex;
+		int m_fd = -1;
+		char *m_map = nullptr;
+		size_t m_capacity = 0;
+		std::string m_path;
+};
+
+// Maps a capture read-only and indexes its entries
+class CaptureReader {
+	public:
+		struct Payload {
+			double time;
+			double latency;
+			bool ok;
+			const char *body;
+			size_t length;
+		};
+
+		~CaptureReader();
+
+		bool open(const std::string &path, std::string &error);
+		void close();
+
+		size_t size() const { return m_entries.size(); }
+		const Payload &operator[](size_t index) const { return m_entries[index]; }
+
+	private:
+		void *m_map = nullptr;
+		size_t m_mapSize = 0;
+		std::vector<Payload> m_entries;
+};
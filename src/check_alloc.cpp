@@ -0,0 +1,239 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Polls cws_simulator through the fetch loop, both transports and the
+// decoder the way the driver does, then with a whole device publishing to
+// shared memory, metrics and an export sink. Fails if a poll still
+// allocates once buffers, the sample and the payload layout have settled.
+// On the INDI thread the library allocates itself, e.g. when it syncs the
+// critical parameters, so that thread is only reported. Only counts with
+// --enable-alloc-count and is skipped otherwise.
+
+#include <alloccount.h>
+#include <appendf.h>
+#include <checksim.h>
+#include <clock.h>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cw.h>
+#include <cwshm.h>
+#include <fcntl.h>
+#include <fetchloop.h>
+#include <indidevapi.h>
+#include <mutex>
+#include <parser.h>
+#include <string>
+#include <transport.h>
+#include <unistd.h>
+
+static constexpr int WARMUP = 20;
+static constexpr int POLLS = 500;
+static const char *DEVICE = "Check Alloc";
+
+// Polls back to back into a reused sample with the learned layout, the
+// allocations are counted on the loop thread from the end of the warmup
+class PollClient : public FetchClient {
+	public:
+		PollClient(Transport *transport, const std::string &url) : m_transport(transport), m_url(url) {}
+
+		Transport *startFetch(std::chrono::steady_clock::time_point &wakeAt) override {
+			if ( m_polls >= WARMUP + POLLS ) {
+				return nullptr;
+			}
+			m_data.clear();
+			m_parser.reset(&m_data, DECODE_ALL, &m_raw, &m_schema);
+			if ( m_transport->start(m_url.c_str(), m_parser, m_error, m_transport->cancelToken()) ) {
+				return m_transport;
+			}
+			finishFetch(false, m_error);
+			wakeAt = DriverClock::get().now();
+			return nullptr;
+		}
+
+		void finishFetch(bool ok, const std::string &error) override {
+			if ( ! ok || ! m_parser.finish() ) {
+				fprintf(stderr, "Poll failed: %s\n", ok ? m_parser.getError() : error.c_str());
+				m_failed++;
+			}
+			if ( ++m_polls == WARMUP ) {
+				m_start = threadAllocations();
+			} else if ( m_polls == WARMUP + POLLS ) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_allocations = threadAllocations() - m_start;
+				m_done = true;
+				m_cond.notify_all();
+			}
+		}
+
+		bool wait(std::chrono::seconds timeout) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			return m_cond.wait_for(lock, timeout, [this]{ return m_done; });
+		}
+
+		int getFailed() const { return m_failed; }
+		uint64_t getAllocations() const { return m_allocations; }
+
+	private:
+		Transport *m_transport;
+		std::string m_url;
+		CloudwatcherParser m_parser;
+		CloudwatcherData m_data;
+		PayloadSchema m_schema;
+		std::string m_raw;
+		std::string m_error;
+		int m_polls = 0;
+		int m_failed = 0;
+		uint64_t m_start = 0;
+		uint64_t m_allocations = 0;
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		bool m_done = false;
+};
+
+static bool pollTransports(const CheckSimulator &simulator) {
+	CurlTransport curl;
+	HttpTransport native;
+	bool failed = false;
+	for (Transport *transport : {static_cast<Transport *>(&curl), static_cast<Transport *>(&native)}) {
+		PollClient client(transport, simulator.getUrl());
+		FetchLoop::instance().add(&client, "check_alloc");
+		bool done = client.wait(std::chrono::seconds(60));
+		FetchLoop::instance().remove(&client);
+		printf("%-8s %s, %d failed, %llu allocations in %d polls after warmup\n", transport->getName(),
+				done ? "done" : "timed out", client.getFailed(),
+				static_cast<unsigned long long>(client.getAllocations()), POLLS);
+		failed = failed || ! done || client.getFailed() > 0 || client.getAllocations() > 0;
+	}
+	return ! failed;
+}
+
+static void setText(CloudwatcherSolo &device, const char *property, const char *element, const char *value) {
+	char *texts[] = {const_cast<char *>(value)};
+	char *names[] = {const_cast<char *>(element)};
+	device.ISNewText(DEVICE, property, texts, names, 1);
+}
+
+static void setNumber(CloudwatcherSolo &device, const char *property, const char *element, double value) {
+	double values[] = {value};
+	char *names[] = {const_cast<char *>(element)};
+	device.ISNewNumber(DEVICE, property, values, names, 1);
+}
+
+static void setSwitch(CloudwatcherSolo &device, const char *property, const char *element) {
+	ISState states[] = {ISS_ON};
+	char *names[] = {const_cast<char *>(element)};
+	device.ISNewSwitch(DEVICE, property, states, names, 1);
+}
+
+// Runs the INDI loop until the device published that many samples in all
+static uint64_t pumpUntil(CwsShmReader &reader, uint64_t samples) {
+	auto until = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+	CwsShmSample sample;
+	uint64_t published = 0;
+	int never = 0;
+	while ( published < samples && std::chrono::steady_clock::now() < until ) {
+		IEDeferLoop(10, &never);
+		if ( reader.isOpen() || reader.open(DEVICE) ) {
+			published = reader.read(sample);
+		}
+	}
+	return published;
+}
+
+// Both lanes of a device, the fetch loop handing samples to the INDI loop,
+// shared memory, metrics and the recorder. The fetch loop and recorder
+// threads are what the process allocated besides this one.
+static bool pollDriver(const CheckSimulator &simulator) {
+	char tmp[] = "/tmp/check_alloc.XXXXXX";
+	if ( mkdtemp(tmp) == nullptr ) {
+		perror("mkdtemp");
+		return false;
+	}
+	std::string config = std::string(tmp) + "/config.xml";
+	setenv("INDICONFIG", config.c_str(), 1);
+	// The property updates would fill the log
+	fflush(stdout);
+	int out = dup(STDOUT_FILENO);
+	int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	dup2(null, STDOUT_FILENO);
+	close(null);
+
+	bool failed = false;
+	std::string report;
+	shm_unlink(cwsShmName(DEVICE).c_str());
+	{
+		CloudwatcherSolo device(DEVICE);
+		device.ISGetProperties(nullptr);
+		setText(device, "CWS_ADDRESS", "ADDRESS", simulator.getUrl().c_str());
+		// Nobody listens there, the datagrams are still formatted and sent
+		setText(device, "CWS_EXPORT", "UDP", "127.0.0.1:9");
+		setNumber(device, "CWS_FAST_POLL", "PERIOD", 0.02);
+		setNumber(device, "CWS_FETCH_CACHE", "TTL", 0);
+		setNumber(device, "WEATHER_UPDATE", "PERIOD", 1);
+		setSwitch(device, "CWS_SHM", "SHM_ON");
+		// The segment and its count carry over from one connection to the next
+		CwsShmReader reader;
+		for (const char *transport : {"CURL", "NATIVE"}) {
+			setSwitch(device, "CWS_TRANSPORT", transport);
+			setSwitch(device, "CONNECTION", "CONNECT");
+			uint64_t base = pumpUntil(reader, 1);
+			uint64_t start = pumpUntil(reader, base + WARMUP);
+			uint64_t indi = threadAllocations();
+			uint64_t allocations = processAllocations();
+			uint64_t published = pumpUntil(reader, start + POLLS) - start;
+			indi = threadAllocations() - indi;
+			allocations = processAllocations() - allocations - indi;
+			setSwitch(device, "CONNECTION", "DISCONNECT");
+			bool done = start >= base + WARMUP && published >= POLLS;
+			appendf(report, "device %-6s %s, %llu allocations in %llu polls after warmup, %llu by INDI\n",
+					transport, done ? "done" : "timed out", static_cast<unsigned long long>(allocations),
+					static_cast<unsigned long long>(published), static_cast<unsigned long long>(indi));
+			failed = failed || ! done || allocations > 0;
+		}
+	}
+	shm_unlink(cwsShmName(DEVICE).c_str());
+	unlink(config.c_str());
+	rmdir(tmp);
+
+	fflush(stdout);
+	dup2(out, STDOUT_FILENO);
+	close(out);
+	printf("%s", report.c_str());
+	return ! failed;
+}
+
+int main() {
+#ifndef CWS_ALLOC_COUNT
+	printf("Configured without --enable-alloc-count, skipped\n");
+	return 77;
+#else
+	CheckSimulator simulator;
+	if ( ! simulator.start() ) {
+		return 1;
+	}
+	bool ok = pollTransports(simulator);
+	ok = pollDriver(simulator) && ok;
+	printf("%s\n", ok ? "PASSED" : "FAILED");
+	return ok ? 0 : 1;
+#endif
+}
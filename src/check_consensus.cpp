@@ -0,0 +1,131 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Votes a consensus of three units through units turning unsafe, samples
+// aging and units dropping out, on a virtual clock.
+
+#include <chrono>
+#include <clock.h>
+#include <consensus.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <indidevapi.h>
+#include <string>
+#include <unistd.h>
+
+static const char *DEVICE = "Cloudwatcher Consensus";
+static constexpr double START = 1700000000;
+static constexpr double MAX_AGE = 60;
+
+static Reading reading(bool safe) {
+	Reading reading;
+	memset(&reading, 0, sizeof(reading));
+	reading.scope = DECODE_CRITICAL;
+	reading.safe = safe;
+	reading.clouds = safe ? -30 : 0;
+	reading.wind = 5;
+	reading.gust = 8;
+	reading.rain = 3000;
+	return reading;
+}
+
+static void setNumber(ConsensusWeather &consensus, const char *element, double value) {
+	double values[] = {value};
+	char *names[] = {const_cast<char *>(element)};
+	consensus.ISNewNumber(DEVICE, "CWS_CONSENSUS", values, names, 1);
+}
+
+static bool check(const ConsensusWeather &consensus, bool safe, const char *what) {
+	if ( consensus.isSafe() != safe ) {
+		fprintf(stderr, "%s: %s instead of %s\n", what, consensus.isSafe() ? "safe" : "unsafe",
+				safe ? "safe" : "unsafe");
+		return false;
+	}
+	return true;
+}
+
+int main() {
+	char tmp[] = "/tmp/check_consensus.XXXXXX";
+	if ( mkdtemp(tmp) == nullptr ) {
+		perror("mkdtemp");
+		return 99;
+	}
+	std::string config = std::string(tmp) + "/config.xml";
+	setenv("INDICONFIG", config.c_str(), 1);
+	// The property updates would fill the log
+	if ( freopen("/dev/null", "w", stdout) == nullptr ) {
+		perror("/dev/null");
+		return 99;
+	}
+
+	VirtualClock clock(START);
+	DriverClock::install(&clock);
+	bool ok = true;
+	{
+		ConsensusWeather consensus(3);
+		consensus.ISGetProperties(nullptr);
+		setNumber(consensus, "MAX_AGE", MAX_AGE);
+		ISState states[] = {ISS_ON};
+		char *names[] = {const_cast<char *>("CONNECT")};
+		consensus.ISNewSwitch(DEVICE, "CONNECTION", states, names, 1);
+		ok &= check(consensus, false, "No unit voting");
+
+		for (size_t unit = 0; unit < 3; unit++) {
+			consensus.addSample(unit, reading(true));
+		}
+		ok &= check(consensus, true, "Every unit safe");
+
+		// Two units about to drop out can not outvote a fresh unsafe one
+		clock.advance(std::chrono::seconds(54));
+		consensus.addSample(2, reading(false));
+		ok &= check(consensus, false, "Fresh unit unsafe, old units safe");
+		consensus.addSample(0, reading(false));
+		consensus.addSample(1, reading(true));
+		consensus.addSample(2, reading(true));
+		ok &= check(consensus, false, "One of three fresh units unsafe");
+
+		// Quorum of two
+		setNumber(consensus, "VOTES", 2);
+		ok &= check(consensus, true, "One unsafe vote of the two needed");
+		consensus.addSample(1, reading(false));
+		ok &= check(consensus, false, "Two unsafe votes of the two needed");
+
+		// Units dropping out, the last one left decides alone
+		consensus.addSample(1, reading(true));
+		clock.advance(std::chrono::seconds(30));
+		consensus.addSample(2, reading(false));
+		clock.advance(std::chrono::seconds(31));
+		consensus.removeUnit(1);
+		ok &= check(consensus, false, "Only unit left unsafe");
+		consensus.addSample(2, reading(true));
+		ok &= check(consensus, true, "Only unit left safe");
+		clock.advance(std::chrono::seconds(static_cast<int>(MAX_AGE)));
+		consensus.removeUnit(0);
+		ok &= check(consensus, false, "Every unit dropped out");
+	}
+	DriverClock::install(nullptr);
+	unlink(config.c_str());
+	rmdir(tmp);
+	fprintf(stderr, "%s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
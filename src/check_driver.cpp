@@ -0,0 +1,300 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Drives a device on a virtual clock through a replayed night that turns
+// unsafe and clears again, and checks from its journal that both lanes
+// fetched on schedule and the weather status went from Idle to Ok, Alert
+// and back to Ok right with the samples that caused it. The journal only
+// commits by time, which has to follow the virtual clock as well, also
+// once the replay ended and no samples come in anymore.
+
+#include <algorithm>
+#include <capture.h>
+#include <chrono>
+#include <clock.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cw.h>
+#include <cwjournal.h>
+#include <dirent.h>
+#include <indidevapi.h>
+#include <mutex>
+#include <recorder.h>
+#include <string>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static const char *DEVICE = "Check";
+static constexpr double START = 1700000000;
+static constexpr int PAYLOADS = 60;
+static constexpr double FAST = 2;
+static constexpr double SLOW = 10;
+// Off the sample grid, so a commit made with the next sample instead of by
+// the recorder's tick comes too late
+static constexpr double COMMIT = 4.5;
+// Run on after the replay ended for the last commit
+static constexpr double TAIL = 3 * COMMIT;
+// Unsafe from the first to before the last
+static constexpr int UNSAFE_FIRST = 20;
+static constexpr int UNSAFE_LAST = 40;
+
+static bool unsafe(int i) {
+	return i >= UNSAFE_FIRST && i < UNSAFE_LAST;
+}
+
+// The fetch loop moves the clock on whenever it waits, each step gives the
+// INDI loop of the check a moment to catch up so no sample is skipped.
+// Steps are short against a tick of the recorder, so it sees a commit due
+// in time even if it misses some.
+class PacedClock : public VirtualClock {
+	public:
+		static constexpr int STEP_MS = 250;
+
+		using VirtualClock::VirtualClock;
+
+		int poll(struct pollfd *fds, nfds_t nfds, int timeout) override {
+			if ( timeout > 0 ) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}
+			return VirtualClock::poll(fds, nfds, std::min(timeout, STEP_MS));
+		}
+};
+
+// Commits of the journal, in virtual time
+static std::mutex commitMutex;
+static std::vector<double> commits;
+static bool recordCommits = false;
+
+// Takes the place of the one in libc, so the journal's commits are seen
+extern "C" int fdatasync(int fd) {
+	{
+		std::lock_guard<std::mutex> lock(commitMutex);
+		if ( recordCommits ) {
+			commits.push_back(DriverClock::get().wallTime());
+		}
+	}
+	return syscall(SYS_fdatasync, fd);
+}
+
+static std::string payload(int i, double time) {
+	time_t seconds = time;
+	struct tm tm;
+	gmtime_r(&seconds, &tm);
+	char line[128];
+	std::string body;
+	strftime(line, sizeof(line), "dataGMTTime=%Y/%m/%d %H:%M:%S\n", &tm);
+	body += line;
+	body += "cwinfo=Serial: 2180, FW: 5.89\n";
+	body += unsafe(i) ? "clouds=0.0\n" : "clouds=-30.0\n";
+	body += "temp=10.0\nwind=5\ngust=8\nrain=3000\nlightmpsas=20.50\n";
+	body += unsafe(i) ? "switch=0\nsafe=0\n" : "switch=1\nsafe=1\n";
+	body += "hum=60\ndewp=2.5\nrawir=-20.0\n";
+	return body;
+}
+
+static void setText(CloudwatcherSolo &device, const char *property, const char *element, const char *value) {
+	char *texts[] = {const_cast<char *>(value)};
+	char *names[] = {const_cast<char *>(element)};
+	device.ISNewText(DEVICE, property, texts, names, 1);
+}
+
+static void setNumber(CloudwatcherSolo &device, const char *property, const char *element, double value) {
+	double values[] = {value};
+	char *names[] = {const_cast<char *>(element)};
+	device.ISNewNumber(DEVICE, property, values, names, 1);
+}
+
+static void setSwitch(CloudwatcherSolo &device, const char *property, const char *element) {
+	ISState states[] = {ISS_ON};
+	char *names[] = {const_cast<char *>(element)};
+	device.ISNewSwitch(DEVICE, property, states, names, 1);
+}
+
+static void removeDir(const std::string &path) {
+	DIR *dir = opendir(path.c_str());
+	if ( dir == nullptr ) {
+		return;
+	}
+	while ( struct dirent *entry = readdir(dir) ) {
+		if ( strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 ) {
+			unlink((path + "/" + entry->d_name).c_str());
+		}
+	}
+	closedir(dir);
+	rmdir(path.c_str());
+}
+
+static bool check(bool ok, const char *what, int i) {
+	if ( ! ok ) {
+		fprintf(stderr, "Sample %d: %s\n", i, what);
+	}
+	return ok;
+}
+
+int main() {
+	char tmp[] = "/tmp/check_driver.XXXXXX";
+	if ( mkdtemp(tmp) == nullptr ) {
+		perror("mkdtemp");
+		return 99;
+	}
+	std::string dir = tmp;
+	std::string capture = dir + "/capture";
+	std::string journal = dir + "/journal";
+	std::string config = dir + "/config.xml";
+	setenv("INDICONFIG", config.c_str(), 1);
+	// The property updates would fill the log
+	if ( freopen("/dev/null", "w", stdout) == nullptr ) {
+		perror("/dev/null");
+		return 99;
+	}
+
+	PacedClock clock(START);
+	DriverClock::install(&clock);
+
+	std::string error;
+	CaptureWriter writer;
+	if ( ! writer.open(capture, error) ) {
+		fprintf(stderr, "Could not write capture: %s\n", error.c_str());
+		removeDir(dir);
+		return 99;
+	}
+	for (int i = 0; i < PAYLOADS; i++) {
+		writer.add(START + i * FAST, 0, true, payload(i, START + i * FAST));
+	}
+	writer.close();
+
+	{
+		CloudwatcherSolo device(DEVICE);
+		device.ISGetProperties(nullptr);
+		setText(device, "CWS_JOURNAL", "FILE", journal.c_str());
+		setNumber(device, "CWS_JOURNAL_COMMIT", "RECORDS", 100000);
+		setNumber(device, "CWS_JOURNAL_COMMIT", "SECONDS", COMMIT);
+		setText(device, "CWS_REPLAY", "FILE", capture.c_str());
+		setNumber(device, "CWS_REPLAY_SPEED", "SPEED", 1);
+		setNumber(device, "CWS_FAST_POLL", "PERIOD", FAST);
+		setNumber(device, "CWS_FETCH_CACHE", "TTL", 0);
+		setNumber(device, "WEATHER_UPDATE", "PERIOD", SLOW);
+		setSwitch(device, "CWS_SHM", "SHM_OFF");
+		setSwitch(device, "CWS_TRANSPORT", "REPLAY");
+		{
+			std::lock_guard<std::mutex> lock(commitMutex);
+			recordCommits = true;
+		}
+		setSwitch(device, "CONNECTION", "CONNECT");
+		int never = 0;
+		while ( clock.wallTime() < START + PAYLOADS * FAST + TAIL ) {
+			IEDeferLoop(10, &never);
+		}
+		{
+			// Disconnecting commits the rest
+			std::lock_guard<std::mutex> lock(commitMutex);
+			recordCommits = false;
+		}
+		setSwitch(device, "CONNECTION", "DISCONNECT");
+	}
+	DriverClock::install(nullptr);
+
+	CwsJournalReader reader;
+	CwsJournalRecord record;
+	std::vector<CwsShmSample> samples;
+	std::vector<CwsJournalEvent> events;
+	if ( ! reader.open(journal.c_str()) ) {
+		fprintf(stderr, "No journal written\n");
+		removeDir(dir);
+		return 1;
+	}
+	while ( reader.next(record) ) {
+		if ( record.type == CWS_JOURNAL_SAMPLE ) {
+			samples.push_back(record.sample);
+		} else if ( record.type == CWS_JOURNAL_EVENT ) {
+			events.push_back(record.event);
+		}
+	}
+	reader.close();
+	removeDir(dir);
+
+	bool ok = true;
+	if ( samples.size() != PAYLOADS ) {
+		fprintf(stderr, "Fetched %zu samples instead of %d\n", samples.size(), PAYLOADS);
+		ok = false;
+	}
+	for (size_t i = 0; i < samples.size() && i < PAYLOADS; i++) {
+		const CwsShmSample &sample = samples[i];
+		// The slow lane takes the place of the fast one every SLOW seconds
+		bool slow = fmod(i * FAST, SLOW) == 0;
+		ok &= check(fabs(sample.time - (START + i * FAST)) < 0.01, "fetched off schedule", i);
+		ok &= check(sample.scope == (slow ? DECODE_ALL : DECODE_CRITICAL), slow ? "not fetched by the slow lane" :
+				"not fetched by the fast lane", i);
+		ok &= check(sample.safe == ! unsafe(i), "wrong sample", i);
+	}
+
+	// Each transition is published before the next sample is fetched
+	const struct {
+		uint32_t from;
+		uint32_t to;
+		int sample;
+	} expected[] = {
+		{IPS_IDLE, IPS_OK, 0},
+		{IPS_OK, IPS_ALERT, UNSAFE_FIRST},
+		{IPS_ALERT, IPS_OK, UNSAFE_LAST}
+	};
+	size_t count = sizeof(expected) / sizeof(expected[0]);
+	if ( events.size() != count ) {
+		fprintf(stderr, "Weather status changed %zu times instead of %zu\n", events.size(), count);
+		ok = false;
+	}
+	for (size_t i = 0; i < events.size() && i < count; i++) {
+		double time = START + expected[i].sample * FAST;
+		if ( events[i].from != expected[i].from || events[i].to != expected[i].to ||
+				events[i].time < time || events[i].time >= time + FAST ) {
+			fprintf(stderr, "Transition %zu from %u to %u at %+.3f s, expected from %u to %u at %+.3f s\n", i,
+					events[i].from, events[i].to, events[i].time - START, expected[i].from, expected[i].to,
+					time - START);
+			ok = false;
+		}
+	}
+
+	// Records are committed COMMIT seconds after the first sample written
+	// since the last commit, within a tick of the recorder. The first one
+	// writes the header of the new journal, before any sample.
+	double last = START + (PAYLOADS - 1) * FAST;
+	for (size_t i = 1; i < commits.size(); i++) {
+		double first = i == 1 ? START : START + ceil((commits[i - 1] - START - 0.001) / FAST) * FAST;
+		if ( commits[i] < first + COMMIT || commits[i] > first + COMMIT + Recorder::TICK + 0.01 ) {
+			fprintf(stderr, "Journal committed at %+.3f s, expected %.1f s after the sample at %+.3f s\n",
+					commits[i] - START, COMMIT, first - START);
+			ok = false;
+		}
+	}
+	if ( commits.empty() || commits.back() < last ) {
+		fprintf(stderr, "Sample at %+.3f s not committed by time\n", last - START);
+		ok = false;
+	}
+	fprintf(stderr, "%zu samples, %zu transitions, %zu commits: %s\n", samples.size(), events.size(),
+			commits.size(), ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
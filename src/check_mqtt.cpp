@@ -0,0 +1,159 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Publishes one sample through the recorder to an MQTT broker and then
+// keeps the recorder running without samples for a while, so check_mqtt.sh
+// can restart the broker underneath it.
+//
+//   check_mqtt 127.0.0.1:1883 check/cws 30
+//
+// With "stalled" it runs a broker of its own that answers the connect and
+// then goes silent without closing, as one behind a dropped link would. On
+// a virtual clock the sink has to give up on it once a ping went
+// unanswered for too long and connect again.
+//
+//   check_mqtt stalled
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <clock.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mqtt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <recorder.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+static SampleRecord sample() {
+	SampleRecord record;
+	record.time = time(nullptr);
+	record.reading = Reading();
+	record.reading.scope = DECODE_ALL;
+	record.reading.sw = OPEN;
+	record.reading.safe = true;
+	record.reading.clouds = -20;
+	record.reading.temp = 10;
+	record.reading.lightmpsas = 21;
+	record.reading.rawir = NAN;
+	record.reading.wind = 5;
+	record.reading.gust = 8;
+	record.reading.rain = 3000;
+	record.reading.hum = 50;
+	record.reading.dewp = 0;
+	record.reading.abspress = NAN;
+	record.reading.relpress = NAN;
+	return record;
+}
+
+static int acceptWithin(int listener, int timeout) {
+	struct pollfd pfd = {listener, POLLIN, 0};
+	if ( poll(&pfd, 1, timeout) <= 0 ) {
+		return -1;
+	}
+	return accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+}
+
+static int stalled() {
+	int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addrLen = sizeof(addr);
+	if ( listener < 0 || bind(listener, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+			listen(listener, 4) != 0 ||
+			getsockname(listener, reinterpret_cast<struct sockaddr *>(&addr), &addrLen) != 0 ) {
+		perror("Could not listen");
+		return 1;
+	}
+	std::string broker = "127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+
+	VirtualClock clock(time(nullptr));
+	DriverClock::install(&clock);
+	bool ok = false;
+	{
+		Recorder recorder;
+		recorder.addSink(std::make_unique<MqttSink>("Check", broker, "check/cws", "", "", 0));
+		recorder.start();
+		recorder.push(sample());
+
+		// The clock stands still until the connection is up
+		char buf[4096];
+		int first = acceptWithin(listener, 5000);
+		struct pollfd pfd = {first, POLLIN, 0};
+		if ( first < 0 || poll(&pfd, 1, 5000) <= 0 || recv(first, buf, sizeof(buf), 0) <= 0 ||
+				buf[0] != 0x10 || send(first, "\x20\x02\x00\x00", 4, MSG_NOSIGNAL) != 4 ) {
+			fprintf(stderr, "Sink did not connect\n");
+		} else {
+			auto connected = clock.now();
+			double earliest = MqttSink::KEEPALIVE / 2 + MqttSink::PING_TIMEOUT;
+			// A tick late for the ping and the timeout each, plus the backoff
+			double latest = earliest + 2 * Recorder::TICK + 1 + 0.5;
+			int second = -1;
+			while ( second < 0 && clock.now() - connected < std::chrono::duration<double>(latest + 10) ) {
+				clock.advance(std::chrono::milliseconds(100));
+				second = acceptWithin(listener, 5);
+			}
+			double after = std::chrono::duration<double>(clock.now() - connected).count();
+			ok = second >= 0 && after >= earliest && after <= latest;
+			fprintf(stderr, "Connected again %.1f s after the broker went silent, expected %.1f s to %.1f s: %s\n",
+					after, earliest, latest, ok ? "ok" : "FAILED");
+			if ( second >= 0 ) {
+				close(second);
+			}
+		}
+		recorder.stop();
+		if ( first >= 0 ) {
+			close(first);
+		}
+	}
+	DriverClock::install(nullptr);
+	close(listener);
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+	if ( argc == 2 && strcmp(argv[1], "stalled") == 0 ) {
+		return stalled();
+	}
+	if ( argc != 4 ) {
+		fprintf(stderr, "Usage: %s broker topic seconds | stalled\n", argv[0]);
+		return 1;
+	}
+	Recorder recorder;
+	recorder.addSink(std::make_unique<MqttSink>("Check", argv[1], argv[2], "", "", 1));
+	// Only the first sample fills a batch, anything after comes from ticks
+	recorder.setBatch(1, 3600);
+	recorder.start();
+	recorder.push(sample());
+
+	std::this_thread::sleep_for(std::chrono::seconds(atoi(argv[3])));
+	recorder.stop();
+	return 0;
+}
@@ -0,0 +1,78 @@
+#!/bin/sh
+# 
+#  This file is part of the Pollux Astro Cloudwatcher software
+# 
+#  Created by Philipp Weber
+#  Copyright (c) 2023 Philipp Weber
+#  All rights reserved.
+# 
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+# 
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+# 
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+# 
+
+# Checks that the sink drops a broker gone silent, then runs check_mqtt
+# against a local mosquitto, restarts the broker and checks that the sink
+# reconnects and publishes the state again while no samples come in. The
+# latter is skipped when mosquitto and its clients are not installed.
+
+./check_mqtt stalled || exit 1
+
+if ! command -v mosquitto >/dev/null 2>&1 || ! command -v mosquitto_sub >/dev/null 2>&1 ; then
+	echo "mosquitto not found, skipped"
+	exit 77
+fi
+
+port=$(( 20000 + $$ % 20000 ))
+topic="check/cws$$"
+conf="check_mqtt.$$.conf"
+printf 'listener %d 127.0.0.1\nallow_anonymous true\npersistence false\n' "$port" > "$conf"
+
+broker=""
+client=""
+cleanup() {
+	[ -n "$client" ] && kill "$client" 2>/dev/null
+	[ -n "$broker" ] && kill "$broker" 2>/dev/null
+	rm -f "$conf"
+}
+trap cleanup EXIT
+
+startBroker() {
+	mosquitto -c "$conf" >/dev/null 2>&1 &
+	broker=$!
+	sleep 1
+}
+
+# Waits up to $1 seconds for the retained or next safety message
+safety() {
+	mosquitto_sub -h 127.0.0.1 -p "$port" -t "$topic/safety" -C 1 -W "$1" 2>/dev/null
+}
+
+startBroker
+./check_mqtt "127.0.0.1:$port" "$topic" 60 &
+client=$!
+if [ "$(safety 10)" != "safe" ] ; then
+	echo "Sample was not published"
+	exit 1
+fi
+
+# Without persistence the retained values go with the broker, only a
+# reconnect of the sink brings them back
+kill "$broker"
+wait "$broker"
+startBroker
+if [ "$(safety 30)" != "safe" ] ; then
+	echo "Sink did not reconnect without samples"
+	exit 1
+fi
+echo "Reconnected and published again"
+exit 0
@@ -0,0 +1,169 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+// Stresses SampleRing and the recorder built on it with a producer that
+// overruns the consumer, built with ThreadSanitizer. Every record taken
+// out has to be one as it was pushed, never parts of two, records have to
+// come out in the order they went in, and every one skipped has to be
+// counted as dropped.
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <recorder.h>
+#include <ring.h>
+#include <thread>
+
+static constexpr uint64_t PUSHES = 200000;
+static constexpr size_t RING_SIZE = 64;
+// Records taken between two pauses of the consumer
+static constexpr uint64_t PAUSE = 1024;
+
+// Every field is derived from n, so a torn copy shows as a mismatch
+static void fill(SampleRecord &record, uint64_t n) {
+	memset(&record, 0, sizeof(record));
+	record.time = static_cast<double>(n);
+	Reading &reading = record.reading;
+	reading.scope = n % 2 == 0 ? DECODE_ALL : DECODE_CRITICAL;
+	snprintf(reading.date, sizeof(reading.date), "%020" PRIu64, n);
+	reading.safe = n % 3 == 0;
+	double value = static_cast<double>(n);
+	for (double *field : {&reading.clouds, &reading.temp, &reading.lightmpsas, &reading.rawir, &reading.wind,
+			&reading.gust, &reading.rain, &reading.hum, &reading.dewp, &reading.abspress, &reading.relpress}) {
+		*field = value++;
+	}
+}
+
+// Checks what comes out of the consumer side, counts the records skipped
+// over so they can be held against the drops counted. Every PAUSE records
+// it lets the producer get two queues ahead, so it is lapped for sure.
+struct Taken {
+	const std::atomic<uint64_t> &pushed;
+	const std::atomic<bool> &done;
+	size_t size;
+	uint64_t count = 0;
+	uint64_t skipped = 0;
+	uint64_t torn = 0;
+	uint64_t backwards = 0;
+	uint64_t last = 0;
+
+	void take(const SampleRecord &record) {
+		uint64_t n = strtoull(record.reading.date, nullptr, 10);
+		SampleRecord expected;
+		fill(expected, n);
+		if ( memcmp(&record, &expected, sizeof(SampleRecord)) != 0 ) {
+			torn++;
+		}
+		if ( n <= last ) {
+			backwards++;
+		} else {
+			skipped += n - last - 1;
+			last = n;
+		}
+		if ( ++count % PAUSE == 0 ) {
+			uint64_t ahead = pushed.load() + 2 * size;
+			while ( ! done.load() && pushed.load() < ahead ) {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	bool report(const char *what, uint64_t dropped) const {
+		bool failed = torn > 0 || backwards > 0 || skipped != dropped || count + dropped != PUSHES ||
+				last != PUSHES || dropped == 0;
+		printf("%s: %" PRIu64 " taken, %" PRIu64 " dropped, %" PRIu64 " skipped, %" PRIu64 " torn, %" PRIu64
+				" out of order: %s\n", what, count, dropped, skipped, torn, backwards, failed ? "FAILED" : "ok");
+		return ! failed;
+	}
+};
+
+static bool checkRing() {
+	SampleRing<SampleRecord, RING_SIZE> ring;
+	std::atomic<uint64_t> pushed{0};
+	std::atomic<bool> done{false};
+	Taken taken{pushed, done, RING_SIZE};
+	std::thread consumer([&]{
+		SampleRecord record;
+		while ( true ) {
+			bool last = done.load();
+			while ( ring.pop(record) ) {
+				taken.take(record);
+			}
+			if ( last ) {
+				break;
+			}
+		}
+	});
+
+	SampleRecord record;
+	for (uint64_t n = 1; n <= PUSHES; n++) {
+		fill(record, n);
+		ring.push(record);
+		pushed.store(n);
+	}
+	done.store(true);
+	consumer.join();
+	return taken.report("Ring", ring.dropped()) && ring.pushed() == PUSHES;
+}
+
+class CheckSink : public RecordSink {
+	public:
+		explicit CheckSink(Taken &taken) : m_taken(taken) {}
+
+		void record(const SampleRecord &record) override {
+			m_taken.take(record);
+		}
+
+	private:
+		Taken &m_taken;
+};
+
+// Handed over to a sink on the recorder thread, which is woken by batches
+static bool checkRecorder() {
+	std::atomic<uint64_t> pushed{0};
+	std::atomic<bool> done{false};
+	Taken taken{pushed, done, Recorder::QUEUE_SIZE};
+	Recorder recorder;
+	recorder.addSink(std::make_unique<CheckSink>(taken));
+	recorder.setBatch(Recorder::QUEUE_SIZE / 2, Recorder::TICK);
+	recorder.start();
+	SampleRecord record;
+	for (uint64_t n = 1; n <= PUSHES; n++) {
+		fill(record, n);
+		recorder.push(record);
+		pushed.store(n);
+	}
+	done.store(true);
+	recorder.stop();
+	return taken.report("Recorder", recorder.getDropped()) && taken.count == recorder.getRecorded();
+}
+
+int main() {
+	bool ok = checkRing();
+	ok &= checkRecorder();
+	printf("%s\n", ok ? "PASSED" : "FAILED");
+	return ok ? 0 : 1;
+}
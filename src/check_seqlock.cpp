@@ -0,0 +1,109 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Stresses SeqLock with one writer and several readers, built with
+// ThreadSanitizer. Every copy a reader gets has to be one value as it was
+// stored, never parts of two, and the values a reader sees must not go
+// back in time.
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <parser.h>
+#include <seqlock.h>
+#include <thread>
+#include <vector>
+
+static constexpr uint64_t STORES = 200000;
+static constexpr int READERS = 4;
+
+// Every field is derived from n, so a torn copy shows as a mismatch
+static void fill(Reading &reading, uint64_t n) {
+	memset(&reading, 0, sizeof(reading));
+	reading.scope = n % 2 == 0 ? DECODE_ALL : DECODE_CRITICAL;
+	snprintf(reading.date, sizeof(reading.date), "%020" PRIu64, n);
+	reading.safe = n % 3 == 0;
+	double value = static_cast<double>(n);
+	for (double *field : {&reading.clouds, &reading.temp, &reading.lightmpsas, &reading.rawir, &reading.wind,
+			&reading.gust, &reading.rain, &reading.hum, &reading.dewp, &reading.abspress, &reading.relpress}) {
+		*field = value++;
+	}
+}
+
+static bool consistent(const Reading &reading, uint64_t &n) {
+	n = strtoull(reading.date, nullptr, 10);
+	Reading expected;
+	fill(expected, n);
+	return memcmp(&reading, &expected, sizeof(Reading)) == 0;
+}
+
+int main() {
+	SeqLock<Reading> latest;
+	std::atomic<bool> done{false};
+	std::atomic<uint64_t> torn{0};
+	std::atomic<uint64_t> backwards{0};
+	std::atomic<uint64_t> reads{0};
+
+	std::vector<std::thread> readers;
+	for (int i = 0; i < READERS; i++) {
+		readers.emplace_back([&]{
+			uint64_t lastSeq = 0;
+			uint64_t lastN = 0;
+			uint64_t count = 0;
+			Reading reading;
+			while ( ! done.load(std::memory_order_relaxed) ) {
+				uint64_t seq = latest.load(reading);
+				if ( seq == 0 ) {
+					continue;
+				}
+				uint64_t n;
+				if ( ! consistent(reading, n) || n != seq ) {
+					torn++;
+				}
+				if ( seq < lastSeq || n < lastN ) {
+					backwards++;
+				}
+				lastSeq = seq;
+				lastN = n;
+				count++;
+			}
+			reads += count;
+		});
+	}
+
+	Reading reading;
+	for (uint64_t n = 1; n <= STORES; n++) {
+		fill(reading, n);
+		latest.store(reading);
+	}
+	done = true;
+	for (std::thread &reader : readers) {
+		reader.join();
+	}
+
+	printf("%" PRIu64 " stores, %" PRIu64 " reads, %" PRIu64 " torn, %" PRIu64 " out of order\n",
+			STORES, reads.load(), torn.load(), backwards.load());
+	bool failed = torn > 0 || backwards > 0 || reads == 0;
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+	return failed ? 1 : 0;
+}
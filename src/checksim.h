@@ -0,0 +1,123 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Runs cws_simulator from the build directory for a check program, on a
+// port that was free a moment ago, and stops it again when destroyed
+class CheckSimulator {
+	public:
+		~CheckSimulator() {
+			if ( m_pid > 0 ) {
+				kill(m_pid, SIGTERM);
+				waitpid(m_pid, nullptr, 0);
+			}
+		}
+
+		// Returns once the simulator accepts connections
+		bool start(const std::vector<const char *> &options = {}) {
+			m_port = freePort();
+			if ( m_port <= 0 ) {
+				return false;
+			}
+			std::string port = std::to_string(m_port);
+			std::vector<char *> argv;
+			argv.push_back(const_cast<char *>("./cws_simulator"));
+			argv.push_back(const_cast<char *>("-p"));
+			argv.push_back(const_cast<char *>(port.c_str()));
+			for (const char *option : options) {
+				argv.push_back(const_cast<char *>(option));
+			}
+			argv.push_back(nullptr);
+			m_pid = fork();
+			if ( m_pid == 0 ) {
+				execv(argv[0], argv.data());
+				fprintf(stderr, "Could not start %s: %s\n", argv[0], strerror(errno));
+				_exit(127);
+			}
+			for (int i = 0; m_pid > 0 && i < 500; i++) {
+				if ( accepts() ) {
+					return true;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			fprintf(stderr, "Simulator did not come up on port %d\n", m_port);
+			return false;
+		}
+
+		int getPort() const { return m_port; }
+
+		std::string getUrl() const {
+			return "http://127.0.0.1:" + std::to_string(m_port) + "/cgi-bin/cgiLastData";
+		}
+
+	private:
+		static struct sockaddr_in loopback(int port) {
+			struct sockaddr_in addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(port);
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			return addr;
+		}
+
+		static int freePort() {
+			int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			struct sockaddr_in addr = loopback(0);
+			socklen_t len = sizeof(addr);
+			int port = -1;
+			if ( fd >= 0 && bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0 &&
+					getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr), &len) == 0 ) {
+				port = ntohs(addr.sin_port);
+			}
+			if ( fd >= 0 ) {
+				close(fd);
+			}
+			return port;
+		}
+
+		bool accepts() const {
+			int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			struct sockaddr_in addr = loopback(m_port);
+			bool ok = fd >= 0 && connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0;
+			if ( fd >= 0 ) {
+				close(fd);
+			}
+			return ok;
+		}
+
+		pid_t m_pid = -1;
+		int m_port = 0;
+};
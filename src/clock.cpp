@@ -0,0 +1,85 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <clock.h>
+
+static SystemClock systemClock;
+
+DriverClock *DriverClock::s_clock = &systemClock;
+
+void DriverClock::install(DriverClock *clock) {
+	s_clock = clock != nullptr ? clock : &systemClock;
+}
+
+double SystemClock::wallTime() const {
+	return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int SystemClock::poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	return ::poll(fds, nfds, timeout);
+}
+
+void SystemClock::waitUntil(std::condition_variable &cond, std::unique_lock<std::mutex> &lock, time_point until) {
+	cond.wait_until(lock, until);
+}
+
+VirtualClock::VirtualClock(double wallStart) : m_wallStart(wallStart) {}
+
+DriverClock::time_point VirtualClock::now() const {
+	return time_point(std::chrono::steady_clock::duration(m_ticks.load()));
+}
+
+double VirtualClock::wallTime() const {
+	return m_wallStart + std::chrono::duration<double>(std::chrono::steady_clock::duration(m_ticks.load())).count();
+}
+
+// Deadlines are rounded down to whole milliseconds by the callers, so a
+// poll() without a timeout still moves the clock or they would spin forever
+int VirtualClock::poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	int ready = ::poll(fds, nfds, timeout < 0 ? -1 : 0);
+	if ( ready == 0 && timeout >= 0 ) {
+		advance(std::chrono::milliseconds(std::max(timeout, 1)));
+	}
+	return ready;
+}
+
+// Registered before the time is checked, an advance after that but before
+// the wait starts is only noticed by the timeout
+void VirtualClock::waitUntil(std::condition_variable &cond, std::unique_lock<std::mutex> &lock, time_point until) {
+	{
+		std::lock_guard<std::mutex> guard(m_waitMutex);
+		m_waiting.push_back(&cond);
+	}
+	if ( now() < until ) {
+		cond.wait_for(lock, std::chrono::milliseconds(10));
+	}
+	std::lock_guard<std::mutex> guard(m_waitMutex);
+	m_waiting.erase(std::find(m_waiting.begin(), m_waiting.end(), &cond));
+}
+
+void VirtualClock::advance(std::chrono::steady_clock::duration step) {
+	m_ticks += step.count();
+	std::lock_guard<std::mutex> guard(m_waitMutex);
+	for (std::condition_variable *cond : m_waiting) {
+		cond->notify_all();
+	}
+}
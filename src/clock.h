@@ -0,0 +1,92 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include <poll.h>
+
+// Where the driver takes its time from. Polling cadence, the fetch cache,
+// request timeouts, MQTT backoff, journal commits and sample ages all ask
+// the installed clock, so a virtual one can run a night of polling in
+// seconds.
+class DriverClock {
+	public:
+		using time_point = std::chrono::steady_clock::time_point;
+
+		virtual ~DriverClock() = default;
+		virtual time_point now() const = 0;
+		// Seconds since the epoch
+		virtual double wallTime() const = 0;
+		// Like poll(), a virtual clock passes the timeout instead of waiting
+		virtual int poll(struct pollfd *fds, nfds_t nfds, int timeout) = 0;
+		// Like cond.wait_until(), may return early so callers check again
+		virtual void waitUntil(std::condition_variable &cond, std::unique_lock<std::mutex> &lock,
+				time_point until) = 0;
+
+		static DriverClock &get() { return *s_clock; }
+		// Set before the first device is created, the clock has to outlive
+		// every device. nullptr goes back to the system clock.
+		static void install(DriverClock *clock);
+
+	private:
+		static DriverClock *s_clock;
+};
+
+class SystemClock : public DriverClock {
+	public:
+		time_point now() const override { return std::chrono::steady_clock::now(); }
+		double wallTime() const override;
+		int poll(struct pollfd *fds, nfds_t nfds, int timeout) override;
+		void waitUntil(std::condition_variable &cond, std::unique_lock<std::mutex> &lock,
+				time_point until) override;
+};
+
+// Only moves when advanced or when a poll() would have to wait. Real
+// descriptors that are ready are still reported, but anything that waits
+// on the network times out at once, so it is meant for the replay
+// transport.
+class VirtualClock : public DriverClock {
+	public:
+		// Starts at the given seconds since the epoch
+		explicit VirtualClock(double wallStart);
+
+		time_point now() const override;
+		double wallTime() const override;
+		// Without a timeout it waits for real
+		int poll(struct pollfd *fds, nfds_t nfds, int timeout) override;
+		// Waits for real until the clock is advanced or cond is notified
+		void waitUntil(std::condition_variable &cond, std::unique_lock<std::mutex> &lock,
+				time_point until) override;
+
+		void advance(std::chrono::steady_clock::duration step);
+
+	private:
+		std::atomic<std::chrono::steady_clock::rep> m_ticks{0};
+		double m_wallStart;
+		std::mutex m_waitMutex;
+		std::vector<std::condition_variable *> m_waiting;
+};
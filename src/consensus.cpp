@@ -0,0 +1,217 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <clock.h>
+#include <consensus.h>
+
+ConsensusWeather::ConsensusWeather(size_t units) : m_units(units), m_weights(units) {
+	setVersion(0, 1);
+	setWeatherConnection(CONNECTION_NONE);
+	m_values.reserve(units);
+}
+
+const char *ConsensusWeather::getDefaultName() {
+	return "Cloudwatcher Consensus";
+}
+
+void ConsensusWeather::ISGetProperties(const char *dev) {
+	INDI::Weather::ISGetProperties(dev);
+	defineProperty(consensusNP);
+}
+
+bool ConsensusWeather::Connect() {
+	return true;
+}
+
+bool ConsensusWeather::Disconnect() {
+	return true;
+}
+
+bool ConsensusWeather::initProperties() {
+	INDI::Weather::initProperties();
+
+	double votes = 1;
+	double maxAge = 60;
+	IUGetConfigNumber(getDeviceName(), "CWS_CONSENSUS", "VOTES", &votes);
+	IUGetConfigNumber(getDeviceName(), "CWS_CONSENSUS", "MAX_AGE", &maxAge);
+	consensusNP[VOTES].fill("VOTES", "Unsafe votes needed", "%.0f", 1, m_units.size(), 1, votes);
+	consensusNP[MAX_AGE].fill("MAX_AGE", "Sample max age [s]", "%.0f", 1, 3600, 1, maxAge);
+	consensusNP.fill(getDeviceName(), "CWS_CONSENSUS", "Consensus", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	unitsNP[0].fill("FRESH", "Voting units", "%.0f", 0, m_units.size(), 1, 0);
+	unitsNP.fill(getDeviceName(), "CWS_CONSENSUS_UNITS", "Units", MAIN_CONTROL_TAB, IP_RO, 60, IPS_IDLE);
+
+	addParameter("WEATHER_SAFE", "Safe", 0.9, 1.1, 0);
+	addParameter("WEATHER_SKYTEMP", "Sky Temperature [°C]", -100, -20, 10);
+	addParameter("WEATHER_WIND", "Wind [km/h]", 0, 40, 10);
+	addParameter("WEATHER_GUST", "Gust [km/h]", 0, 40, 10);
+	addParameter("WEATHER_RAIN", "Rain [a.u.]", 2900, 3200, 10);
+	setCriticalParameter("WEATHER_SAFE");
+	setCriticalParameter("WEATHER_SKYTEMP");
+	setCriticalParameter("WEATHER_WIND");
+	setCriticalParameter("WEATHER_GUST");
+	setCriticalParameter("WEATHER_RAIN");
+
+	addDebugControl();
+	return true;
+}
+
+bool ConsensusWeather::updateProperties() {
+	INDI::Weather::updateProperties();
+	if ( isConnected() ) {
+		defineProperty(unitsNP);
+	} else {
+		deleteProperty(unitsNP.getName());
+	}
+	return true;
+}
+
+bool ConsensusWeather::ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n) {
+	if (dev != nullptr && strcmp(dev, getDeviceName()) == 0) {
+		if (consensusNP.isNameMatch(name)) {
+			consensusNP.update(values, names, n);
+			consensusNP.setState(IPS_OK);
+			consensusNP.apply();
+			saveConfig(true, consensusNP.getName());
+			if ( isConnected() ) {
+				fuse();
+				publish();
+			}
+			return true;
+		}
+	}
+	return INDI::Weather::ISNewNumber(dev, name, values, names, n);
+}
+
+bool ConsensusWeather::saveConfigItems(FILE *fp) {
+	INDI::Weather::saveConfigItems(fp);
+	consensusNP.save(fp);
+	return true;
+}
+
+void ConsensusWeather::addSample(size_t unit, const Reading &reading) {
+	m_units[unit].valid = true;
+	m_units[unit].time = DriverClock::get().now();
+	m_units[unit].reading = reading;
+	if ( isConnected() ) {
+		fuse();
+		publish();
+	}
+}
+
+void ConsensusWeather::removeUnit(size_t unit) {
+	m_units[unit].valid = false;
+	if ( isConnected() ) {
+		fuse();
+		publish();
+	}
+}
+
+// Samples are only re-weighted here as they age, new ones are fused as
+// they arrive
+IPState ConsensusWeather::updateWeather() {
+	fuse();
+	return IPS_OK;
+}
+
+// Median where every value counts as often as its weight, robust against a
+// single unit reading far off
+double ConsensusWeather::weightedMedian(double Reading::*value) {
+	m_values.clear();
+	double total = 0;
+	for (size_t i = 0; i < m_units.size(); i++) {
+		double v = m_units[i].reading.*value;
+		if ( m_weights[i] > 0 && ! std::isnan(v) ) {
+			m_values.emplace_back(v, m_weights[i]);
+			total += m_weights[i];
+		}
+	}
+	if ( m_values.empty() ) {
+		return NAN;
+	}
+	std::sort(m_values.begin(), m_values.end());
+	double sum = 0;
+	for (const std::pair<double, double> &entry : m_values) {
+		sum += entry.second;
+		if ( sum >= total / 2 ) {
+			return entry.first;
+		}
+	}
+	return m_values.back().first;
+}
+
+// Every unit with a sample younger than the max age has one full vote,
+// however old the sample, so units about to drop out can not outvote one
+// that just turned unsafe. The site is unsafe once the unsafe votes reach
+// the configured count, or every unit still voting if fewer are left, and
+// also if no unit is left at all. Only the fused values use the weights,
+// 1 with a new sample fading to 0 at the max age.
+void ConsensusWeather::fuse() {
+	auto now = DriverClock::get().now();
+	double maxAge = consensusNP[MAX_AGE].getValue();
+	int unsafe = 0;
+	int voting = 0;
+	for (size_t i = 0; i < m_units.size(); i++) {
+		double age = std::chrono::duration<double>(now - m_units[i].time).count();
+		m_weights[i] = m_units[i].valid ? std::max(0., 1 - age / maxAge) : 0;
+		if ( m_weights[i] <= 0 ) {
+			continue;
+		}
+		voting++;
+		if ( ! m_units[i].reading.safe ) {
+			unsafe++;
+		}
+	}
+	m_safe = voting > 0 && unsafe < std::min<double>(consensusNP[VOTES].getValue(), voting);
+
+	setParameterValue("WEATHER_SAFE", m_safe);
+	double clouds = weightedMedian(&Reading::clouds);
+	if ( ! std::isnan(clouds) ) {
+		setParameterValue("WEATHER_SKYTEMP", clouds);
+	}
+	double wind = weightedMedian(&Reading::wind);
+	if ( ! std::isnan(wind) ) {
+		setParameterValue("WEATHER_WIND", wind);
+	}
+	double gust = weightedMedian(&Reading::gust);
+	if ( ! std::isnan(gust) ) {
+		setParameterValue("WEATHER_GUST", gust);
+	}
+	double rain = weightedMedian(&Reading::rain);
+	if ( ! std::isnan(rain) ) {
+		setParameterValue("WEATHER_RAIN", rain);
+	}
+
+	if ( voting != unitsNP[0].getValue() ) {
+		unitsNP[0].setValue(voting);
+		unitsNP.setState(voting > 0 ? IPS_OK : IPS_ALERT);
+		unitsNP.apply();
+	}
+}
+
+void ConsensusWeather::publish() {
+	if ( syncCriticalParameters() ) {
+		IDSetLight(&critialParametersLP, nullptr);
+	}
+	ParametersNP.s = IPS_OK;
+	IDSetNumber(&ParametersNP, nullptr);
+}
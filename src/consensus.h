@@ -0,0 +1,85 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <utility>
+#include <vector>
+
+#include <indipropertynumber.h>
+#include <parser.h>
+#include <indiweather.h>
+
+// Virtual weather device fusing the critical parameters of several Solos.
+// Samples are fed in by the units as they arrive and the fused state is
+// recomputed right away. A unit votes until its sample reaches the max age,
+// so a unit going offline drops out instead of freezing its last state,
+// while its readings weigh less in the fused values as they age.
+class ConsensusWeather : INDI::Weather {
+	public:
+		explicit ConsensusWeather(size_t units);
+
+		bool Connect() override;
+		bool Disconnect() override;
+		const char *getDefaultName() override;
+
+		virtual bool initProperties() override;
+		virtual void ISGetProperties(const char *dev) override;
+		virtual bool ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n) override;
+		using INDI::Weather::ISNewSwitch;
+
+		// Only called from the INDI thread
+		void addSample(size_t unit, const Reading &reading);
+		void removeUnit(size_t unit);
+		// Outcome of the last vote
+		bool isSafe() const { return m_safe; }
+
+		enum {
+			VOTES = 0,
+			MAX_AGE = 1
+		} CONSENSUS;
+
+	protected:
+		virtual IPState updateWeather() override;
+		virtual bool saveConfigItems(FILE *fp) override;
+		virtual bool updateProperties() override;
+
+	private:
+		struct Unit {
+			bool valid = false;
+			std::chrono::steady_clock::time_point time;
+			Reading reading;
+		};
+
+		INDI::PropertyNumber consensusNP{2};
+		INDI::PropertyNumber unitsNP{1};
+
+		std::vector<Unit> m_units;
+		bool m_safe = false;
+		// Weight of each unit and value/weight pairs of the fusion
+		std::vector<double> m_weights;
+		std::vector<std::pair<double, double>> m_values;
+
+		void fuse();
+		void publish();
+		double weightedMedian(double Reading::*value);
+};
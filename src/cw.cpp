@@ -19,100 +19,43 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <appendf.h>
+#include <cerrno>
+#include <clock.h>
 #include <cw.h>
+#include <eventloop.h>
+#include <export.h>
+#include <fcntl.h>
 #include <indiweather.h>
+#include <mqtt.h>
+#include <probes.h>
 #include <stdexcept>
+#include <unistd.h>
 
-std::unique_ptr<CloudwatcherSolo> solo(new CloudwatcherSolo());
-
-static size_t WriteCB(void *contents, size_t size, size_t nmemb, void *userp) {
-	((std::string *)userp)->append((char *)contents, size * nmemb);
-	return size * nmemb;
-}
-
-CloudwatcherData::CloudwatcherData(const std::string &data) {
-	std::stringstream s(data);
-	std::string line;
-	int valInt;
-	char valString[256];
-	while ( std::getline(s, line, '\n') ) {
-		const char *str = line.c_str();
-		if ( sscanf(str, "dataGMTTime=%[^\n]", valString) == 1 ) {
-			date = std::string(valString);
-			continue;
-		}
-		if ( sscanf(str, "cwinfo=%[^\n]", valString) == 1 ) {
-			cwinfo = std::string(valString);
-			continue;
-		}
-		if ( sscanf(str, "clouds=%lf", &clouds) == 1 ) {
-			continue;
-		}
-		if ( sscanf(str, "temp=%lf", &temp) == 1 ) {
-			continue;
-		}
-		if ( sscanf(str, "wind=%lf", &wind) == 1 ) {
-			continue;
-		}
-		if ( sscanf(str, "gust=%lf", &gust) == 1 ) {
-			continue;
-		}
-		if ( sscanf(str, "rain=%lf", &rain) == 1 ) {
-			continue;
-		}
-		if ( sscanf(str, "lightmpsas=%lf", &lightmpsas) == 1 ) {
-			continue;
-		}
-		if ( sscanf(str, "switch=%d", &valInt) == 1 ) {
-			sw = static_cast<SwitchState>(valInt);
-			continue;
-		}
-		if ( sscanf(str, "safe=%d", &valInt) == 1 ) {
-			safe = valInt ? true : false;
-			continue;
-		}
-		if ( sscanf(str, "hum=%lf", &hum) == 1 ) {
-			continue;
-		}
-		if ( sscanf(str, "dewp=%lf", &dewp) == 1 ) {
-			continue;
-		}
-		if ( sscanf(str, "rawir=%lf", &rawir) == 1 ) {
-			continue;
-		}
-		if ( sscanf(str, "abspress=%lf", &abspress) == 1 ) {
-			continue;
-		}
-		if ( sscanf(str, "relpress=%lf", &relpress) == 1 ) {
-			continue;
-		}
-		LOGF_WARN("Did not understand value: %s", str);
-	}
-	if ( date == "" ) {
-		throw std::runtime_error("Required field date not found");
-	}
-	if ( cwinfo == "" ) {
-		throw std::runtime_error("Required field cwinfo not found");
+CloudwatcherSolo::CloudwatcherSolo(const char *name) {
+	if ( name != nullptr ) {
+		setDeviceName(name);
 	}
-	if ( clouds == NAN ) {
-		throw std::runtime_error("Required field clouds not found");
-	}
-	if ( lightmpsas == NAN ) {
-		throw std::runtime_error("Required filed lightmpsas not found");
-	}
-	if ( temp == NAN ) {
-		throw std::runtime_error("Required field temp not found");
-	}
-}
-
-CloudwatcherSolo::CloudwatcherSolo() {
 	setVersion(0, 1);
 	setWeatherConnection(CONNECTION_NONE);
-	curl_global_init(CURL_GLOBAL_DEFAULT);
+	m_curlTransport = std::make_unique<CurlTransport>();
+	m_httpTransport = std::make_unique<HttpTransport>();
+	m_replayTransport = std::make_unique<ReplayTransport>();
+	m_transport = m_curlTransport.get();
+	m_cacheBody.reserve(1024);
+	m_recvBody.reserve(1024);
+	m_fetchAddress.reserve(256);
 }
 
 CloudwatcherSolo::~CloudwatcherSolo() {
-	curl_global_cleanup();
+	cancelFetch();
+	stopPoller();
+}
+
+void CloudwatcherSolo::setConsensus(ConsensusWeather *consensus, size_t unit) {
+	m_consensus = consensus;
+	m_consensusUnit = unit;
 }
 
 const char *CloudwatcherSolo::getDefaultName() {
@@ -122,24 +65,68 @@ const char *CloudwatcherSolo::getDefaultName() {
 void CloudwatcherSolo::ISGetProperties(const char *dev) {
 	INDI::Weather::ISGetProperties(dev);
 	defineProperty(addressTP);
+	defineProperty(fastPollNP);
+	defineProperty(fetchCacheNP);
+	defineProperty(hedgingNP);
+	defineProperty(serverNP);
+	defineProperty(metricsTP);
+	defineProperty(exportTP);
+	defineProperty(exportBatchNP);
+	defineProperty(mqttTP);
+	defineProperty(mqttQosNP);
+	defineProperty(journalTP);
+	defineProperty(journalCommitNP);
+	defineProperty(shmSP);
+	defineProperty(captureTP);
+	defineProperty(transportSP);
+	defineProperty(replayTP);
+	defineProperty(replaySpeedNP);
 }
 
 bool CloudwatcherSolo::Connect() {
-	if ( addressTP[0].getText() == nullptr || strcmp(addressTP[0].getText(), "") == 0 ) {
+	bool replay = transportSP.findOnSwitchIndex() == TRANSPORT_REPLAY;
+	std::string address;
+	if ( ! replay && ! copyAddress(address) ) {
 		LOG_ERROR("You must set the address first!");
         INDI::Weather::Disconnect();
 		return false;
 	}
-	if ( ! updateRaw() ) {
+	if ( replay ) {
+		loadReplay();
+	}
+	openCapture();
+	setupRecorder();
+	openShm();
+	startPoller();
+	if ( ! m_polling ) {
+		Disconnect();
 		return false;
 	}
-    if ( ! updateWeather() ) {
-        return false;
-    }
+	// The first sample is fetched by the loop like any other and published
+	// once it arrives
+	updateWeather();
+	startServer();
 	return true;
 }
 
 bool CloudwatcherSolo::Disconnect() {
+	auto start = std::chrono::steady_clock::now();
+	cancelFetch();
+	stopPoller();
+	m_server.stop();
+	m_shm.close();
+	m_capture.close();
+	invalidateCache();
+	if ( m_consensus != nullptr ) {
+		m_consensus->removeUnit(m_consensusUnit);
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_transportMutex);
+		m_curlTransport->reset();
+		m_httpTransport->reset();
+	}
+	LOGF_DEBUG("Pending transfers cancelled and connection closed in %.1f ms",
+			std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
 	return true;
 }
 
@@ -149,76 +136,463 @@ bool CloudwatcherSolo::ISNewText(const char *dev, const char *name, char *texts[
 			addressTP.update(texts, names, n);
 			addressTP.setState(IPS_OK);
 			addressTP.apply();
+			setAddress(addressTP[0].getText());
+			cancelFetch();
+			invalidateCache();
 			saveConfig(true, addressTP.getName());
 			return true;
 		}
+		if (metricsTP.isNameMatch(name)) {
+			metricsTP.update(texts, names, n);
+			metricsTP.setState(IPS_OK);
+			metricsTP.apply();
+			if ( isConnected() ) {
+				setupRecorder();
+			}
+			saveConfig(true, metricsTP.getName());
+			return true;
+		}
+		if (exportTP.isNameMatch(name)) {
+			exportTP.update(texts, names, n);
+			exportTP.setState(IPS_OK);
+			exportTP.apply();
+			if ( isConnected() ) {
+				setupRecorder();
+			}
+			saveConfig(true, exportTP.getName());
+			return true;
+		}
+		if (mqttTP.isNameMatch(name)) {
+			mqttTP.update(texts, names, n);
+			mqttTP.setState(IPS_OK);
+			mqttTP.apply();
+			if ( isConnected() ) {
+				setupRecorder();
+			}
+			saveConfig(true, mqttTP.getName());
+			return true;
+		}
+		if (journalTP.isNameMatch(name)) {
+			journalTP.update(texts, names, n);
+			journalTP.setState(IPS_OK);
+			journalTP.apply();
+			if ( isConnected() ) {
+				setupRecorder();
+			}
+			saveConfig(true, journalTP.getName());
+			return true;
+		}
+		if (captureTP.isNameMatch(name)) {
+			captureTP.update(texts, names, n);
+			if ( isConnected() ) {
+				openCapture();
+			}
+			saveConfig(true, captureTP.getName());
+			return true;
+		}
+		if (replayTP.isNameMatch(name)) {
+			replayTP.update(texts, names, n);
+			if ( isConnected() && transportSP.findOnSwitchIndex() == TRANSPORT_REPLAY ) {
+				loadReplay();
+			} else {
+				replayTP.setState(IPS_OK);
+				replayTP.apply();
+			}
+			saveConfig(true, replayTP.getName());
+			return true;
+		}
 	    return INDI::Weather::ISNewText(dev, name, texts, names, n);
 	}
 	return INDI::Weather::ISNewText(dev, name, texts, names, n);
 }
 
+bool CloudwatcherSolo::ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n) {
+	if (dev != nullptr && strcmp(dev, getDeviceName()) == 0) {
+		if (fastPollNP.isNameMatch(name)) {
+			fastPollNP.update(values, names, n);
+			fastPollNP.setState(IPS_OK);
+			fastPollNP.apply();
+			{
+				std::lock_guard<std::mutex> lock(m_pollMutex);
+				m_fastPeriod = fastPollNP[0].getValue();
+			}
+			m_server.setMaxAge(m_fastPeriod);
+			m_metrics.setPollPeriod(m_fastPeriod);
+			FetchLoop::instance().wake();
+			saveConfig(true, fastPollNP.getName());
+			return true;
+		}
+		if (fetchCacheNP.isNameMatch(name)) {
+			fetchCacheNP.update(values, names, n);
+			fetchCacheNP.setState(IPS_OK);
+			fetchCacheNP.apply();
+			{
+				std::lock_guard<std::mutex> lock(m_cacheMutex);
+				m_cacheTTL = fetchCacheNP[0].getValue();
+			}
+			saveConfig(true, fetchCacheNP.getName());
+			return true;
+		}
+		if (hedgingNP.isNameMatch(name)) {
+			hedgingNP.update(values, names, n);
+			hedgingNP.setState(IPS_OK);
+			hedgingNP.apply();
+			m_curlTransport->setHedgeBudget(hedgingNP[0].getValue());
+			m_httpTransport->setHedgeBudget(hedgingNP[0].getValue());
+			saveConfig(true, hedgingNP.getName());
+			return true;
+		}
+		if (serverNP.isNameMatch(name)) {
+			serverNP.update(values, names, n);
+			if ( isConnected() ) {
+				startServer();
+			}
+			saveConfig(true, serverNP.getName());
+			return true;
+		}
+		if (exportBatchNP.isNameMatch(name)) {
+			exportBatchNP.update(values, names, n);
+			exportBatchNP.setState(IPS_OK);
+			exportBatchNP.apply();
+			if ( isConnected() ) {
+				setupRecorder();
+			}
+			saveConfig(true, exportBatchNP.getName());
+			return true;
+		}
+		if (mqttQosNP.isNameMatch(name)) {
+			mqttQosNP.update(values, names, n);
+			mqttQosNP.setState(IPS_OK);
+			mqttQosNP.apply();
+			if ( isConnected() ) {
+				setupRecorder();
+			}
+			saveConfig(true, mqttQosNP.getName());
+			return true;
+		}
+		if (journalCommitNP.isNameMatch(name)) {
+			journalCommitNP.update(values, names, n);
+			journalCommitNP.setState(IPS_OK);
+			journalCommitNP.apply();
+			if ( isConnected() ) {
+				setupRecorder();
+			}
+			saveConfig(true, journalCommitNP.getName());
+			return true;
+		}
+		if (replaySpeedNP.isNameMatch(name)) {
+			replaySpeedNP.update(values, names, n);
+			replaySpeedNP.setState(IPS_OK);
+			replaySpeedNP.apply();
+			m_replayTransport->setSpeed(replaySpeedNP[0].getValue());
+			FetchLoop::instance().wake();
+			saveConfig(true, replaySpeedNP.getName());
+			return true;
+		}
+	}
+	bool handled = INDI::Weather::ISNewNumber(dev, name, values, names, n);
+	if ( handled && dev != nullptr && strcmp(dev, getDeviceName()) == 0 && strcmp(name, UpdatePeriodNP.name) == 0 ) {
+		{
+			std::lock_guard<std::mutex> lock(m_pollMutex);
+			m_slowPeriod = UpdatePeriodN[0].value;
+		}
+		FetchLoop::instance().wake();
+	}
+	// A changed range can change the weather status right away
+	if ( handled && isConnected() ) {
+		syncWeatherStatus();
+	}
+	return handled;
+}
+
+bool CloudwatcherSolo::ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n) {
+	if (dev != nullptr && strcmp(dev, getDeviceName()) == 0) {
+		if (transportSP.isNameMatch(name)) {
+			transportSP.update(states, names, n);
+			transportSP.setState(IPS_OK);
+			transportSP.apply();
+			selectTransport(transportSP.findOnSwitchIndex());
+			saveConfig(true, transportSP.getName());
+			return true;
+		}
+		if (shmSP.isNameMatch(name)) {
+			shmSP.update(states, names, n);
+			if ( shmSP.findOnSwitchIndex() == SHM_OFF ) {
+				m_shm.close(true);
+				shmSP.setState(IPS_IDLE);
+				shmSP.apply();
+			} else if ( isConnected() ) {
+				openShm();
+			}
+			saveConfig(true, shmSP.getName());
+			return true;
+		}
+		// INDI refreshes through TimerHit(), here the poller is asked instead
+		if (m_polling && strcmp(name, RefreshSP.name) == 0) {
+			RefreshS[0].s = ISS_OFF;
+			RefreshSP.s = updateWeather() == IPS_ALERT ? IPS_ALERT : IPS_OK;
+			IDSetSwitch(&RefreshSP, nullptr);
+			return true;
+		}
+	}
+	return INDI::Weather::ISNewSwitch(dev, name, states, names, n);
+}
+
 bool CloudwatcherSolo::saveConfigItems(FILE *fp) {
 	INDI::Weather::saveConfigItems(fp);
 	addressTP.save(fp);
+	fastPollNP.save(fp);
+	fetchCacheNP.save(fp);
+	hedgingNP.save(fp);
+	serverNP.save(fp);
+	metricsTP.save(fp);
+	exportTP.save(fp);
+	exportBatchNP.save(fp);
+	mqttTP.save(fp);
+	mqttQosNP.save(fp);
+	journalTP.save(fp);
+	journalCommitNP.save(fp);
+	transportSP.save(fp);
+	shmSP.save(fp);
+	captureTP.save(fp);
+	replayTP.save(fp);
+	replaySpeedNP.save(fp);
 	return true;
 }
 
-bool CloudwatcherSolo::readRaw() {
-	char curlErrorBuff[CURL_ERROR_SIZE] = ""; // Necessary, see curl docs
-	std::string buff;
+void CloudwatcherSolo::cancelFetch() {
+	m_curlTransport->cancel();
+	m_httpTransport->cancel();
+	m_replayTransport->cancel();
+}
 
-	if ( addressTP[0].getText() == nullptr ) {
-		LOG_ERROR("Address not defined!");
-		return false;
+// Switching aborts a transfer still running on the old transport and closes
+// its connection
+void CloudwatcherSolo::selectTransport(int index) {
+	Transport *transport = m_curlTransport.get();
+	if ( index == TRANSPORT_NATIVE ) {
+		transport = m_httpTransport.get();
+	} else if ( index == TRANSPORT_REPLAY ) {
+		transport = m_replayTransport.get();
+	}
+	if ( transport == m_transport ) {
+		return;
 	}
+	Transport *old = m_transport.exchange(transport);
+	old->cancel();
+	{
+		std::lock_guard<std::mutex> lock(m_transportMutex);
+		old->reset();
+	}
+	LOGF_INFO("Using %s transport", transport->getName());
+	invalidateCache();
+	if ( transport == m_replayTransport.get() && isConnected() ) {
+		loadReplay();
+	}
+}
 
-	CURL *curl = curl_easy_init();
-	if ( curl == NULL ) {
-		LOG_ERROR("Could not initialize curl!");
-		curl_easy_cleanup(curl);
-		return false;
+// Called with m_cacheMutex held. The fence pairs with the release of the
+// last other reference, so its reads are done before the sample is reused.
+std::shared_ptr<CloudwatcherData> CloudwatcherSolo::acquireSample() {
+	for (std::shared_ptr<CloudwatcherData> &sample : m_samplePool) {
+		if ( sample == nullptr ) {
+			sample = std::make_shared<CloudwatcherData>();
+			sample->extra.reserve(CloudwatcherData::EXTRA_RESERVE);
+			return sample;
+		}
+		if ( sample.use_count() == 1 ) {
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return sample;
+		}
 	}
+	LOG_DEBUG("All samples in use, allocating a new one");
+	return std::make_shared<CloudwatcherData>();
+}
 
-	if ( CURLE_OK != curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curlErrorBuff) ) {
-		LOG_ERROR("Could not set curl error buffer!");
-		curl_easy_cleanup(curl);
-		return false;
+// Called with m_cacheMutex held to widen the cached sample
+std::shared_ptr<const CloudwatcherData> CloudwatcherSolo::decode(const std::string &body, DecodeScope scope,
+		const std::shared_ptr<const DeviceInfo> &device) {
+	std::shared_ptr<CloudwatcherData> data = acquireSample();
+	CloudwatcherParser parser;
+	parser.reset(data.get(), scope);
+	parser.setKnownDevice(device);
+	if ( ! parser.write(body.data(), body.size()) || ! parser.finish() ) {
+		LOGF_ERROR("Could not decode values from device: %s", parser.getError());
+		return nullptr;
 	}
+	return data;
+}
 
-	if ( CURLE_OK != curl_easy_setopt(curl, CURLOPT_URL, addressTP[0].getText()) ) {
-		LOGF_ERROR("Could not use specified URL: %s",
-				strlen(curlErrorBuff) ? curlErrorBuff : "Unknown error");
-		curl_easy_cleanup(curl);
-		return false;
+// Answers from the cache where it can: inside the freshness window the
+// cached sample is shared, with wait callers arriving during a transfer wait
+// for its result. On CACHE_MISS the caller owns the transfer into
+// m_fetchParser and has to hand its outcome to endFetch().
+CloudwatcherSolo::CacheLookup CloudwatcherSolo::lookupCache(DecodeScope scope, bool wait,
+		std::shared_ptr<const CloudwatcherData> &data, bool &ok) {
+	std::unique_lock<std::mutex> lock(m_cacheMutex);
+	if ( m_fetchInFlight ) {
+		if ( ! wait ) {
+			return CACHE_BUSY;
+		}
+		uint64_t generation = m_fetchGeneration;
+		m_cacheCond.wait(lock, [&]{ return m_fetchGeneration != generation; });
+		if ( ! m_cacheOk ) {
+			ok = false;
+			return CACHE_HIT;
+		}
+	} else if ( ! m_cacheOk || m_cacheTTL <= 0 ||
+			DriverClock::get().now() - m_cacheTime > std::chrono::duration<double>(m_cacheTTL) ) {
+		CWS_PROBE2(fetch__start, getDeviceName(), scope);
+		m_fetchInFlight = true;
+		m_fetchStart = DriverClock::get().now();
+		m_cacheMisses++;
+		// The payload is decoded while it is received and kept for widening
+		m_fetchSample = acquireSample();
+		m_fetchParser.reset(m_fetchSample.get(), scope, &m_recvBody, &m_schema);
+		return CACHE_MISS;
 	}
 
-	if ( CURLE_OK != curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCB) ) {
-		LOGF_ERROR("Could not set curl write callback: %s",
-				strlen(curlErrorBuff) ? curlErrorBuff : "Unknown error");
-		curl_easy_cleanup(curl);
-		return false;
+	m_cacheHits++;
+	if ( m_cacheData != nullptr && m_cacheData->scope > scope ) {
+		// Only the critical fields were decoded so far, widen it from the
+		// cached payload instead of asking the device again
+		m_cacheData = decode(m_cacheBody, scope, m_cacheData->device);
 	}
+	data = m_cacheData;
+	ok = true;
+	return CACHE_HIT;
+}
 
-	if ( CURLE_OK != curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buff) ) {
-		LOGF_ERROR("Could not set curl data buffer: %s",
-				strlen(curlErrorBuff) ? curlErrorBuff : "Unknown error");
-		curl_easy_cleanup(curl);
-		return false;
+// A payload rejected by the parser still counts as read, finish() reports
+// why it could not be decoded
+bool CloudwatcherSolo::endFetch(Transport *transport, bool ok, const std::string &error,
+		std::shared_ptr<const CloudwatcherData> &data) {
+	Metrics::Outcome outcome = Metrics::FETCH_OK;
+	if ( ! ok && m_fetchParser.getError() != nullptr ) {
+		ok = true;
+	} else if ( ! ok && transport != nullptr && transport->cancelled() ) {
+		outcome = Metrics::FETCH_CANCELLED;
+		LOG_DEBUG("Fetch cancelled");
+	} else if ( ! ok ) {
+		outcome = transport != nullptr && transport->timedOut() ? Metrics::FETCH_TIMEOUT : Metrics::FETCH_FAILED;
+		LOGF_ERROR("Could not read data from Cloudwatcher: %s", error.c_str());
+	}
+
+	std::shared_ptr<const CloudwatcherData> decoded = nullptr;
+	if ( ok && m_fetchParser.finish() ) {
+		decoded = m_fetchSample;
+	} else if ( ok ) {
+		outcome = Metrics::FETCH_PARSE_ERROR;
+		LOGF_ERROR("Could not decode values from device: %s", m_fetchParser.getError());
+	}
+	double latency = std::chrono::duration<double>(DriverClock::get().now() - m_fetchStart).count();
+	CWS_PROBE6(fetch__end, getDeviceName(), transport != nullptr ? transport->getName() : "", static_cast<int>(outcome),
+			m_recvBody.size(), static_cast<uint64_t>(latency * 1e6), error.c_str());
+	m_metrics.recordFetch(outcome, latency);
+	if ( outcome != Metrics::FETCH_CANCELLED && m_capture.running() ) {
+		double now = DriverClock::get().wallTime();
+		m_capture.add(now - latency, latency, ok, ok ? m_recvBody : error);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_cacheMutex);
+		m_fetchSample = nullptr;
+		m_cacheOk = ok;
+		m_cacheBody.swap(m_recvBody);
+		if ( decoded != nullptr && m_server.running() ) {
+			m_server.publish(m_cacheBody);
+		}
+		m_cacheData = decoded;
+		m_cacheTime = DriverClock::get().now();
+		m_fetchInFlight = false;
+		m_fetchGeneration++;
+	}
+	m_cacheCond.notify_all();
+
+	data = decoded;
+	return ok;
+}
+
+void CloudwatcherSolo::setAddress(const char *address) {
+	std::lock_guard<std::mutex> lock(m_addressMutex);
+	m_address = address != nullptr ? address : "";
+}
+
+// Copies into a string owned by the caller, reusing its buffer
+bool CloudwatcherSolo::copyAddress(std::string &address) {
+	std::lock_guard<std::mutex> lock(m_addressMutex);
+	address.assign(m_address);
+	return ! address.empty();
+}
+
+// Blocking fetch, only used while the device is not polled by the loop.
+// Returns false if the device could not be read, data is left empty if the
+// payload could not be decoded.
+bool CloudwatcherSolo::fetchData(DecodeScope scope, std::shared_ptr<const CloudwatcherData> &data) {
+	bool ok = false;
+	if ( lookupCache(scope, true, data, ok) == CACHE_HIT ) {
+		return ok;
+	}
+
+	Transport *transport = m_transport;
+	uint64_t token = transport->cancelToken();
+	std::string error;
+	{
+		std::lock_guard<std::mutex> lock(m_transportMutex);
+		if ( ! copyAddress(m_fetchAddress) && transport != m_replayTransport.get() ) {
+			error = "Address not defined!";
+		} else {
+			ok = transport->get(m_fetchAddress.c_str(), m_fetchParser, error, token);
+		}
+	}
+	return endFetch(transport, ok, error, data);
+}
+
+void CloudwatcherSolo::invalidateCache() {
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+	m_cacheOk = false;
+	m_cacheData = nullptr;
+}
+
+void CloudwatcherSolo::updateFetchStats() {
+	{
+		std::lock_guard<std::mutex> lock(m_cacheMutex);
+		fetchStatsNP[0].setValue(m_cacheHits);
+		fetchStatsNP[1].setValue(m_cacheMisses);
 	}
+	Transport *transport = m_transport;
+	uint64_t requests = transport->getRequests();
+	uint64_t hedges = transport->getHedges();
+	fetchStatsNP[2].setValue(transport->getLatencyP95() * 1000);
+	fetchStatsNP[3].setValue(hedges);
+	fetchStatsNP[4].setValue(requests ? 100. * hedges / requests : 0);
+	fetchStatsNP[5].setValue(hedges ? 100. * transport->getHedgeWins() / hedges : 0);
+	uint64_t positional = m_schema.hits;
+	uint64_t decoded = positional + m_schema.misses;
+	fetchStatsNP[6].setValue(decoded ? 100. * positional / decoded : 0);
+	fetchStatsNP.setState(IPS_OK);
+	CWS_PROBE2(publish, getDeviceName(), fetchStatsNP.getName());
+	fetchStatsNP.apply();
+
+	if ( m_recorder.hasSinks() ) {
+		recorderStatsNP[0].setValue(m_recorder.getRecorded());
+		recorderStatsNP[1].setValue(m_recorder.getDropped());
+		recorderStatsNP[2].setValue(m_recorder.getFailed());
+		recorderStatsNP.setState(m_recorder.getDropped() > 0 || m_recorder.getFailed() > 0 ? IPS_ALERT : IPS_OK);
+		CWS_PROBE2(publish, getDeviceName(), recorderStatsNP.getName());
+		recorderStatsNP.apply();
+	}
+}
 
-	CURLcode res = curl_easy_perform(curl);
-	curl_easy_cleanup(curl);
-	
-	if ( CURLE_OK != res ) {
-		LOGF_ERROR("Could not read data from Cloudwatcher: %s",
-				strlen(curlErrorBuff) ? curlErrorBuff : curl_easy_strerror(res));
+bool CloudwatcherSolo::readRaw() {
+	std::shared_ptr<const CloudwatcherData> data;
+
+	if ( ! fetchData(DECODE_ALL, data) ) {
 		return false;
 	}
 
-	try {
-		m_lastData = std::make_unique<CloudwatcherData>(buff);
-	} catch (const std::exception& e) {
-		LOGF_ERROR("Could not decode values from device: %s", e.what());
+	if ( data != nullptr ) {
+		m_lastData = data;
 	}
 
 	return true;
@@ -226,24 +600,32 @@ bool CloudwatcherSolo::readRaw() {
 
 bool CloudwatcherSolo::updateRaw() {
 	RawTP.s = IPS_BUSY;
+	CWS_PROBE2(publish, getDeviceName(), RawTP.name);
 	IDSetText(&RawTP, nullptr);
 	RawNP.s = IPS_BUSY;
+	CWS_PROBE2(publish, getDeviceName(), RawNP.name);
 	IDSetNumber(&RawNP, nullptr);
 	if ( ! readRaw() ) {
 		RawTP.s = IPS_ALERT;
+		CWS_PROBE2(publish, getDeviceName(), RawTP.name);
 		IDSetText(&RawTP, nullptr);
 		RawNP.s = IPS_ALERT;
+		CWS_PROBE2(publish, getDeviceName(), RawNP.name);
 		IDSetNumber(&RawNP, nullptr);
 		return false;
 	}
+	publishRaw();
+	return true;
+}
+
+void CloudwatcherSolo::publishRaw() {
+	if ( m_lastData == nullptr ) {
+		return;
+	}
 
-	static char dateBuff[256];
-	strncpy(dateBuff, m_lastData->date.c_str(), 255);
-	RawT[DATE].text = dateBuff;
-	static char cwinfoBuff[256];
-	strncpy(cwinfoBuff, m_lastData->cwinfo.c_str(), 255);
-	RawT[CWINFO].text = cwinfoBuff;
+	IUSaveText(&RawT[DATE], m_lastData->date.c_str());
 	RawTP.s = IPS_OK;
+	CWS_PROBE2(publish, getDeviceName(), RawTP.name);
 	IDSetText(&RawTP, nullptr);
 
 	RawN[CLOUDS].value = m_lastData->clouds;
@@ -260,21 +642,278 @@ bool CloudwatcherSolo::updateRaw() {
 	RawN[ABSPRESS].value = m_lastData->abspress;
 	RawN[RELPRESS].value = m_lastData->relpress;
 	RawNP.s = IPS_OK;
+	CWS_PROBE2(publish, getDeviceName(), RawNP.name);
 	IDSetNumber(&RawNP, nullptr);
 
-	return true;
+	publishExtra();
+	publishDeviceInfo();
+	if ( isConnected() ) {
+		updateFetchStats();
+	}
+}
+
+void CloudwatcherSolo::publishDeviceInfo() {
+	const std::shared_ptr<const DeviceInfo> &device = m_lastData->device;
+	if ( device == m_device || device == nullptr ) {
+		return;
+	}
+	// A decode without the learned layout brings its own copy
+	if ( m_device != nullptr && device->cwinfo == m_device->cwinfo ) {
+		m_device = device;
+		return;
+	}
+	m_device = device;
+	setupParameters();
+	deviceInfoTP[INFO_SERIAL].setText(device->serial.c_str());
+	deviceInfoTP[INFO_FIRMWARE].setText(device->firmware.c_str());
+	deviceInfoTP[INFO_CWINFO].setText(device->cwinfo.c_str());
+	deviceInfoTP.setState(IPS_OK);
+	if ( isConnected() ) {
+		CWS_PROBE2(publish, getDeviceName(), deviceInfoTP.getName());
+		deviceInfoTP.apply();
+	}
+	LOGF_INFO("Cloudwatcher serial %s, firmware %s", device->serial.c_str(), device->firmware.c_str());
+}
+
+void CloudwatcherSolo::publishExtra() {
+	const auto &extra = m_lastData->extra;
+	bool same = extra.size() == m_extraKeys.size();
+	for (size_t i = 0; same && i < extra.size(); i++) {
+		same = extra[i].first == m_extraKeys[i];
+	}
+	if ( ! same ) {
+		if ( ! ExtraT.empty() ) {
+			deleteProperty(ExtraTP.name);
+		}
+		for (IText &text : ExtraT) {
+			free(text.text);
+		}
+		ExtraT.clear();
+		ExtraT.resize(extra.size());
+		m_extraKeys.clear();
+		for (size_t i = 0; i < extra.size(); i++) {
+			m_extraKeys.push_back(extra[i].first);
+			std::string name = "RAW_" + extra[i].first;
+			std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+			IUFillText(&ExtraT[i], name.c_str(), extra[i].first.c_str(), "n/a");
+		}
+		IUFillTextVector(&ExtraTP, ExtraT.data(), ExtraT.size(), getDeviceName(), "RAW_EXTRA", "Other", "Raw", IP_RO, 2, IPS_IDLE);
+		if ( isConnected() && ! ExtraT.empty() ) {
+			defineProperty(&ExtraTP);
+		}
+	}
+	if ( ExtraT.empty() ) {
+		return;
+	}
+	for (size_t i = 0; i < extra.size(); i++) {
+		IUSaveText(&ExtraT[i], extra[i].second.c_str());
+	}
+	ExtraTP.s = IPS_OK;
+	CWS_PROBE2(publish, getDeviceName(), ExtraTP.name);
+	IDSetText(&ExtraTP, nullptr);
+}
+
+// Parameters without a value are only offered by firmware that has the sensor
+static const struct {
+	const char *name;
+	const char *label;
+	double min;
+	double max;
+	double percWarning;
+	bool critical;
+	double CloudwatcherData::*value;
+} PARAMETERS[] = {
+	{"WEATHER_SAFE", "Safe", 0.9, 1.1, 0, true, nullptr},
+	{"WEATHER_SWITCH", "Switch", 0.9, 1.1, 0, false, nullptr},
+	{"WEATHER_SKYTEMP", "Sky Temperature [°C]", -100, -20, 10, true, nullptr},
+	{"WEATHER_TEMP", "Temperature [°C]", -30, 50, 10, false, nullptr},
+	{"WEATHER_SKY_QUALITY", "Sky Brightness [mag/arcsec^2]", 15, 23, 10, false, nullptr},
+	{"WEATHER_WIND", "Wind [km/h]", 0, 40, 10, true, &CloudwatcherData::wind},
+	{"WEATHER_GUST", "Gust [km/h]", 0, 40, 10, true, &CloudwatcherData::gust},
+	{"WEATHER_RAIN", "Rain [a.u.]", 2900, 3200, 10, true, &CloudwatcherData::rain},
+	{"WEATHER_HUMIDITY", "Humidity [%]", 0, 100, 0, false, &CloudwatcherData::hum},
+	{"WEATHER_DEWPOINT", "Dewpoint [°C]", -30, 50, 0, false, &CloudwatcherData::dewp},
+	{"WEATHER_ABSPRESS", "Absolute Pressure [mbar]", 500, 1500, 0, false, &CloudwatcherData::abspress},
+	{"WEATHER_RELPRESS", "Relative Pressure [mbar]", 500, 1500, 0, false, &CloudwatcherData::relpress}
+};
+
+// Runs for the first sample and again whenever cwinfo changes. INDI cannot
+// drop parameters, so those of an earlier firmware stay and only the
+// sensors new to this one are added.
+void CloudwatcherSolo::setupParameters() {
+	bool added = false;
+	for (const auto &parameter : PARAMETERS) {
+		if ( parameter.value != nullptr && std::isnan(m_lastData.get()->*parameter.value) ) {
+			continue;
+		}
+		if ( std::find(m_parameters.begin(), m_parameters.end(), parameter.name) != m_parameters.end() ) {
+			continue;
+		}
+		addParameter(parameter.name, parameter.label, parameter.min, parameter.max, parameter.percWarning);
+		if ( parameter.critical ) {
+			setCriticalParameter(parameter.name);
+		}
+		m_parameters.push_back(parameter.name);
+		added = true;
+	}
+	if ( ! added || ! isConnected() ) {
+		return;
+	}
+	deleteProperty(critialParametersLP.name);
+	deleteProperty(ParametersNP.name);
+	for (uint8_t i = 0; i < nRanges; i++) {
+		deleteProperty(ParametersRangeNP[i].name);
+	}
+	defineProperty(&critialParametersLP);
+	defineProperty(&ParametersNP);
+	for (uint8_t i = 0; i < nRanges; i++) {
+		defineProperty(&ParametersRangeNP[i]);
+	}
 }
 
 bool CloudwatcherSolo::initProperties() {
 	INDI::Weather::initProperties();
+	// The name is final from here on, INDI sets the default right before
+	m_fetchParser.setDeviceName(getDeviceName());
 	char address[1024] = "";
 	IUGetConfigText(getDeviceName(), "CWS_ADDRESS", "ADDRESS", address, 1024);
 	addressTP[0].fill("ADDRESS", "Address", address);
 	addressTP.fill(getDeviceName(), "CWS_ADDRESS", "Cloudwatcher", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+	setAddress(address);
+
+	IUGetConfigNumber(getDeviceName(), "CWS_FAST_POLL", "PERIOD", &m_fastPeriod);
+	fastPollNP[0].fill("PERIOD", "Critical period [s] (0 = off)", "%.1f", 0, 600, 0.5, m_fastPeriod);
+	fastPollNP.fill(getDeviceName(), "CWS_FAST_POLL", "Fast polling", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUGetConfigNumber(getDeviceName(), "CWS_FETCH_CACHE", "TTL", &m_cacheTTL);
+	fetchCacheNP[0].fill("TTL", "Freshness [s] (0 = off)", "%.1f", 0, 600, 0.1, m_cacheTTL);
+	fetchCacheNP.fill(getDeviceName(), "CWS_FETCH_CACHE", "Fetch cache", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	double hedgeBudget = 0;
+	IUGetConfigNumber(getDeviceName(), "CWS_HEDGING", "BUDGET", &hedgeBudget);
+	m_curlTransport->setHedgeBudget(hedgeBudget);
+	m_httpTransport->setHedgeBudget(hedgeBudget);
+	hedgingNP[0].fill("BUDGET", "Extra requests [%] (0 = off)", "%.0f", 0, 100, 1, hedgeBudget);
+	hedgingNP.fill(getDeviceName(), "CWS_HEDGING", "Hedging", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	double serverPort = 0;
+	IUGetConfigNumber(getDeviceName(), "CWS_SERVER", "PORT", &serverPort);
+	serverNP[0].fill("PORT", "Port (0 = off)", "%.0f", 0, 65535, 1, serverPort);
+	serverNP.fill(getDeviceName(), "CWS_SERVER", "Serve payload", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	char metricsFile[1024] = "";
+	IUGetConfigText(getDeviceName(), "CWS_METRICS", "FILE", metricsFile, 1024);
+	metricsTP[0].fill("FILE", "Textfile (empty = off)", metricsFile);
+	metricsTP.fill(getDeviceName(), "CWS_METRICS", "Metrics", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+	m_metrics.setPollPeriod(m_fastPeriod);
+
+	static const char *exportNames[] = {"CSV", "JSONL", "UDP", "SOCKET"};
+	static const char *exportLabels[] = {"CSV file", "JSON lines file", "UDP host:port", "Local socket"};
+	for (int i = EXPORT_CSV; i <= EXPORT_SOCKET; i++) {
+		char target[1024] = "";
+		IUGetConfigText(getDeviceName(), "CWS_EXPORT", exportNames[i], target, 1024);
+		exportTP[i].fill(exportNames[i], exportLabels[i], target);
+	}
+	exportTP.fill(getDeviceName(), "CWS_EXPORT", "Export (empty = off)", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	double batchSamples = 1;
+	double batchSeconds = 1;
+	IUGetConfigNumber(getDeviceName(), "CWS_EXPORT_BATCH", "SAMPLES", &batchSamples);
+	IUGetConfigNumber(getDeviceName(), "CWS_EXPORT_BATCH", "SECONDS", &batchSeconds);
+	exportBatchNP[0].fill("SAMPLES", "Samples", "%.0f", 1, Recorder::QUEUE_SIZE / 2, 1, batchSamples);
+	exportBatchNP[1].fill("SECONDS", "Max delay [s]", "%.1f", 0.1, 600, 0.1, batchSeconds);
+	exportBatchNP.fill(getDeviceName(), "CWS_EXPORT_BATCH", "Export batch", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	std::string topic = "cloudwatcher/";
+	for (const char *c = getDeviceName(); *c != '\0'; c++) {
+		topic += *c == ' ' ? '_' : *c;
+	}
+	static const char *mqttNames[] = {"BROKER", "TOPIC", "USER", "PASSWORD"};
+	static const char *mqttLabels[] = {"Broker host:port (empty = off)", "Topic prefix", "User", "Password"};
+	for (int i = MQTT_BROKER; i <= MQTT_PASSWORD; i++) {
+		char value[1024] = "";
+		if ( IUGetConfigText(getDeviceName(), "CWS_MQTT", mqttNames[i], value, 1024) != 0 && i == MQTT_TOPIC ) {
+			snprintf(value, sizeof(value), "%s", topic.c_str());
+		}
+		mqttTP[i].fill(mqttNames[i], mqttLabels[i], value);
+	}
+	mqttTP.fill(getDeviceName(), "CWS_MQTT", "MQTT", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	double mqttQos = 0;
+	IUGetConfigNumber(getDeviceName(), "CWS_MQTT_QOS", "QOS", &mqttQos);
+	mqttQosNP[0].fill("QOS", "QoS", "%.0f", 0, 1, 1, mqttQos);
+	mqttQosNP.fill(getDeviceName(), "CWS_MQTT_QOS", "MQTT QoS", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	char journalFile[1024] = "";
+	IUGetConfigText(getDeviceName(), "CWS_JOURNAL", "FILE", journalFile, 1024);
+	journalTP[0].fill("FILE", "File (empty = off)", journalFile);
+	journalTP.fill(getDeviceName(), "CWS_JOURNAL", "Journal", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	double commitRecords = 64;
+	double commitSeconds = 60;
+	double journalSize = 16;
+	IUGetConfigNumber(getDeviceName(), "CWS_JOURNAL_COMMIT", "RECORDS", &commitRecords);
+	IUGetConfigNumber(getDeviceName(), "CWS_JOURNAL_COMMIT", "SECONDS", &commitSeconds);
+	IUGetConfigNumber(getDeviceName(), "CWS_JOURNAL_COMMIT", "SIZE", &journalSize);
+	journalCommitNP[0].fill("RECORDS", "Sync every records", "%.0f", 1, 100000, 1, commitRecords);
+	journalCommitNP[1].fill("SECONDS", "Sync at least every [s]", "%.0f", 0, 3600, 1, commitSeconds);
+	journalCommitNP[2].fill("SIZE", "Rotate at [MB]", "%.0f", 1, 4096, 1, journalSize);
+	journalCommitNP.fill(getDeviceName(), "CWS_JOURNAL_COMMIT", "Journal commit", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	int transport = TRANSPORT_CURL;
+	IUGetConfigOnSwitchIndex(getDeviceName(), "CWS_TRANSPORT", &transport);
+	transportSP[TRANSPORT_CURL].fill("CURL", "libcurl", transport == TRANSPORT_CURL ? ISS_ON : ISS_OFF);
+	transportSP[TRANSPORT_NATIVE].fill("NATIVE", "Native HTTP", transport == TRANSPORT_NATIVE ? ISS_ON : ISS_OFF);
+	transportSP[TRANSPORT_REPLAY].fill("REPLAY", "Replay capture", transport == TRANSPORT_REPLAY ? ISS_ON : ISS_OFF);
+	transportSP.fill(getDeviceName(), "CWS_TRANSPORT", "Transport", OPTIONS_TAB, IP_RW, ISR_1OFMANY, 60, IPS_IDLE);
+	m_transport = transport == TRANSPORT_NATIVE ? m_httpTransport.get() : m_curlTransport.get();
+	if ( transport == TRANSPORT_REPLAY ) {
+		m_transport = m_replayTransport.get();
+	}
+
+	char captureFile[1024] = "";
+	IUGetConfigText(getDeviceName(), "CWS_CAPTURE", "FILE", captureFile, 1024);
+	captureTP[0].fill("FILE", "File (empty = off)", captureFile);
+	captureTP.fill(getDeviceName(), "CWS_CAPTURE", "Capture payloads", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	char replayFile[1024] = "";
+	IUGetConfigText(getDeviceName(), "CWS_REPLAY", "FILE", replayFile, 1024);
+	replayTP[0].fill("FILE", "Capture file", replayFile);
+	replayTP.fill(getDeviceName(), "CWS_REPLAY", "Replay", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	double replaySpeed = 1;
+	IUGetConfigNumber(getDeviceName(), "CWS_REPLAY_SPEED", "SPEED", &replaySpeed);
+	replaySpeedNP[0].fill("SPEED", "Speed (0 = flat out)", "%.1f", 0, 10000, 1, replaySpeed);
+	replaySpeedNP.fill(getDeviceName(), "CWS_REPLAY_SPEED", "Replay speed", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+	m_replayTransport->setSpeed(replaySpeed);
+
+	int shm = SHM_OFF;
+	IUGetConfigOnSwitchIndex(getDeviceName(), "CWS_SHM", &shm);
+	shmSP[SHM_ON].fill("SHM_ON", "On", shm == SHM_ON ? ISS_ON : ISS_OFF);
+	shmSP[SHM_OFF].fill("SHM_OFF", "Off", shm == SHM_OFF ? ISS_ON : ISS_OFF);
+	shmSP.fill(getDeviceName(), "CWS_SHM", "Shared memory", OPTIONS_TAB, IP_RW, ISR_1OFMANY, 60, IPS_IDLE);
+
+	fetchStatsNP[0].fill("HITS", "Cache hits", "%.0f", 0, 1e12, 1, 0);
+	fetchStatsNP[1].fill("MISSES", "Cache misses", "%.0f", 0, 1e12, 1, 0);
+	fetchStatsNP[2].fill("LATENCY_P95", "Latency p95 [ms]", "%.0f", 0, 1e6, 1, 0);
+	fetchStatsNP[3].fill("HEDGES", "Hedged requests", "%.0f", 0, 1e12, 1, 0);
+	fetchStatsNP[4].fill("HEDGE_RATE", "Hedge rate [%]", "%.1f", 0, 100, 0.1, 0);
+	fetchStatsNP[5].fill("HEDGE_WINS", "Hedges answered first [%]", "%.1f", 0, 100, 0.1, 0);
+	fetchStatsNP[6].fill("POSITIONAL", "Decoded by layout [%]", "%.1f", 0, 100, 0.1, 0);
+	fetchStatsNP.fill(getDeviceName(), "CWS_FETCH_STATS", "Fetching", "Statistics", IP_RO, 60, IPS_IDLE);
+
+	recorderStatsNP[0].fill("RECORDED", "Recorded samples", "%.0f", 0, 1e12, 1, 0);
+	recorderStatsNP[1].fill("DROPPED", "Dropped samples", "%.0f", 0, 1e12, 1, 0);
+	recorderStatsNP[2].fill("FAILED", "Failed writes", "%.0f", 0, 1e12, 1, 0);
+	recorderStatsNP.fill(getDeviceName(), "CWS_RECORDER_STATS", "Recording", "Statistics", IP_RO, 60, IPS_IDLE);
+
+	deviceInfoTP[INFO_SERIAL].fill("SERIAL", "Serial", "n/a");
+	deviceInfoTP[INFO_FIRMWARE].fill("FIRMWARE", "Firmware", "n/a");
+	deviceInfoTP[INFO_CWINFO].fill("CWINFO", "cwinfo", "n/a");
+	deviceInfoTP.fill(getDeviceName(), "CWS_DEVICE_INFO", "Device", INFO_TAB, IP_RO, 60, IPS_IDLE);
 
 	IUFillText(&RawT[DATE], "RAW_DATE", "dataGMTTime", "n/a");
-	IUFillText(&RawT[CWINFO], "RAW_CWINFO", "cwinfo", "n/a");
-	IUFillTextVector(&RawTP, RawT, 2, getDeviceName(), "RAW_STRING", "Raw", "Raw", IP_RO, 2, IPS_IDLE);
+	IUFillTextVector(&RawTP, RawT, 1, getDeviceName(), "RAW_STRING", "Raw", "Raw", IP_RO, 2, IPS_IDLE);
 
 	IUFillNumber(&RawN[CLOUDS], "RAW_CLOUDS", "clouds", "%.6f", -100, 100, 0.000001, NAN);
 	IUFillNumber(&RawN[TEMP], "RAW_TEMP", "temp", "%.6f", -100, 100, 0.000001, NAN);
@@ -291,86 +930,59 @@ bool CloudwatcherSolo::initProperties() {
 	IUFillNumber(&RawN[RELPRESS], "RAW_RELPRESS", "relpress", "%.6f", 0.0, 2000.0, 0.000001, NAN);
 	IUFillNumberVector(&RawNP, RawN, 13, getDeviceName(), "RAW_FLOAT", "Raw", "Raw", IP_RO, 2, IPS_IDLE);
 
-	updateRaw();
-	if ( m_lastData == nullptr ) {
-		LOG_ERROR("Data not read yet!");
-		return false;
-	}
-
-	addParameter("WEATHER_SAFE", "Safe", 0.9, 1.1, 0);
-	addParameter("WEATHER_SWITCH", "Switch", 0.9, 1.1, 0);
-	addParameter("WEATHER_SKYTEMP", "Sky Temperature [°C]", -100, -20, 10);
-	addParameter("WEATHER_TEMP", "Temperature [°C]", -30, 50, 10);
-	addParameter("WEATHER_SKY_QUALITY", "Sky Brightness [mag/arcsec^2]", 15, 23, 10);
-	if ( m_lastData->wind != NAN ) {
-		addParameter("WEATHER_WIND", "Wind [km/h]", 0, 40, 10);
-	}
-	if ( m_lastData->gust != NAN ) {
-		addParameter("WEATHER_GUST", "Gust [km/h]", 0, 40, 10);
-	}
-	if ( m_lastData->rain != NAN ) {
-		addParameter("WEATHER_RAIN", "Rain [a.u.]", 2900, 3200, 10);
-	}
-	if ( m_lastData->hum != NAN ) {
-		addParameter("WEATHER_HUMIDITY", "Humidity [%]", 0, 100, 0);
-	}
-	if ( m_lastData->dewp != NAN ) {
-		addParameter("WEATHER_DEWPOINT", "Dewpoint [°C]", -30, 50, 0);
-	}
-	if ( m_lastData->abspress != NAN ) {
-		addParameter("WEATHER_ABSPRESS", "Absolute Pressure [mbar]", 500, 1500, 0);
-	}
-	if ( m_lastData->relpress != NAN ) {
-		addParameter("WEATHER_RELPRESS", "Relative Pressure [mbar]", 500, 1500, 0);
-	}
-
-	setCriticalParameter("WEATHER_SAFE");
-	setCriticalParameter("WEATHER_SKYTEMP");
-	if ( m_lastData->wind != NAN ) {
-		setCriticalParameter("WEATHER_WIND");
-	}
-	if ( m_lastData->gust != NAN ) {
-		setCriticalParameter("WEATHER_GUST");
-	}
-	if ( m_lastData->rain != NAN ) {
-		setCriticalParameter("WEATHER_RAIN");
-	}
-
 	addDebugControl();
 	return true;
 }
 
+// Once the poller runs the slow lane is scheduled by startFetch(), here it
+// is only asked for right away. Its result is published by
+// applyPolledData() and the state of the last one is returned.
 IPState CloudwatcherSolo::updateWeather() {
+	if ( m_polling ) {
+		{
+			std::lock_guard<std::mutex> lock(m_pollMutex);
+			m_slowRequested = true;
+		}
+		FetchLoop::instance().wake();
+		return m_slowState;
+	}
 	if ( ! updateRaw() ) {
 		return IPS_ALERT;
 	}
+	applyWeather();
+	return IPS_OK;
+}
+
+void CloudwatcherSolo::applyWeather() {
+	if ( m_lastData == nullptr ) {
+		return;
+	}
 	setParameterValue("WEATHER_SAFE", m_lastData->safe);
 	setParameterValue("WEATHER_SWITCH", m_lastData->sw);
 	setParameterValue("WEATHER_SKYTEMP", m_lastData->clouds);
 	setParameterValue("WEATHER_TEMP", m_lastData->temp);
 	setParameterValue("WEATHER_SKY_QUALITY", m_lastData->lightmpsas);
-	if ( m_lastData->wind != NAN ) {
+	if ( ! std::isnan(m_lastData->wind) ) {
 		setParameterValue("WEATHER_WIND", m_lastData->wind);
 	}
-	if ( m_lastData->gust != NAN ) {
+	if ( ! std::isnan(m_lastData->gust) ) {
 		setParameterValue("WEATHER_GUST", m_lastData->gust);
 	}
-	if ( m_lastData->rain != NAN ) {
+	if ( ! std::isnan(m_lastData->rain) ) {
 		setParameterValue("WEATHER_RAIN", m_lastData->rain);
 	}
-	if ( m_lastData->hum != NAN ) {
+	if ( ! std::isnan(m_lastData->hum) ) {
 		setParameterValue("WEATHER_HUMIDITY", m_lastData->hum);
 	}
-	if ( m_lastData->dewp != NAN ) {
+	if ( ! std::isnan(m_lastData->dewp) ) {
 		setParameterValue("WEATHER_DEWPOINT", m_lastData->dewp);
 	}
-	if ( m_lastData->abspress != NAN ) {
+	if ( ! std::isnan(m_lastData->abspress) ) {
 		setParameterValue("WEATHER_ABSPRESS", m_lastData->abspress);
 	}
-	if ( m_lastData->relpress != NAN ) {
+	if ( ! std::isnan(m_lastData->relpress) ) {
 		setParameterValue("WEATHER_RELPRESS", m_lastData->relpress);
 	}
-	return IPS_OK;
 }
 
 bool CloudwatcherSolo::updateProperties() {
@@ -378,9 +990,426 @@ bool CloudwatcherSolo::updateProperties() {
 	if ( isConnected() ) {
 		defineProperty(&RawTP);
 		defineProperty(&RawNP);
+		if ( ! ExtraT.empty() ) {
+			defineProperty(&ExtraTP);
+		}
+		defineProperty(fetchStatsNP);
+		if ( m_recorder.hasSinks() ) {
+			defineProperty(recorderStatsNP);
+		}
+		defineProperty(deviceInfoTP);
 	} else {
 		deleteProperty(RawTP.name);
 		deleteProperty(RawNP.name);
+		if ( ! ExtraT.empty() ) {
+			deleteProperty(ExtraTP.name);
+		}
+		deleteProperty(fetchStatsNP.getName());
+		if ( m_recorder.hasSinks() ) {
+			deleteProperty(recorderStatsNP.getName());
+		}
+		deleteProperty(deviceInfoTP.getName());
 	}
 	return true;
 }
+
+// Other software on the site can fetch the payload from the driver instead
+// of the device, consumers may keep it for one fast polling period
+void CloudwatcherSolo::startServer() {
+	m_server.stop();
+	int port = serverNP[0].getValue();
+	if ( port <= 0 ) {
+		serverNP.setState(IPS_IDLE);
+		serverNP.apply();
+		return;
+	}
+	m_server.setMaxAge(m_fastPeriod);
+	{
+		std::lock_guard<std::mutex> lock(m_cacheMutex);
+		if ( m_cacheOk && m_cacheData != nullptr ) {
+			m_server.publish(m_cacheBody);
+		}
+	}
+	// Only named once the properties are set up
+	m_server.setMetrics(&m_metrics, getDeviceName());
+	std::string error;
+	if ( m_server.start(port, error) ) {
+		LOGF_INFO("Serving the payload on port %d", port);
+		serverNP.setState(IPS_OK);
+	} else {
+		LOGF_ERROR("Could not serve the payload: %s", error.c_str());
+		serverNP.setState(IPS_ALERT);
+	}
+	serverNP.apply();
+}
+
+// Local processes read every sample from shared memory, without INDI
+void CloudwatcherSolo::openShm() {
+	if ( shmSP.findOnSwitchIndex() != SHM_ON ) {
+		return;
+	}
+	std::string error;
+	if ( m_shm.open(getDeviceName(), error) ) {
+		LOGF_INFO("Publishing samples to %s", cwsShmName(getDeviceName()).c_str());
+		shmSP.setState(IPS_OK);
+	} else {
+		LOGF_ERROR("Could not publish samples to shared memory: %s", error.c_str());
+		shmSP.setState(IPS_ALERT);
+	}
+	shmSP.apply();
+}
+
+// Sinks and batching can only be changed while the recorder is stopped, so
+// polling, which feeds it, pauses meanwhile
+void CloudwatcherSolo::setupRecorder() {
+	bool polling = m_polling;
+	if ( polling ) {
+		stopPoller();
+	}
+	bool hadSinks = m_recorder.hasSinks();
+	m_journal = nullptr;
+	m_recorder.clearSinks();
+
+	const char *metricsFile = metricsTP[0].getText();
+	if ( metricsFile != nullptr && *metricsFile != '\0' ) {
+		std::unique_ptr<MetricsFileSink> sink = std::make_unique<MetricsFileSink>(m_metrics, getDeviceName());
+		sink->setPath(metricsFile);
+		m_recorder.addSink(std::move(sink));
+	}
+	for (int i = EXPORT_CSV; i <= EXPORT_SOCKET; i++) {
+		const char *target = exportTP[i].getText();
+		if ( target == nullptr || *target == '\0' ) {
+			continue;
+		}
+		switch (i) {
+			case EXPORT_CSV:
+				m_recorder.addSink(std::make_unique<CsvSink>(getDeviceName(), target));
+				break;
+			case EXPORT_JSONL:
+				m_recorder.addSink(std::make_unique<JsonLinesSink>(getDeviceName(), target));
+				break;
+			case EXPORT_UDP:
+				m_recorder.addSink(std::make_unique<UdpSink>(getDeviceName(), target));
+				break;
+			case EXPORT_SOCKET:
+				m_recorder.addSink(std::make_unique<SocketSink>(getDeviceName(), target));
+				break;
+		}
+		LOGF_INFO("Exporting samples to %s", target);
+	}
+	const char *journalFile = journalTP[0].getText();
+	if ( journalFile != nullptr && *journalFile != '\0' ) {
+		std::unique_ptr<JournalSink> sink = std::make_unique<JournalSink>(getDeviceName(), journalFile,
+				journalCommitNP[0].getValue(), journalCommitNP[1].getValue(), journalCommitNP[2].getValue() * 1024 * 1024);
+		m_journal = sink.get();
+		m_recorder.addSink(std::move(sink));
+		LOGF_INFO("Journaling samples to %s", journalFile);
+	}
+	const char *broker = mqttTP[MQTT_BROKER].getText();
+	if ( broker != nullptr && *broker != '\0' ) {
+		m_recorder.addSink(std::make_unique<MqttSink>(getDeviceName(), broker, mqttTP[MQTT_TOPIC].getText(),
+				mqttTP[MQTT_USER].getText(), mqttTP[MQTT_PASSWORD].getText(), mqttQosNP[0].getValue()));
+	}
+	m_recorder.setBatch(exportBatchNP[0].getValue(), exportBatchNP[1].getValue());
+
+	if ( isConnected() && hadSinks != m_recorder.hasSinks() ) {
+		if ( m_recorder.hasSinks() ) {
+			defineProperty(recorderStatsNP);
+		} else {
+			deleteProperty(recorderStatsNP.getName());
+		}
+	}
+	if ( polling ) {
+		startPoller();
+	}
+}
+
+// Every payload from now on, with its timing, for the replay transport
+void CloudwatcherSolo::openCapture() {
+	m_capture.close();
+	const char *path = captureTP[0].getText();
+	if ( path == nullptr || *path == '\0' ) {
+		captureTP.setState(IPS_IDLE);
+		captureTP.apply();
+		return;
+	}
+	std::string error;
+	if ( m_capture.open(path, error) ) {
+		LOGF_INFO("Capturing payloads to %s", path);
+		captureTP.setState(IPS_OK);
+	} else {
+		LOGF_ERROR("Could not capture payloads: %s", error.c_str());
+		captureTP.setState(IPS_ALERT);
+	}
+	captureTP.apply();
+}
+
+// Starts the replay over from the first payload
+void CloudwatcherSolo::loadReplay() {
+	m_replayTransport->cancel();
+	std::string error;
+	bool loaded;
+	{
+		std::lock_guard<std::mutex> lock(m_transportMutex);
+		loaded = m_replayTransport->load(replayTP[0].getText(), error);
+	}
+	invalidateCache();
+	if ( loaded ) {
+		LOGF_INFO("Replaying %zu payloads from %s", m_replayTransport->getSize(), replayTP[0].getText());
+		replayTP.setState(IPS_OK);
+	} else {
+		LOGF_ERROR("Could not load replay: %s", error.c_str());
+		replayTP.setState(IPS_ALERT);
+	}
+	replayTP.apply();
+}
+
+void CloudwatcherSolo::startPoller() {
+	if ( m_polling ) {
+		return;
+	}
+	if ( pipe2(m_pollPipe, O_NONBLOCK | O_CLOEXEC) != 0 ) {
+		LOGF_ERROR("Could not create polling pipe: %s", strerror(errno));
+		return;
+	}
+	m_pollCallbackID = IEAddCallback(m_pollPipe[0], pollerCB, this);
+	m_slowRequested = false;
+	m_slowDone = false;
+	m_slowState = IPS_OK;
+	{
+		std::lock_guard<std::mutex> lock(m_pollMutex);
+		m_slowPeriod = UpdatePeriodN[0].value;
+		m_lastFast = m_lastSlow = DriverClock::get().now();
+	}
+	m_recorder.start();
+	m_polling = true;
+	FetchLoop::instance().add(this, getDeviceName());
+}
+
+void CloudwatcherSolo::stopPoller() {
+	if ( m_polling ) {
+		FetchLoop::instance().remove(this);
+		m_polling = false;
+	}
+	m_recorder.stop();
+	if ( m_pollCallbackID >= 0 ) {
+		IERmCallback(m_pollCallbackID);
+		m_pollCallbackID = -1;
+	}
+	for (int &fd : m_pollPipe) {
+		if ( fd >= 0 ) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	m_slowData = nullptr;
+}
+
+// Called by the fetch loop when this device is idle. A request already
+// running for the device, e.g. a blocking one, makes it ask again shortly.
+Transport *CloudwatcherSolo::startFetch(std::chrono::steady_clock::time_point &wakeAt) {
+	auto now = DriverClock::get().now();
+	bool slow;
+	{
+		std::lock_guard<std::mutex> lock(m_pollMutex);
+		auto nextFast = m_lastFast + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>(m_fastPeriod));
+		bool fastDue = m_fastPeriod > 0 && now >= nextFast;
+		auto nextSlow = m_lastSlow + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>(m_slowPeriod));
+		bool slowDue = m_slowRequested || ( m_slowPeriod > 0 && now >= nextSlow );
+		// A replay at speed 0 is fed back to back, as fast as it is decoded
+		ReplayTransport *replay = m_replayTransport.get();
+		if ( m_transport == replay && replay->getSpeed() <= 0 && replay->getPosition() < replay->getSize() ) {
+			fastDue = true;
+		}
+		if ( ! slowDue && ! fastDue ) {
+			if ( m_fastPeriod > 0 ) {
+				wakeAt = std::min(wakeAt, nextFast);
+			}
+			if ( m_slowPeriod > 0 ) {
+				wakeAt = std::min(wakeAt, nextSlow);
+			}
+			return nullptr;
+		}
+		slow = slowDue;
+	}
+	auto retryAt = now + std::chrono::milliseconds(10);
+	if ( ! m_transportMutex.try_lock() ) {
+		wakeAt = std::min(wakeAt, retryAt);
+		return nullptr;
+	}
+
+	std::shared_ptr<const CloudwatcherData> data = nullptr;
+	bool ok = false;
+	CacheLookup lookup = lookupCache(slow ? DECODE_ALL : DECODE_CRITICAL, false, data, ok);
+	if ( lookup == CACHE_BUSY ) {
+		m_transportMutex.unlock();
+		wakeAt = std::min(wakeAt, retryAt);
+		return nullptr;
+	}
+	if ( slow ) {
+		std::lock_guard<std::mutex> lock(m_pollMutex);
+		m_slowRequested = false;
+		m_lastSlow = now;
+	}
+	if ( lookup == CACHE_HIT ) {
+		m_transportMutex.unlock();
+		completePoll(slow, ok, data);
+		return nullptr;
+	}
+
+	m_fetchSlow = slow;
+	m_fetchTransport = m_transport;
+	std::string error;
+	if ( ! copyAddress(m_fetchAddress) && m_fetchTransport != m_replayTransport.get() ) {
+		error = "Address not defined!";
+	} else if ( m_fetchTransport->start(m_fetchAddress.c_str(), m_fetchParser, error, m_fetchTransport->cancelToken()) ) {
+		return m_fetchTransport;
+	}
+	ok = endFetch(m_fetchTransport, false, error, data);
+	m_transportMutex.unlock();
+	completePoll(slow, ok, data);
+	return nullptr;
+}
+
+void CloudwatcherSolo::finishFetch(bool ok, const std::string &error) {
+	std::shared_ptr<const CloudwatcherData> data = nullptr;
+	ok = endFetch(m_fetchTransport, ok, error, data);
+	m_transportMutex.unlock();
+	completePoll(m_fetchSlow, ok, data);
+}
+
+// Runs on the fetch loop, INDI must only be touched from the main loop, so
+// samples are handed over through m_latest/m_slowData and the pipe
+void CloudwatcherSolo::completePoll(bool slow, bool ok, const std::shared_ptr<const CloudwatcherData> &data) {
+	// Published without waiting for any reader, a full sample carries
+	// the critical fields as well
+	if ( data != nullptr ) {
+		SampleRecord record;
+		record.time = DriverClock::get().wallTime();
+		data->snapshot(record.reading);
+		m_latest.store(record.reading);
+		m_shm.publish(record);
+		m_metrics.recordSample(record);
+		m_recorder.push(record);
+	}
+
+	std::lock_guard<std::mutex> lock(m_pollMutex);
+	m_lastFast = DriverClock::get().now();
+	if ( slow ) {
+		m_slowData = data;
+		m_slowOk = ok;
+		m_slowDone = true;
+	} else if ( data == nullptr ) {
+		return;
+	}
+	char c = 0;
+	if ( write(m_pollPipe[1], &c, 1) < 0 && errno != EAGAIN ) {
+		LOGF_ERROR("Could not signal polled data: %s", strerror(errno));
+	}
+}
+
+void CloudwatcherSolo::pollerCB(int fd, void *userp) {
+	char drain[64];
+	while ( read(fd, drain, sizeof(drain)) > 0 );
+	static_cast<CloudwatcherSolo *>(userp)->applyPolledData();
+}
+
+void CloudwatcherSolo::applyPolledData() {
+	std::shared_ptr<const CloudwatcherData> slow;
+	bool slowDone;
+	bool slowOk;
+	{
+		std::lock_guard<std::mutex> lock(m_pollMutex);
+		slow = std::move(m_slowData);
+		slowDone = m_slowDone;
+		slowOk = m_slowOk;
+		m_slowDone = false;
+	}
+	Reading reading;
+	uint64_t seq = m_latest.load(reading);
+	bool fresh = seq != m_latestSeen;
+	m_latestSeen = seq;
+	if ( ! isConnected() ) {
+		return;
+	}
+	if ( fresh && m_consensus != nullptr ) {
+		m_consensus->addSample(m_consensusUnit, reading);
+	}
+
+	if ( slowDone ) {
+		if ( ! slowOk ) {
+			RawTP.s = IPS_ALERT;
+			CWS_PROBE2(publish, getDeviceName(), RawTP.name);
+			IDSetText(&RawTP, nullptr);
+			RawNP.s = IPS_ALERT;
+			CWS_PROBE2(publish, getDeviceName(), RawNP.name);
+			IDSetNumber(&RawNP, nullptr);
+			ParametersNP.s = m_slowState = IPS_ALERT;
+			CWS_PROBE2(publish, getDeviceName(), ParametersNP.name);
+			IDSetNumber(&ParametersNP, nullptr);
+			return;
+		}
+		if ( slow != nullptr ) {
+			m_lastData = slow;
+		}
+		m_slowState = IPS_OK;
+		publishRaw();
+		applyWeather();
+		publishParameters();
+		return;
+	}
+
+	if ( ! fresh ) {
+		return;
+	}
+	setParameterValue("WEATHER_SAFE", reading.safe);
+	setParameterValue("WEATHER_SKYTEMP", reading.clouds);
+	if ( ! std::isnan(reading.wind) ) {
+		setParameterValue("WEATHER_WIND", reading.wind);
+	}
+	if ( ! std::isnan(reading.gust) ) {
+		setParameterValue("WEATHER_GUST", reading.gust);
+	}
+	if ( ! std::isnan(reading.rain) ) {
+		setParameterValue("WEATHER_RAIN", reading.rain);
+	}
+	publishParameters();
+}
+
+void CloudwatcherSolo::publishParameters() {
+	syncWeatherStatus();
+	ParametersNP.s = IPS_OK;
+	CWS_PROBE2(publish, getDeviceName(), ParametersNP.name);
+	IDSetNumber(&ParametersNP, nullptr);
+}
+
+// The weather status is only ever set here, so every transition is probed
+// and journalled however the parameters changed
+void CloudwatcherSolo::syncWeatherStatus() {
+	if ( syncCriticalParameters() ) {
+		CWS_PROBE2(publish, getDeviceName(), critialParametersLP.name);
+		IDSetLight(&critialParametersLP, nullptr);
+	}
+	if ( critialParametersLP.s == m_weatherStatus ) {
+		return;
+	}
+	CWS_PROBE3(weather__state, getDeviceName(), static_cast<int>(m_weatherStatus),
+			static_cast<int>(critialParametersLP.s));
+	if ( m_journal != nullptr ) {
+		static const char *stateNames[] = {"Idle", "Ok", "Busy", "Alert"};
+		std::string detail;
+		for (int i = 0; i < critialParametersLP.nlp; i++) {
+			appendf(detail, "%s%s=%s", i > 0 ? " " : "", critialParametersLP.lp[i].name,
+					stateNames[critialParametersLP.lp[i].s]);
+		}
+		m_journal->addEvent(DriverClock::get().wallTime(),
+				m_weatherStatus, critialParametersLP.s, detail.c_str());
+	}
+	m_weatherStatus = critialParametersLP.s;
+}
+
+// The slow lane runs on the driver clock, so INDI's update timer is left to run out
+void CloudwatcherSolo::TimerHit() {
+}
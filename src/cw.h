@@ -19,44 +19,33 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <vector>
 
-#include <curl/curl.h>
-
+#include <consensus.h>
+#include <fetchloop.h>
+#include <indipropertynumber.h>
+#include <indipropertyswitch.h>
 #include <indipropertytext.h>
+#include <journal.h>
+#include <metrics.h>
+#include <parser.h>
+#include <recorder.h>
+#include <seqlock.h>
+#include <server.h>
+#include <shmpub.h>
+#include <transport.h>
 #include <indiweather.h>
 
-enum SwitchState {
-	CLOSED = 0,
-	OPEN = 1
-};
-
-class CloudwatcherData {
-	public:
-		const char *getDeviceName() {
-			return "Decoder";
-		}
-		CloudwatcherData(const std::string &data);
-		std::string date = "";
-		std::string cwinfo = "";
-		SwitchState sw = CLOSED;
-		bool safe = false;
-		double clouds = NAN;
-		double temp = NAN;
-		double lightmpsas = NAN;
-		double rawir = NAN;
-		double wind = NAN;
-		double gust = NAN;
-		double rain = NAN;
-		double hum = NAN;
-		double dewp = NAN;
-		double abspress = NAN;
-		double relpress = NAN;
-};
-
-class CloudwatcherSolo : INDI::Weather {
+class CloudwatcherSolo : INDI::Weather, FetchClient {
 	public:
-		CloudwatcherSolo();
+		// Without a name the device is called by its default name
+		explicit CloudwatcherSolo(const char *name = nullptr);
 		virtual ~CloudwatcherSolo();
 
 		bool Connect() override;
@@ -66,12 +55,47 @@ class CloudwatcherSolo : INDI::Weather {
 		virtual bool initProperties() override;
 		virtual void ISGetProperties(const char *dev) override;
 		virtual bool ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n) override;
+		virtual bool ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n) override;
+		virtual bool ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n) override;
+
+		// Every new sample is also handed to consensus as this unit
+		void setConsensus(ConsensusWeather *consensus, size_t unit);
 
 		enum {
-			DATE = 0,
-			CWINFO = 1
+			DATE = 0
 		} RAW_STRING;
 
+		enum {
+			INFO_SERIAL = 0,
+			INFO_FIRMWARE = 1,
+			INFO_CWINFO = 2
+		} DEVICE_INFO;
+
+		enum {
+			TRANSPORT_CURL = 0,
+			TRANSPORT_NATIVE = 1,
+			TRANSPORT_REPLAY = 2
+		} TRANSPORT;
+
+		enum {
+			SHM_ON = 0,
+			SHM_OFF = 1
+		} SHM;
+
+		enum {
+			EXPORT_CSV = 0,
+			EXPORT_JSONL = 1,
+			EXPORT_UDP = 2,
+			EXPORT_SOCKET = 3
+		} EXPORT;
+
+		enum {
+			MQTT_BROKER = 0,
+			MQTT_TOPIC = 1,
+			MQTT_USER = 2,
+			MQTT_PASSWORD = 3
+		} MQTT;
+
 		enum {
 			CLOUDS = 0,
 			TEMP = 1,
@@ -90,20 +114,166 @@ class CloudwatcherSolo : INDI::Weather {
 
 	protected:
 		virtual IPState updateWeather() override;
+		virtual void TimerHit() override;
 		virtual bool saveConfigItems(FILE *fp) override;
 		virtual bool updateProperties() override;
 
 	private:
-		std::unique_ptr<CloudwatcherData> m_lastData = nullptr;
+		std::shared_ptr<const CloudwatcherData> m_lastData = nullptr;
 
 		INDI::PropertyText addressTP{1};
+		INDI::PropertyText deviceInfoTP{3};
+		INDI::PropertyNumber fastPollNP{1};
+		INDI::PropertyNumber fetchCacheNP{1};
+		INDI::PropertyNumber fetchStatsNP{7};
+		INDI::PropertyNumber hedgingNP{1};
+		INDI::PropertyNumber recorderStatsNP{3};
+		INDI::PropertyNumber serverNP{1};
+		INDI::PropertyText metricsTP{1};
+		INDI::PropertyText exportTP{4};
+		INDI::PropertyNumber exportBatchNP{2};
+		INDI::PropertyText mqttTP{4};
+		INDI::PropertyNumber mqttQosNP{1};
+		INDI::PropertyText journalTP{1};
+		INDI::PropertyNumber journalCommitNP{3};
+		INDI::PropertySwitch transportSP{3};
+		INDI::PropertyText captureTP{1};
+		INDI::PropertyText replayTP{1};
+		INDI::PropertyNumber replaySpeedNP{1};
+		INDI::PropertySwitch shmSP{2};
+
+		// Both lanes go through the selected transport, so they share its
+		// connection and never have more than one request in flight. The
+		// fetch loop holds m_transportMutex from start to finish of its
+		// requests.
+		std::unique_ptr<Transport> m_curlTransport;
+		std::unique_ptr<Transport> m_httpTransport;
+		std::unique_ptr<ReplayTransport> m_replayTransport;
+		std::atomic<Transport *> m_transport{nullptr};
+		std::mutex m_transportMutex;
+		// Copy of addressTP for the fetches, which must never read the
+		// property while ISNewText replaces it
+		std::mutex m_addressMutex;
+		std::string m_address;
+		// Taken by the request holding m_transportMutex
+		std::string m_fetchAddress;
 
-		IText RawT[2];
+		// Fetch cache, one logical read never hits the device twice
+		std::mutex m_cacheMutex;
+		std::condition_variable m_cacheCond;
+		bool m_fetchInFlight = false;
+		uint64_t m_fetchGeneration = 0;
+		bool m_cacheOk = false;
+		std::string m_cacheBody;
+		std::shared_ptr<const CloudwatcherData> m_cacheData = nullptr;
+		std::chrono::steady_clock::time_point m_cacheTime;
+		double m_cacheTTL = 1.0;
+		uint64_t m_cacheHits = 0;
+		uint64_t m_cacheMisses = 0;
+		// Only used by the single fetch in flight
+		PayloadSchema m_schema;
+		std::string m_recvBody;
+		CloudwatcherParser m_fetchParser;
+		std::shared_ptr<CloudwatcherData> m_fetchSample = nullptr;
+		std::chrono::steady_clock::time_point m_fetchStart;
+		// Samples are reused once nobody else holds them anymore
+		std::array<std::shared_ptr<CloudwatcherData>, 6> m_samplePool;
+
+		// Both lanes are fetched by the shared fetch loop, INDI only ever
+		// sees the results through the pipe
+		bool m_polling = false;
+		std::mutex m_pollMutex;
+		double m_fastPeriod = 2.0;
+		std::chrono::steady_clock::time_point m_lastFast;
+		// The update period of INDI, the slow lane runs on the driver clock
+		// instead of an INDI timer
+		double m_slowPeriod = 60.0;
+		std::chrono::steady_clock::time_point m_lastSlow;
+		// Lane and transport of the request the loop has in flight
+		bool m_fetchSlow = false;
+		Transport *m_fetchTransport = nullptr;
+		bool m_slowRequested = false;
+		bool m_slowDone = false;
+		bool m_slowOk = false;
+		IPState m_slowState = IPS_OK;
+		std::shared_ptr<const CloudwatcherData> m_slowData = nullptr;
+		// Latest sample of either lane, readable from any thread
+		SeqLock<Reading> m_latest;
+		uint64_t m_latestSeen = 0;
+		// Gets every sample, unlike m_latest
+		Recorder m_recorder;
+		ConsensusWeather *m_consensus = nullptr;
+		size_t m_consensusUnit = 0;
+		// Re-serves the last good payload to other local consumers
+		PayloadServer m_server;
+		// Every payload with its timing, for the replay transport
+		CaptureWriter m_capture;
+		// Every sample for readers on this host, see cwshm.h
+		ShmPublisher m_shm;
+		// Gets the weather status changes, owned by the recorder
+		JournalSink *m_journal = nullptr;
+		IPState m_weatherStatus = IPS_IDLE;
+		// Served at /metrics and written to a textfile by the recorder, which
+		// also feeds the export sinks
+		Metrics m_metrics;
+		int m_pollPipe[2] = {-1, -1};
+		int m_pollCallbackID = -1;
+
+		// Device info as last published, only sent again when it changes
+		std::shared_ptr<const DeviceInfo> m_device = nullptr;
+		// Weather parameters offered so far
+		std::vector<std::string> m_parameters;
+
+		IText RawT[1];
 		ITextVectorProperty RawTP;
 		INumber RawN[13];
 		INumberVectorProperty RawNP;
+		// Keys of newer firmware, rebuilt whenever they change. The labels
+		// are cut to MAXINDILABEL, so the keys are compared in full.
+		std::vector<IText> ExtraT;
+		ITextVectorProperty ExtraTP;
+		std::vector<std::string> m_extraKeys;
 
+		enum CacheLookup {
+			CACHE_HIT,
+			CACHE_BUSY,
+			CACHE_MISS
+		};
+		CacheLookup lookupCache(DecodeScope scope, bool wait, std::shared_ptr<const CloudwatcherData> &data, bool &ok);
+		bool endFetch(Transport *transport, bool ok, const std::string &error,
+				std::shared_ptr<const CloudwatcherData> &data);
+		bool fetchData(DecodeScope scope, std::shared_ptr<const CloudwatcherData> &data);
+		std::shared_ptr<CloudwatcherData> acquireSample();
+		std::shared_ptr<const CloudwatcherData> decode(const std::string &body, DecodeScope scope,
+				const std::shared_ptr<const DeviceInfo> &device);
+		void invalidateCache();
+		void updateFetchStats();
 		bool readRaw();
 		bool updateRaw();
 		void setupRaw();
+
+		void cancelFetch();
+		void selectTransport(int index);
+		void setAddress(const char *address);
+		bool copyAddress(std::string &address);
+
+		void publishRaw();
+		void publishExtra();
+		void publishDeviceInfo();
+		void setupParameters();
+		void applyWeather();
+		void startPoller();
+		void stopPoller();
+		void startServer();
+		void openShm();
+		void openCapture();
+		void loadReplay();
+		void setupRecorder();
+		Transport *startFetch(std::chrono::steady_clock::time_point &wakeAt) override;
+		void finishFetch(bool ok, const std::string &error) override;
+		void completePoll(bool slow, bool ok, const std::shared_ptr<const CloudwatcherData> &data);
+		static void pollerCB(int fd, void *userp);
+		void applyPolledData();
+		void publishParameters();
+		void syncWeatherStatus();
 };
@@ -0,0 +1,146 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Format of the journal the driver appends every sample and every change of
+// the weather status to, and a reader for it. Header only. A journal file
+// is a header followed by fixed size records, each with its own CRC, so a
+// torn or damaged record is skipped. Rotated files are <path>.1, .2, ...
+//
+//   CwsJournalReader reader;
+//   CwsJournalRecord record;
+//   if ( reader.open("/var/lib/cws/journal") ) while ( reader.next(record) ) ...
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <cwshm.h>
+
+#define CWS_JOURNAL_MAGIC "CWSJRNL"
+#define CWS_JOURNAL_VERSION 1u
+
+enum {
+	CWS_JOURNAL_SAMPLE = 1,
+	CWS_JOURNAL_EVENT = 2
+};
+
+struct CwsJournalHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	char device[48];
+};
+
+// A change of the overall weather status, WEATHER_STATUS in INDI
+struct CwsJournalEvent {
+	double time;
+	// INDI states, 0 idle, 1 ok, 2 busy and 3 alert
+	uint32_t from;
+	uint32_t to;
+	// The critical parameters and their states, e.g. "WEATHER_RAIN=Alert"
+	char detail[128];
+};
+
+struct CwsJournalRecord {
+	uint32_t type;
+	// CRC-32 of the record with this field 0
+	uint32_t crc;
+	// Counts up, also across rotated files
+	uint64_t seq;
+	union {
+		CwsShmSample sample;
+		CwsJournalEvent event;
+	};
+};
+
+static_assert(sizeof(CwsJournalHeader) == 64, "CwsJournalHeader layout changed");
+static_assert(sizeof(CwsJournalEvent) == sizeof(CwsShmSample), "CwsJournalEvent layout changed");
+static_assert(sizeof(CwsJournalRecord) == 160, "CwsJournalRecord layout changed");
+
+inline uint32_t cwsJournalCrc(const CwsJournalRecord &record) {
+	CwsJournalRecord copy = record;
+	copy.crc = 0;
+	const uint8_t *data = reinterpret_cast<const uint8_t *>(&copy);
+	uint32_t crc = 0xffffffffu;
+	for (size_t i = 0; i < sizeof(copy); i++) {
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0xedb88320u : crc >> 1;
+		}
+	}
+	return ~crc;
+}
+
+class CwsJournalReader {
+	public:
+		CwsJournalReader() = default;
+		CwsJournalReader(const CwsJournalReader &) = delete;
+		CwsJournalReader &operator=(const CwsJournalReader &) = delete;
+		~CwsJournalReader() { close(); }
+
+		// Fails unless path is a journal in the format this header knows
+		bool open(const char *path) {
+			close();
+			m_file = fopen(path, "rb");
+			if ( m_file == nullptr ) {
+				return false;
+			}
+			if ( fread(&m_header, sizeof(m_header), 1, m_file) != 1 ||
+					memcmp(m_header.magic, CWS_JOURNAL_MAGIC, sizeof(CWS_JOURNAL_MAGIC)) != 0 ||
+					m_header.version != CWS_JOURNAL_VERSION || m_header.recordSize != sizeof(CwsJournalRecord) ) {
+				close();
+				return false;
+			}
+			m_header.device[sizeof(m_header.device) - 1] = '\0';
+			m_skipped = 0;
+			return true;
+		}
+
+		void close() {
+			if ( m_file != nullptr ) {
+				fclose(m_file);
+				m_file = nullptr;
+			}
+		}
+
+		const char *getDevice() const { return m_header.device; }
+		// Records dropped for a wrong CRC so far
+		uint64_t getSkipped() const { return m_skipped; }
+
+		// False at the end, a partial record there included
+		bool next(CwsJournalRecord &record) {
+			while ( m_file != nullptr && fread(&record, sizeof(record), 1, m_file) == 1 ) {
+				if ( record.crc == cwsJournalCrc(record) ) {
+					return true;
+				}
+				m_skipped++;
+			}
+			return false;
+		}
+
+	private:
+		FILE *m_file = nullptr;
+		CwsJournalHeader m_header;
+		uint64_t m_skipped = 0;
+};
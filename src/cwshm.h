@@ -0,0 +1,180 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Reader for the latest sample the driver publishes in shared memory, for
+// processes on the same host. Header only, link with -lrt on older glibc.
+// Opening maps the segment, reading it afterwards makes no syscalls:
+//
+//   CwsShmReader reader;
+//   CwsShmSample sample;
+//   if ( reader.open("Cloudwatcher Solo") && reader.read(sample) > 0 ) ...
+//
+// The segment outlives the driver, so check sample.time for staleness.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CWS_SHM_MAGIC 0x31535743u
+#define CWS_SHM_VERSION 1u
+
+// Fixed layout of one sample. Any change to it needs a new version.
+struct CwsShmSample {
+	// Seconds since the epoch when the sample was fetched
+	double time;
+	// 0 for a full sample, 1 if only the critical fields were decoded
+	uint32_t scope;
+	// Roof switch, 0 closed and 1 open
+	uint32_t sw;
+	uint32_t safe;
+	uint32_t reserved;
+	char date[32];
+	// NAN where the device did not send a value or it was not decoded
+	double clouds;
+	double temp;
+	double lightmpsas;
+	double rawir;
+	double wind;
+	double gust;
+	double rain;
+	double hum;
+	double dewp;
+	double abspress;
+	double relpress;
+};
+
+static_assert(sizeof(CwsShmSample) == 144, "CwsShmSample layout changed");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory needs lock free atomics");
+
+// The segment, a header and the sample behind a seqlock. The writer bumps
+// seq to odd, stores the words and bumps it to even again.
+struct CwsShmSegment {
+	static constexpr size_t WORDS = sizeof(CwsShmSample) / sizeof(uint64_t);
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t reserved;
+	std::atomic<uint64_t> seq;
+	std::atomic<uint64_t> words[WORDS];
+};
+
+// Name of the segment of a device, e.g. /cws-Cloudwatcher_Solo
+inline std::string cwsShmName(const char *device) {
+	std::string name = "/cws-";
+	for (const char *c = device; *c != '\0'; c++) {
+		name += *c == '/' || *c == ' ' ? '_' : *c;
+	}
+	return name;
+}
+
+// Only ever called by the single writer
+inline void cwsShmWrite(CwsShmSegment *segment, const CwsShmSample &sample) {
+	uint64_t words[CwsShmSegment::WORDS];
+	memcpy(words, &sample, sizeof(sample));
+	uint64_t seq = segment->seq.load(std::memory_order_relaxed);
+	segment->seq.store(seq + 1, std::memory_order_relaxed);
+	for (size_t i = 0; i < CwsShmSegment::WORDS; i++) {
+		segment->words[i].store(words[i], std::memory_order_release);
+	}
+	segment->seq.store(seq + 2, std::memory_order_release);
+}
+
+// Returns how many samples were published so far, 0 leaves sample alone.
+// Gives up with 0 as well if the writer died in the middle of a store.
+inline uint64_t cwsShmRead(const CwsShmSegment *segment, CwsShmSample &sample) {
+	uint64_t words[CwsShmSegment::WORDS];
+	for (int attempt = 0; attempt < (1 << 20); attempt++) {
+		uint64_t seq = segment->seq.load(std::memory_order_acquire);
+		if ( seq & 1 ) {
+			continue;
+		}
+		if ( seq == 0 ) {
+			return 0;
+		}
+		for (size_t i = 0; i < CwsShmSegment::WORDS; i++) {
+			words[i] = segment->words[i].load(std::memory_order_acquire);
+		}
+		if ( segment->seq.load(std::memory_order_relaxed) == seq ) {
+			memcpy(&sample, words, sizeof(sample));
+			return seq / 2;
+		}
+	}
+	return 0;
+}
+
+class CwsShmReader {
+	public:
+		CwsShmReader() = default;
+		CwsShmReader(const CwsShmReader &) = delete;
+		CwsShmReader &operator=(const CwsShmReader &) = delete;
+		~CwsShmReader() { close(); }
+
+		// Fails if the driver never published for device or the layout
+		// is not the one this header knows
+		bool open(const char *device) {
+			close();
+			int fd = shm_open(cwsShmName(device).c_str(), O_RDONLY | O_CLOEXEC, 0);
+			if ( fd < 0 ) {
+				return false;
+			}
+			struct stat st;
+			void *addr = MAP_FAILED;
+			if ( fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(CwsShmSegment) ) {
+				addr = mmap(nullptr, sizeof(CwsShmSegment), PROT_READ, MAP_SHARED, fd, 0);
+			}
+			::close(fd);
+			if ( addr == MAP_FAILED ) {
+				return false;
+			}
+			m_segment = static_cast<const CwsShmSegment *>(addr);
+			if ( m_segment->magic != CWS_SHM_MAGIC || m_segment->version != CWS_SHM_VERSION ||
+					m_segment->size != sizeof(CwsShmSegment) ) {
+				close();
+				return false;
+			}
+			return true;
+		}
+
+		void close() {
+			if ( m_segment != nullptr ) {
+				munmap(const_cast<CwsShmSegment *>(m_segment), sizeof(CwsShmSegment));
+				m_segment = nullptr;
+			}
+		}
+
+		bool isOpen() const { return m_segment != nullptr; }
+
+		uint64_t read(CwsShmSample &sample) const {
+			return m_segment != nullptr ? cwsShmRead(m_segment, sample) : 0;
+		}
+
+	private:
+		const CwsShmSegment *m_segment = nullptr;
+};
@@ -0,0 +1,66 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The devices of the driver, kept apart from the device itself so check
+// programs can build their own
+
+#include <cstdlib>
+#include <cw.h>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+// CWS_DEVICES lists the devices this process serves, separated by commas.
+// They all share one fetch loop but keep their own configuration.
+static std::vector<std::unique_ptr<CloudwatcherSolo>> createDevices() {
+	std::vector<std::unique_ptr<CloudwatcherSolo>> devices;
+	const char *names = getenv("CWS_DEVICES");
+	if ( names != nullptr ) {
+		std::istringstream list(names);
+		std::string name;
+		while ( std::getline(list, name, ',') ) {
+			if ( ! name.empty() ) {
+				devices.push_back(std::make_unique<CloudwatcherSolo>(name.c_str()));
+			}
+		}
+	}
+	if ( devices.empty() ) {
+		devices.push_back(std::make_unique<CloudwatcherSolo>());
+	}
+	return devices;
+}
+
+static std::vector<std::unique_ptr<CloudwatcherSolo>> devices = createDevices();
+
+// With more than one device their critical parameters are also fused into
+// a consensus device
+static std::unique_ptr<ConsensusWeather> createConsensus() {
+	if ( devices.size() < 2 ) {
+		return nullptr;
+	}
+	std::unique_ptr<ConsensusWeather> consensus = std::make_unique<ConsensusWeather>(devices.size());
+	for (size_t unit = 0; unit < devices.size(); unit++) {
+		devices[unit]->setConsensus(consensus.get(), unit);
+	}
+	return consensus;
+}
+
+static std::unique_ptr<ConsensusWeather> consensus = createConsensus();
@@ -0,0 +1,234 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <appendf.h>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <export.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void appendJson(std::string &out, const char *str) {
+	for (const char *c = str; *c != '\0'; c++) {
+		if ( *c == '"' || *c == '\\' ) {
+			out += '\\';
+		}
+		if ( static_cast<unsigned char>(*c) >= 0x20 ) {
+			out += *c;
+		}
+	}
+}
+
+static void formatJson(const std::string &device, const SampleRecord &record, std::string &out) {
+	const Reading &reading = record.reading;
+	out += "{\"device\":\"";
+	appendJson(out, device.c_str());
+	appendf(out, "\",\"time\":%.3f,\"date\":\"", record.time);
+	appendJson(out, reading.date);
+	appendf(out, "\",\"scope\":\"%s\",\"safe\":%s,\"switch\":%d", reading.scope == DECODE_ALL ? "full" : "critical",
+			reading.safe ? "true" : "false", reading.sw);
+	for (const auto &field : EXPORT_FIELDS) {
+		double value = reading.*field.value;
+		if ( std::isnan(value) ) {
+			appendf(out, ",\"%s\":null", field.name);
+		} else {
+			appendf(out, ",\"%s\":%.6g", field.name, value);
+		}
+	}
+	out += "}\n";
+}
+
+void BatchSink::flush() {
+	if ( m_buffer.empty() ) {
+		return;
+	}
+	if ( ! write(m_buffer) ) {
+		m_failed++;
+	}
+	m_buffer.clear();
+}
+
+FileSink::~FileSink() {
+	if ( m_fd >= 0 ) {
+		close(m_fd);
+	}
+}
+
+bool FileSink::write(const std::string &batch) {
+	if ( m_fd < 0 ) {
+		m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if ( m_fd < 0 ) {
+			return false;
+		}
+		struct stat st;
+		const char *head = header();
+		if ( head != nullptr && fstat(m_fd, &st) == 0 && st.st_size == 0 &&
+				::write(m_fd, head, strlen(head)) < 0 ) {
+			close(m_fd);
+			m_fd = -1;
+			return false;
+		}
+	}
+	size_t written = 0;
+	while ( written < batch.size() ) {
+		ssize_t n = ::write(m_fd, batch.data() + written, batch.size() - written);
+		if ( n < 0 && errno == EINTR ) {
+			continue;
+		}
+		if ( n <= 0 ) {
+			close(m_fd);
+			m_fd = -1;
+			return false;
+		}
+		written += n;
+	}
+	return true;
+}
+
+const char *CsvSink::header() const {
+	return "time,date,scope,safe,switch,clouds,temp,wind,gust,rain,lightmpsas,hum,dewp,rawir,abspress,relpress\n";
+}
+
+// Missing values are left empty
+void CsvSink::format(const SampleRecord &record, std::string &out) {
+	const Reading &reading = record.reading;
+	appendf(out, "%.3f,%s,%s,%d,%d", record.time, reading.date, reading.scope == DECODE_ALL ? "full" : "critical",
+			reading.safe ? 1 : 0, reading.sw);
+	for (const auto &field : EXPORT_FIELDS) {
+		double value = reading.*field.value;
+		if ( std::isnan(value) ) {
+			out += ',';
+		} else {
+			appendf(out, ",%.6g", value);
+		}
+	}
+	out += '\n';
+}
+
+void JsonLinesSink::format(const SampleRecord &record, std::string &out) {
+	formatJson(m_device, record, out);
+}
+
+DatagramSink::~DatagramSink() {
+	if ( m_fd >= 0 ) {
+		close(m_fd);
+	}
+}
+
+bool DatagramSink::write(const std::string &batch) {
+	if ( m_fd < 0 ) {
+		m_fd = connectSocket();
+		if ( m_fd < 0 ) {
+			return false;
+		}
+	}
+	size_t pos = 0;
+	while ( pos < batch.size() ) {
+		size_t len = batch.size() - pos;
+		if ( len > m_maxDatagram ) {
+			size_t nl = batch.rfind('\n', pos + m_maxDatagram - 1);
+			len = nl != std::string::npos && nl >= pos ? nl + 1 - pos : m_maxDatagram;
+		}
+		if ( send(m_fd, batch.data() + pos, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ) {
+			// The receiver may be gone or restarted, connect again next time
+			if ( errno != EAGAIN ) {
+				close(m_fd);
+				m_fd = -1;
+			}
+			return false;
+		}
+		pos += len;
+	}
+	return true;
+}
+
+// Tag values have spaces, commas and equal signs escaped
+void UdpSink::format(const SampleRecord &record, std::string &out) {
+	const Reading &reading = record.reading;
+	out += "cloudwatcher,device=";
+	for (char c : m_device) {
+		if ( c == ' ' || c == ',' || c == '=' ) {
+			out += '\\';
+		}
+		out += c;
+	}
+	appendf(out, ",scope=%s safe=%di,switch=%di", reading.scope == DECODE_ALL ? "full" : "critical",
+			reading.safe ? 1 : 0, reading.sw);
+	for (const auto &field : EXPORT_FIELDS) {
+		double value = reading.*field.value;
+		if ( ! std::isnan(value) ) {
+			appendf(out, ",%s=%.6g", field.name, value);
+		}
+	}
+	appendf(out, " %lld\n", static_cast<long long>(record.time * 1e9));
+}
+
+int UdpSink::connectSocket() {
+	size_t colon = m_target.rfind(':');
+	if ( colon == std::string::npos ) {
+		return -1;
+	}
+	std::string host = m_target.substr(0, colon);
+	if ( host.size() > 2 && host.front() == '[' && host.back() == ']' ) {
+		host = host.substr(1, host.size() - 2);
+	}
+	std::string port = m_target.substr(colon + 1);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	struct addrinfo *res = nullptr;
+	if ( getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || res == nullptr ) {
+		return -1;
+	}
+	int fd = socket(res->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if ( fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0 ) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+void SocketSink::format(const SampleRecord &record, std::string &out) {
+	formatJson(m_device, record, out);
+}
+
+int SocketSink::connectSocket() {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if ( m_path.size() >= sizeof(addr.sun_path) ) {
+		return -1;
+	}
+	memcpy(addr.sun_path, m_path.c_str(), m_path.size());
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if ( fd >= 0 && connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
@@ -0,0 +1,146 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include <recorder.h>
+#include <sys/socket.h>
+
+// The values of a sample, in the same order in every format
+struct ExportField {
+	const char *name;
+	double Reading::*value;
+};
+
+inline constexpr ExportField EXPORT_FIELDS[] = {
+	{"clouds", &Reading::clouds},
+	{"temp", &Reading::temp},
+	{"wind", &Reading::wind},
+	{"gust", &Reading::gust},
+	{"rain", &Reading::rain},
+	{"lightmpsas", &Reading::lightmpsas},
+	{"hum", &Reading::hum},
+	{"dewp", &Reading::dewp},
+	{"rawir", &Reading::rawir},
+	{"abspress", &Reading::abspress},
+	{"relpress", &Reading::relpress}
+};
+
+// Formats samples into a buffer and hands each batch over at once when the
+// recorder flushes. A batch that cannot be written is dropped and counted,
+// so a stalled target only ever costs one batch.
+class BatchSink : public RecordSink {
+	public:
+		explicit BatchSink(const std::string &device) : m_device(device) { m_buffer.reserve(4096); }
+
+		void record(const SampleRecord &record) override { format(record, m_buffer); }
+		void flush() override;
+		uint64_t getFailed() const override { return m_failed; }
+
+	protected:
+		virtual void format(const SampleRecord &record, std::string &out) = 0;
+		virtual bool write(const std::string &batch) = 0;
+
+		std::string m_device;
+
+	private:
+		std::string m_buffer;
+		std::atomic<uint64_t> m_failed{0};
+};
+
+// Appends to a file, opened on the first batch and again after an error
+class FileSink : public BatchSink {
+	public:
+		FileSink(const std::string &device, const std::string &path) : BatchSink(device), m_path(path) {}
+		~FileSink();
+
+	protected:
+		bool write(const std::string &batch) override;
+		// Written first to a new or empty file
+		virtual const char *header() const { return nullptr; }
+
+	private:
+		std::string m_path;
+		int m_fd = -1;
+};
+
+class CsvSink : public FileSink {
+	public:
+		using FileSink::FileSink;
+
+	protected:
+		void format(const SampleRecord &record, std::string &out) override;
+		const char *header() const override;
+};
+
+// One JSON object per line
+class JsonLinesSink : public FileSink {
+	public:
+		using FileSink::FileSink;
+
+	protected:
+		void format(const SampleRecord &record, std::string &out) override;
+};
+
+// Sends a batch as datagrams of whole lines, never waiting for the receiver
+class DatagramSink : public BatchSink {
+	public:
+		DatagramSink(const std::string &device, size_t maxDatagram) : BatchSink(device), m_maxDatagram(maxDatagram) {}
+		~DatagramSink();
+
+	protected:
+		bool write(const std::string &batch) override;
+		// Returns a connected, non-blocking socket or -1
+		virtual int connectSocket() = 0;
+
+	private:
+		size_t m_maxDatagram;
+		int m_fd = -1;
+};
+
+// InfluxDB line protocol over UDP to host:port
+class UdpSink : public DatagramSink {
+	public:
+		UdpSink(const std::string &device, const std::string &target) : DatagramSink(device, 1400), m_target(target) {}
+
+	protected:
+		void format(const SampleRecord &record, std::string &out) override;
+		int connectSocket() override;
+
+	private:
+		std::string m_target;
+};
+
+// JSON lines to a local datagram socket, e.g. one bound by a dome controller
+class SocketSink : public DatagramSink {
+	public:
+		SocketSink(const std::string &device, const std::string &path) : DatagramSink(device, 16384), m_path(path) {}
+
+	protected:
+		void format(const SampleRecord &record, std::string &out) override;
+		int connectSocket() override;
+
+	private:
+		std::string m_path;
+};
@@ -0,0 +1,153 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <clock.h>
+#include <cstring>
+#include <fetchloop.h>
+#include <indilogger.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Never destroyed, devices may still remove themselves at exit
+FetchLoop &FetchLoop::instance() {
+	static FetchLoop *loop = new FetchLoop();
+	return *loop;
+}
+
+FetchLoop::FetchLoop() {
+	m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+FetchLoop::~FetchLoop() {
+	if ( m_wakeFd >= 0 ) {
+		close(m_wakeFd);
+	}
+}
+
+void FetchLoop::wake() {
+	uint64_t one = 1;
+	if ( write(m_wakeFd, &one, sizeof(one)) < 0 ) {
+		// Counter overflow only, the poll wakes up anyway
+	}
+}
+
+void FetchLoop::add(FetchClient *client, const std::string &device) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_entries.push_back({client, device, nullptr, false});
+	if ( ! m_thread.joinable() ) {
+		m_stop = false;
+		m_thread = std::thread(&FetchLoop::run, this);
+	} else {
+		wake();
+	}
+}
+
+void FetchLoop::remove(FetchClient *client) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	auto find = [&]{
+		return std::find_if(m_entries.begin(), m_entries.end(), [&](const Entry &entry) {
+			return entry.client == client;
+		});
+	};
+	auto it = find();
+	if ( it == m_entries.end() ) {
+		return;
+	}
+	it->removing = true;
+	wake();
+	m_removed.wait(lock, [&]{ return find() == m_entries.end(); });
+
+	if ( m_entries.empty() ) {
+		m_stop = true;
+		lock.unlock();
+		wake();
+		m_thread.join();
+	}
+}
+
+void FetchLoop::run() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while ( ! m_stop ) {
+		auto now = DriverClock::get().now();
+		auto wakeAt = now + std::chrono::seconds(1);
+		m_fds.clear();
+		m_fds.push_back({m_wakeFd, POLLIN, 0});
+
+		bool removed = false;
+		for (Entry &entry : m_entries) {
+			if ( entry.removing ) {
+				if ( entry.transport != nullptr ) {
+					entry.transport->abort();
+					entry.client->finishFetch(false, "Cancelled");
+				}
+				removed = true;
+				continue;
+			}
+			if ( entry.transport == nullptr ) {
+				entry.transport = entry.client->startFetch(wakeAt);
+			}
+			if ( entry.transport != nullptr ) {
+				int timeout = -1;
+				entry.transport->collect(m_fds, timeout);
+				if ( timeout >= 0 ) {
+					wakeAt = std::min(wakeAt, now + std::chrono::milliseconds(timeout));
+				}
+			}
+		}
+		if ( removed ) {
+			m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [](const Entry &entry) {
+				return entry.removing;
+			}), m_entries.end());
+			m_removed.notify_all();
+			continue;
+		}
+
+		int timeout = std::max<long>(0, std::chrono::ceil<std::chrono::milliseconds>(
+				wakeAt - DriverClock::get().now()).count());
+		lock.unlock();
+		int polled = DriverClock::get().poll(m_fds.data(), m_fds.size(), timeout);
+		int error = errno;
+		lock.lock();
+		if ( polled < 0 && error != EINTR ) {
+			// Stalls the requests of every device
+			for (const Entry &entry : m_entries) {
+				DEBUGFDEVICE(entry.device.c_str(), INDI::Logger::DBG_ERROR, "Fetch loop could not poll: %s",
+						strerror(error));
+			}
+		}
+
+		uint64_t drain;
+		while ( read(m_wakeFd, &drain, sizeof(drain)) > 0 );
+		for (Entry &entry : m_entries) {
+			if ( entry.transport == nullptr || entry.removing ) {
+				continue;
+			}
+			bool ok = false;
+			std::string error;
+			if ( entry.transport->advance(m_fds, ok, error) ) {
+				entry.transport = nullptr;
+				entry.client->finishFetch(ok, error);
+			}
+		}
+	}
+}
@@ -0,0 +1,83 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <transport.h>
+
+// Something that fetches through the loop. Both calls are made on the loop
+// thread, never at the same time for one client.
+class FetchClient {
+	public:
+		virtual ~FetchClient() = default;
+		// Called while the client has no request in flight. Returns the
+		// transport a request was started on, or nullptr and lowers wakeAt
+		// to when the client should be asked again.
+		virtual Transport *startFetch(std::chrono::steady_clock::time_point &wakeAt) = 0;
+		// The request completed
+		virtual void finishFetch(bool ok, const std::string &error) = 0;
+};
+
+// One thread drives the requests of every device, each on its own
+// transport, through the non-blocking transport interface. The thread only
+// runs while there are clients.
+class FetchLoop {
+	public:
+		static FetchLoop &instance();
+
+		// Only called from the INDI thread, messages about the client are
+		// logged for device
+		void add(FetchClient *client, const std::string &device);
+		// A request still in flight is aborted and finished first, after
+		// that the loop does not touch the client anymore
+		void remove(FetchClient *client);
+
+		// Ask every client again, e.g. after its schedule changed
+		void wake();
+
+	private:
+		struct Entry {
+			FetchClient *client;
+			std::string device;
+			Transport *transport;
+			bool removing;
+		};
+
+		FetchLoop();
+		~FetchLoop();
+		void run();
+
+		std::thread m_thread;
+		std::mutex m_mutex;
+		std::condition_variable m_removed;
+		std::vector<Entry> m_entries;
+		std::vector<struct pollfd> m_fds;
+		bool m_stop = true;
+		int m_wakeFd = -1;
+};
@@ -0,0 +1,644 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <clock.h>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <system_error>
+#include <thread>
+#include <transport.h>
+#include <unistd.h>
+
+void HttpTransport::Connection::close() {
+	if ( fd >= 0 ) {
+		::close(fd);
+		fd = -1;
+	}
+	state = IDLE;
+}
+
+short HttpTransport::Connection::events() const {
+	switch ( state ) {
+		case CONNECTING:
+		case SENDING:
+			return POLLOUT;
+		case HEADERS:
+		case BODY:
+			return POLLIN;
+		default:
+			return 0;
+	}
+}
+
+HttpTransport::HttpTransport() {
+	m_conn.in.reserve(MAX_HEADER);
+	m_hedge.in.reserve(MAX_HEADER);
+}
+
+HttpTransport::~HttpTransport() {
+	reset();
+}
+
+void HttpTransport::reset() {
+	m_conn.close();
+	m_hedge.close();
+	m_lookup = nullptr;
+}
+
+HttpTransport::Lookup::Lookup() {
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+HttpTransport::Lookup::~Lookup() {
+	if ( fd >= 0 ) {
+		::close(fd);
+	}
+}
+
+bool HttpTransport::parseUrl(const char *url, std::string &error) {
+	if ( m_url == url && m_addrLen != 0 ) {
+		return true;
+	}
+	reset();
+	m_addrLen = 0;
+	m_url = url;
+
+	const char *rest = url;
+	if ( strncasecmp(rest, "http://", 7) == 0 ) {
+		rest += 7;
+	} else if ( strstr(rest, "://") != nullptr ) {
+		error = "Only http:// URLs are supported by the native transport";
+		return false;
+	}
+
+	const char *pathStart = strchr(rest, '/');
+	std::string authority = pathStart ? std::string(rest, pathStart - rest) : std::string(rest);
+	std::string path = pathStart ? std::string(pathStart) : std::string("/");
+	if ( authority.empty() ) {
+		error = "No host in URL";
+		return false;
+	}
+
+	m_port = "80";
+	if ( authority[0] == '[' ) {
+		size_t close = authority.find(']');
+		if ( close == std::string::npos ) {
+			error = "Malformed IPv6 address in URL";
+			return false;
+		}
+		m_host = authority.substr(1, close - 1);
+		if ( close + 1 < authority.size() && authority[close + 1] == ':' ) {
+			m_port = authority.substr(close + 2);
+		}
+	} else {
+		size_t colon = authority.rfind(':');
+		m_host = authority.substr(0, colon);
+		if ( colon != std::string::npos ) {
+			m_port = authority.substr(colon + 1);
+		}
+	}
+
+	m_request = "GET " + path + " HTTP/1.1\r\n"
+		"Host: " + authority + "\r\n"
+		"User-Agent: indi_aagcloudwatcher_solo\r\n"
+		"Accept: */*\r\n"
+		"Connection: keep-alive\r\n"
+		"\r\n";
+	return true;
+}
+
+// The device sits on the LAN and rarely changes address, so the lookup is
+// only repeated when the URL changes or a connect fails. An address is
+// taken right away, a name is looked up on a thread of its own as
+// getaddrinfo() may block for seconds and the fetch loop serves every device.
+bool HttpTransport::resolve(std::string &error) {
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	struct addrinfo *res = nullptr;
+	int rc = getaddrinfo(m_host.c_str(), m_port.c_str(), &hints, &res);
+	if ( rc == 0 && res != nullptr ) {
+		memcpy(&m_addr, res->ai_addr, res->ai_addrlen);
+		m_addrLen = res->ai_addrlen;
+		freeaddrinfo(res);
+		return true;
+	}
+	if ( rc != EAI_NONAME ) {
+		error = std::string("Could not resolve ") + m_host + ": " + gai_strerror(rc);
+		return false;
+	}
+
+	std::shared_ptr<Lookup> lookup = std::make_shared<Lookup>();
+	if ( lookup->fd < 0 ) {
+		error = std::string("Could not resolve ") + m_host + ": " + strerror(errno);
+		return false;
+	}
+	try {
+		std::thread([lookup, host = m_host, port = m_port]() {
+			struct addrinfo hints;
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			struct addrinfo *res = nullptr;
+			lookup->result = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+			if ( lookup->result == 0 && res != nullptr ) {
+				memcpy(&lookup->addr, res->ai_addr, res->ai_addrlen);
+				lookup->addrLen = res->ai_addrlen;
+			} else if ( lookup->result == 0 ) {
+				lookup->result = EAI_NONAME;
+			}
+			if ( res != nullptr ) {
+				freeaddrinfo(res);
+			}
+			lookup->done.store(true, std::memory_order_release);
+			uint64_t one = 1;
+			if ( write(lookup->fd, &one, sizeof(one)) < 0 ) {
+				// Counter overflow only, done is set anyway
+			}
+		}).detach();
+	} catch (const std::system_error &e) {
+		error = std::string("Could not resolve ") + m_host + ": " + e.what();
+		return false;
+	}
+	m_lookup = lookup;
+	return true;
+}
+
+// Connects once the lookup is done, returns false while it still runs
+bool HttpTransport::lookedUp(bool &ok, std::string &error) {
+	ok = false;
+	if ( ! m_lookup->done.load(std::memory_order_acquire) ) {
+		if ( cancelled() ) {
+			error = "Cancelled";
+		} else if ( DriverClock::get().now() >= m_deadline ) {
+			m_timedOut = true;
+			error = "Timeout resolving " + m_host;
+		} else {
+			return false;
+		}
+		m_lookup = nullptr;
+		return true;
+	}
+	std::shared_ptr<Lookup> lookup = std::move(m_lookup);
+	if ( lookup->result != 0 ) {
+		error = std::string("Could not resolve ") + m_host + ": " + gai_strerror(lookup->result);
+		return true;
+	}
+	memcpy(&m_addr, &lookup->addr, lookup->addrLen);
+	m_addrLen = lookup->addrLen;
+	if ( ! open(m_conn, m_sink) ) {
+		error = m_conn.error;
+		return true;
+	}
+	return false;
+}
+
+bool HttpTransport::open(Connection &conn, BodySink *sink) {
+	conn.sink = sink;
+	conn.sink->begin();
+	conn.received = 0;
+	conn.in.clear();
+	conn.error.clear();
+	conn.sent = 0;
+	conn.keepAlive = false;
+	conn.chunked = false;
+	conn.contentLength = -1;
+	conn.chunkLeft = 0;
+	conn.chunkSkip = 0;
+	conn.chunkTrailer = false;
+
+	if ( conn.fd >= 0 && conn.state == Connection::IDLE ) {
+		conn.reused = true;
+		conn.state = Connection::SENDING;
+		return true;
+	}
+	conn.close();
+	conn.reused = false;
+
+	conn.fd = socket(m_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if ( conn.fd < 0 ) {
+		fail(conn, "Could not create socket", errno);
+		return false;
+	}
+	int one = 1;
+	setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if ( connect(conn.fd, reinterpret_cast<struct sockaddr *>(&m_addr), m_addrLen) == 0 ) {
+		conn.state = Connection::SENDING;
+	} else if ( errno == EINPROGRESS ) {
+		conn.state = Connection::CONNECTING;
+	} else {
+		fail(conn, "Could not connect", errno);
+		m_addrLen = 0;
+		return false;
+	}
+	return true;
+}
+
+void HttpTransport::deliver(Connection &conn, const char *data, size_t len) {
+	conn.received += len;
+	if ( ! conn.sink->write(data, len) ) {
+		fail(conn, "Payload rejected");
+	}
+}
+
+void HttpTransport::fail(Connection &conn, const char *what, int err) {
+	conn.error = what;
+	if ( err != 0 ) {
+		conn.error += std::string(": ") + strerror(err);
+	}
+	conn.close();
+	conn.state = Connection::FAILED;
+}
+
+void HttpTransport::step(Connection &conn, short revents) {
+	if ( conn.state == Connection::CONNECTING ) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if ( err != 0 ) {
+			fail(conn, "Could not connect", err);
+			m_addrLen = 0;
+			return;
+		}
+		conn.state = Connection::SENDING;
+	}
+
+	if ( conn.state == Connection::SENDING ) {
+		while ( conn.sent < m_request.size() ) {
+			ssize_t n = send(conn.fd, m_request.data() + conn.sent, m_request.size() - conn.sent, MSG_NOSIGNAL);
+			if ( n < 0 ) {
+				if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+					return;
+				}
+				fail(conn, "Could not send request", errno);
+				return;
+			}
+			conn.sent += n;
+		}
+		conn.state = Connection::HEADERS;
+		return;
+	}
+
+	if ( conn.state != Connection::HEADERS && conn.state != Connection::BODY ) {
+		return;
+	}
+	if ( (revents & (POLLIN | POLLHUP | POLLERR)) == 0 ) {
+		return;
+	}
+
+	char buff[4096];
+	while ( conn.state == Connection::HEADERS || conn.state == Connection::BODY ) {
+		ssize_t n = recv(conn.fd, buff, sizeof(buff), 0);
+		if ( n < 0 ) {
+			if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+				return;
+			}
+			fail(conn, "Could not read response", errno);
+			return;
+		}
+		if ( n == 0 ) {
+			if ( conn.state == Connection::BODY && ! conn.chunked && conn.contentLength < 0 ) {
+				// Body delimited by the end of the connection
+				conn.keepAlive = false;
+				conn.state = Connection::DONE;
+				return;
+			}
+			fail(conn, conn.state == Connection::HEADERS && conn.in.empty() ?
+					"Connection closed before response" : "Connection closed during response");
+			return;
+		}
+
+		if ( conn.state == Connection::HEADERS ) {
+			conn.in.append(buff, n);
+			parseHeaders(conn);
+		} else if ( conn.chunked ) {
+			conn.in.append(buff, n);
+			parseBody(conn);
+		} else {
+			deliver(conn, buff, n);
+			parseBody(conn);
+		}
+	}
+}
+
+void HttpTransport::parseHeaders(Connection &conn) {
+	size_t end = conn.in.find("\r\n\r\n");
+	if ( end == std::string::npos ) {
+		if ( conn.in.size() > MAX_HEADER ) {
+			fail(conn, "Response headers too long");
+		}
+		return;
+	}
+
+	int major = 0;
+	int minor = 0;
+	int status = 0;
+	if ( sscanf(conn.in.c_str(), "HTTP/%d.%d %d", &major, &minor, &status) != 3 ) {
+		fail(conn, "Malformed status line");
+		return;
+	}
+	if ( status != 200 ) {
+		char msg[64];
+		snprintf(msg, sizeof(msg), "Device answered with HTTP status %d", status);
+		fail(conn, msg);
+		return;
+	}
+	conn.keepAlive = major > 1 || (major == 1 && minor >= 1);
+
+	size_t pos = conn.in.find("\r\n") + 2;
+	while ( pos < end ) {
+		size_t eol = conn.in.find("\r\n", pos);
+		const char *line = conn.in.c_str() + pos;
+		const char *value = strchr(line, ':');
+		if ( value != nullptr && value < conn.in.c_str() + eol ) {
+			size_t nameLen = value - line;
+			value++;
+			while ( *value == ' ' || *value == '\t' ) {
+				value++;
+			}
+			if ( nameLen == 14 && strncasecmp(line, "Content-Length", nameLen) == 0 ) {
+				conn.contentLength = strtol(value, nullptr, 10);
+			} else if ( nameLen == 17 && strncasecmp(line, "Transfer-Encoding", nameLen) == 0 ) {
+				conn.chunked = strncasecmp(value, "chunked", 7) == 0;
+			} else if ( nameLen == 10 && strncasecmp(line, "Connection", nameLen) == 0 ) {
+				if ( strncasecmp(value, "close", 5) == 0 ) {
+					conn.keepAlive = false;
+				} else if ( strncasecmp(value, "keep-alive", 10) == 0 ) {
+					conn.keepAlive = true;
+				}
+			}
+		}
+		pos = eol + 2;
+	}
+	if ( conn.contentLength > static_cast<long>(MAX_BODY) ) {
+		fail(conn, "Response body too large");
+		return;
+	}
+
+	conn.in.erase(0, end + 4);
+	conn.state = Connection::BODY;
+	if ( ! conn.chunked && ! conn.in.empty() ) {
+		deliver(conn, conn.in.data(), conn.in.size());
+		conn.in.clear();
+	}
+	parseBody(conn);
+}
+
+void HttpTransport::parseBody(Connection &conn) {
+	if ( conn.state != Connection::BODY ) {
+		return;
+	}
+	if ( ! conn.chunked ) {
+		if ( conn.contentLength >= 0 && conn.received >= static_cast<size_t>(conn.contentLength) ) {
+			conn.state = Connection::DONE;
+		} else if ( conn.received > MAX_BODY ) {
+			fail(conn, "Response body too large");
+		}
+		return;
+	}
+
+	size_t pos = 0;
+	while ( conn.state == Connection::BODY ) {
+		if ( conn.chunkLeft > 0 ) {
+			size_t n = std::min(conn.chunkLeft, conn.in.size() - pos);
+			deliver(conn, conn.in.data() + pos, n);
+			if ( conn.state != Connection::BODY ) {
+				return;
+			}
+			pos += n;
+			conn.chunkLeft -= n;
+			if ( conn.chunkLeft > 0 ) {
+				break;
+			}
+			conn.chunkSkip = 2;
+			continue;
+		}
+		if ( conn.chunkSkip > 0 ) {
+			size_t n = std::min(conn.chunkSkip, conn.in.size() - pos);
+			pos += n;
+			conn.chunkSkip -= n;
+			if ( conn.chunkSkip > 0 ) {
+				break;
+			}
+			continue;
+		}
+
+		size_t eol = conn.in.find("\r\n", pos);
+		if ( eol == std::string::npos ) {
+			if ( conn.in.size() - pos > MAX_HEADER ) {
+				fail(conn, "Chunk header too long");
+				return;
+			}
+			break;
+		}
+		if ( conn.chunkTrailer ) {
+			bool last = eol == pos;
+			pos = eol + 2;
+			if ( last ) {
+				conn.state = Connection::DONE;
+			}
+			continue;
+		}
+
+		const char *start = conn.in.c_str() + pos;
+		char *stop = nullptr;
+		unsigned long size = strtoul(start, &stop, 16);
+		if ( stop == start ) {
+			fail(conn, "Malformed chunk header");
+			return;
+		}
+		pos = eol + 2;
+		if ( size == 0 ) {
+			conn.chunkTrailer = true;
+			continue;
+		}
+		if ( conn.received + size > MAX_BODY ) {
+			fail(conn, "Response body too large");
+			return;
+		}
+		conn.chunkLeft = size;
+	}
+	conn.in.erase(0, pos);
+}
+
+bool HttpTransport::start(const char *url, BodySink &sink, std::string &error, uint64_t token) {
+	drainWake();
+	m_hedgeAfter = beginRequest(token);
+	if ( cancelled() ) {
+		error = "Cancelled";
+		return false;
+	}
+
+	if ( ! parseUrl(url, error) ) {
+		return false;
+	}
+
+	m_sink = &sink;
+	m_retried = false;
+	m_hedged = false;
+	m_start = DriverClock::get().now();
+	m_deadline = m_start + std::chrono::milliseconds(TIMEOUT_MS);
+
+	if ( m_addrLen == 0 ) {
+		if ( ! resolve(error) ) {
+			return false;
+		}
+		if ( m_lookup != nullptr ) {
+			return true;
+		}
+	}
+	if ( ! open(m_conn, m_sink) ) {
+		error = m_conn.error;
+		return false;
+	}
+	return true;
+}
+
+void HttpTransport::collect(std::vector<struct pollfd> &fds, int &timeout) {
+	collectWake(fds);
+	m_fdIndex = fds.size();
+	short events = m_conn.events();
+	fds.push_back({events != 0 ? m_conn.fd : -1, events, 0});
+	events = m_hedge.events();
+	fds.push_back({events != 0 ? m_hedge.fd : -1, events, 0});
+	if ( m_lookup != nullptr ) {
+		fds.push_back({m_lookup->fd, POLLIN, 0});
+	}
+
+	auto now = DriverClock::get().now();
+	lowerTimeout(timeout, std::max(0., std::chrono::duration<double, std::milli>(m_deadline - now).count()) + 1);
+	if ( ! m_hedged && m_conn.events() != 0 && m_hedgeAfter > 0 ) {
+		double elapsed = std::chrono::duration<double>(now - m_start).count();
+		lowerTimeout(timeout, std::max(0., (m_hedgeAfter - elapsed) * 1000) + 1);
+	}
+}
+
+bool HttpTransport::advance(const std::vector<struct pollfd> &fds, bool &ok, std::string &error) {
+	drainWake();
+	if ( m_lookup != nullptr ) {
+		return lookedUp(ok, error);
+	}
+	if ( m_fdIndex + 1 < fds.size() ) {
+		if ( fds[m_fdIndex].fd >= 0 && fds[m_fdIndex].revents != 0 ) {
+			step(m_conn, fds[m_fdIndex].revents);
+		}
+		if ( fds[m_fdIndex + 1].fd >= 0 && fds[m_fdIndex + 1].revents != 0 ) {
+			step(m_hedge, fds[m_fdIndex + 1].revents);
+		}
+	}
+
+	Connection *winner = nullptr;
+	for (;;) {
+		if ( m_conn.state == Connection::DONE ) {
+			winner = &m_conn;
+			break;
+		}
+		if ( m_hedge.state == Connection::DONE ) {
+			winner = &m_hedge;
+			break;
+		}
+		// The device may have closed an idle keep-alive connection, that
+		// only shows once the request is sent, so try once more fresh
+		if ( m_conn.state == Connection::FAILED && m_conn.reused && ! m_retried && m_conn.received == 0 ) {
+			m_retried = true;
+			if ( ! open(m_conn, m_sink) ) {
+				break;
+			}
+		}
+		bool primaryActive = m_conn.events() != 0;
+		bool hedgeActive = m_hedge.events() != 0;
+		if ( ! primaryActive && ! hedgeActive ) {
+			break;
+		}
+		if ( cancelled() ) {
+			break;
+		}
+
+		auto now = DriverClock::get().now();
+		if ( now >= m_deadline ) {
+			m_timedOut = true;
+			if ( primaryActive ) {
+				fail(m_conn, "Timeout");
+			}
+			if ( hedgeActive ) {
+				fail(m_hedge, "Timeout");
+			}
+			break;
+		}
+		if ( ! m_hedged && primaryActive && m_hedgeAfter > 0 &&
+				std::chrono::duration<double>(now - m_start).count() >= m_hedgeAfter ) {
+			m_hedged = true;
+			if ( takeHedge() ) {
+				open(m_hedge, &m_hedgeSink);
+			}
+			continue;
+		}
+		return false;
+	}
+
+	ok = false;
+	if ( winner == nullptr ) {
+		error = cancelled() ? "Cancelled" :
+			! m_conn.error.empty() ? m_conn.error :
+			! m_hedge.error.empty() ? m_hedge.error : "Unknown error";
+		reset();
+		return true;
+	}
+
+	// Abort the loser, keep the winner around for the next request if the
+	// device allows it
+	Connection &loser = winner == &m_conn ? m_hedge : m_conn;
+	if ( loser.state != Connection::IDLE || loser.fd >= 0 ) {
+		loser.close();
+	}
+	if ( winner->keepAlive ) {
+		winner->state = Connection::IDLE;
+	} else {
+		winner->close();
+	}
+
+	bool hedgeWon = winner == &m_hedge;
+	if ( hedgeWon ) {
+		std::swap(m_conn, m_hedge);
+		m_sink->begin();
+		if ( ! m_sink->write(m_hedgeBody.data(), m_hedgeBody.size()) ) {
+			error = "Payload rejected";
+			return true;
+		}
+	}
+	finishRequest(std::chrono::duration<double>(DriverClock::get().now() - m_start).count(), hedgeWon);
+	ok = true;
+	return true;
+}
+
+void HttpTransport::abort() {
+	reset();
+}
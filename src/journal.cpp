@@ -0,0 +1,269 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <clock.h>
+#include <fcntl.h>
+#include <indilogger.h>
+#include <journal.h>
+#include <shmpub.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+JournalSink::JournalSink(const std::string &device, const std::string &path, size_t commitRecords,
+		double commitSeconds, size_t maxBytes) :
+	m_device(device), m_path(path), m_commitRecords(commitRecords > 0 ? commitRecords : 1),
+	m_commitSeconds(commitSeconds), m_maxBytes(maxBytes) {
+	m_buffer.reserve(16 * sizeof(CwsJournalRecord));
+}
+
+// Nothing that was handed over is left behind unsynced
+JournalSink::~JournalSink() {
+	takeEvents();
+	if ( ! m_buffer.empty() ) {
+		write();
+	}
+	close();
+}
+
+void JournalSink::addEvent(double time, uint32_t from, uint32_t to, const char *detail) {
+	CwsJournalEvent event;
+	memset(&event, 0, sizeof(event));
+	event.time = time;
+	event.from = from;
+	event.to = to;
+	snprintf(event.detail, sizeof(event.detail), "%s", detail);
+	std::lock_guard<std::mutex> lock(m_eventMutex);
+	m_events.push_back(event);
+}
+
+void JournalSink::record(const SampleRecord &record) {
+	CwsJournalRecord journal;
+	memset(&journal, 0, sizeof(journal));
+	journal.type = CWS_JOURNAL_SAMPLE;
+	toShmSample(record, journal.sample);
+	append(journal);
+}
+
+void JournalSink::flush() {
+	takeEvents();
+	if ( ! m_buffer.empty() ) {
+		write();
+	}
+	if ( m_unsynced > 0 && ( m_unsynced >= m_commitRecords ||
+			DriverClock::get().now() - m_firstUnsynced >= std::chrono::duration<double>(m_commitSeconds) ) ) {
+		sync();
+	}
+}
+
+// Events are written and the commit is made in time without samples
+void JournalSink::tick() {
+	flush();
+}
+
+// Numbered once the journal is open and the sequence is known
+void JournalSink::append(const CwsJournalRecord &record) {
+	m_buffer.append(reinterpret_cast<const char *>(&record), sizeof(record));
+}
+
+// Events follow the samples of the batch that caused them
+void JournalSink::takeEvents() {
+	{
+		std::lock_guard<std::mutex> lock(m_eventMutex);
+		m_takenEvents.swap(m_events);
+	}
+	for (const CwsJournalEvent &event : m_takenEvents) {
+		CwsJournalRecord journal;
+		memset(&journal, 0, sizeof(journal));
+		journal.type = CWS_JOURNAL_EVENT;
+		journal.event = event;
+		append(journal);
+	}
+	m_takenEvents.clear();
+}
+
+bool JournalSink::open() {
+	m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if ( m_fd < 0 ) {
+		LOGF_WARN("Could not open journal %s: %s", m_path.c_str(), strerror(errno));
+		return false;
+	}
+	if ( ! recover() ) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+// Number of records up to the last one with a valid CRC, the sequence
+// continues after it
+size_t JournalSink::scan(int fd, size_t size) {
+	size_t records = ( size - sizeof(CwsJournalHeader) ) / sizeof(CwsJournalRecord);
+	CwsJournalRecord record;
+	while ( records > 0 ) {
+		off_t offset = sizeof(CwsJournalHeader) + ( records - 1 ) * sizeof(CwsJournalRecord);
+		if ( pread(fd, &record, sizeof(record), offset) == sizeof(record) && record.crc == cwsJournalCrc(record) ) {
+			m_seq = std::max(m_seq, record.seq + 1);
+			break;
+		}
+		records--;
+	}
+	return records;
+}
+
+// A journal rotated away right before a restart still holds the sequence
+void JournalSink::recoverRotated() {
+	std::string path = m_path + ".1";
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if ( fd < 0 ) {
+		return;
+	}
+	struct stat st;
+	CwsJournalHeader header;
+	if ( fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(header) &&
+			pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+			memcmp(header.magic, CWS_JOURNAL_MAGIC, sizeof(CWS_JOURNAL_MAGIC)) == 0 &&
+			header.version == CWS_JOURNAL_VERSION && header.recordSize == sizeof(CwsJournalRecord) ) {
+		scan(fd, st.st_size);
+	}
+	::close(fd);
+}
+
+// Keeps the records up to the last one with a valid CRC and continues the
+// sequence from there. A file that is no journal is rotated away.
+bool JournalSink::recover() {
+	struct stat st;
+	if ( fstat(m_fd, &st) != 0 ) {
+		return false;
+	}
+	size_t size = st.st_size;
+	CwsJournalHeader header;
+	if ( size >= sizeof(header) && ( pread(m_fd, &header, sizeof(header), 0) != sizeof(header) ||
+			memcmp(header.magic, CWS_JOURNAL_MAGIC, sizeof(CWS_JOURNAL_MAGIC)) != 0 ||
+			header.version != CWS_JOURNAL_VERSION || header.recordSize != sizeof(CwsJournalRecord) ) ) {
+		LOGF_WARN("%s is no journal of this version, rotating it away", m_path.c_str());
+		rotate();
+		return m_fd >= 0;
+	}
+	if ( size < sizeof(header) ) {
+		recoverRotated();
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, CWS_JOURNAL_MAGIC, sizeof(CWS_JOURNAL_MAGIC));
+		header.version = CWS_JOURNAL_VERSION;
+		header.recordSize = sizeof(CwsJournalRecord);
+		snprintf(header.device, sizeof(header.device), "%s", m_device.c_str());
+		if ( ftruncate(m_fd, 0) != 0 || pwrite(m_fd, &header, sizeof(header), 0) != sizeof(header) ||
+				fdatasync(m_fd) != 0 ) {
+			LOGF_WARN("Could not write journal %s: %s", m_path.c_str(), strerror(errno));
+			return false;
+		}
+		m_size = sizeof(header);
+		return true;
+	}
+
+	size_t records = scan(m_fd, size);
+	if ( records == 0 ) {
+		recoverRotated();
+	}
+	m_size = sizeof(header) + records * sizeof(CwsJournalRecord);
+	if ( m_size != size ) {
+		LOGF_WARN("Cut %zu bytes of torn tail off journal %s", size - m_size, m_path.c_str());
+		return ftruncate(m_fd, m_size) == 0;
+	}
+	return true;
+}
+
+void JournalSink::rotate() {
+	close();
+	for (int i = KEEP - 1; i > 0; i--) {
+		rename((m_path + "." + std::to_string(i)).c_str(), (m_path + "." + std::to_string(i + 1)).c_str());
+	}
+	rename(m_path.c_str(), (m_path + ".1").c_str());
+	open();
+}
+
+void JournalSink::close() {
+	if ( m_fd >= 0 ) {
+		sync();
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+
+// A batch that cannot be written is dropped, the journal is opened again
+// with the next one and cut back to its last good record
+bool JournalSink::write() {
+	if ( m_fd < 0 && ! open() ) {
+		m_failed++;
+		m_buffer.clear();
+		return false;
+	}
+	if ( m_size >= m_maxBytes ) {
+		rotate();
+		if ( m_fd < 0 ) {
+			m_failed++;
+			m_buffer.clear();
+			return false;
+		}
+	}
+	for (size_t pos = 0; pos < m_buffer.size(); pos += sizeof(CwsJournalRecord)) {
+		CwsJournalRecord record;
+		memcpy(&record, &m_buffer[pos], sizeof(record));
+		record.seq = m_seq++;
+		record.crc = cwsJournalCrc(record);
+		memcpy(&m_buffer[pos], &record, sizeof(record));
+	}
+	size_t written = 0;
+	while ( written < m_buffer.size() ) {
+		ssize_t n = ::write(m_fd, m_buffer.data() + written, m_buffer.size() - written);
+		if ( n < 0 && errno == EINTR ) {
+			continue;
+		}
+		if ( n <= 0 ) {
+			LOGF_WARN("Could not write journal %s: %s", m_path.c_str(), strerror(errno));
+			m_failed++;
+			m_buffer.clear();
+			::close(m_fd);
+			m_fd = -1;
+			m_unsynced = 0;
+			return false;
+		}
+		written += n;
+	}
+	if ( m_unsynced == 0 ) {
+		m_firstUnsynced = DriverClock::get().now();
+	}
+	m_unsynced += m_buffer.size() / sizeof(CwsJournalRecord);
+	m_size += m_buffer.size();
+	m_buffer.clear();
+	return true;
+}
+
+// The group commit, one flush to disk for all records since the last
+void JournalSink::sync() {
+	if ( m_fd >= 0 && m_unsynced > 0 ) {
+		if ( fdatasync(m_fd) != 0 ) {
+			m_failed++;
+		}
+		m_unsynced = 0;
+	}
+}
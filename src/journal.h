@@ -0,0 +1,87 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cwjournal.h>
+#include <recorder.h>
+
+// Appends every sample and weather status change to a journal, see
+// cwjournal.h. Records are written with each batch but only synced to disk
+// every commitRecords records or commitSeconds, to keep an SD card from
+// wearing out. What a power cut left half written is cut off when the
+// journal is opened again. Past maxBytes the file is rotated.
+class JournalSink : public RecordSink {
+	public:
+		static constexpr int KEEP = 3;
+
+		JournalSink(const std::string &device, const std::string &path, size_t commitRecords,
+				double commitSeconds, size_t maxBytes);
+		~JournalSink();
+
+		void record(const SampleRecord &record) override;
+		void flush() override;
+		void tick() override;
+		uint64_t getFailed() const override { return m_failed; }
+
+		// From any thread, written with the next batch
+		void addEvent(double time, uint32_t from, uint32_t to, const char *detail);
+
+		const char *getDeviceName() {
+			return m_device.c_str();
+		}
+
+	private:
+		bool open();
+		bool recover();
+		size_t scan(int fd, size_t size);
+		void recoverRotated();
+		void rotate();
+		void close();
+		void append(const CwsJournalRecord &record);
+		void takeEvents();
+		bool write();
+		void sync();
+
+		std::string m_device;
+		std::string m_path;
+		size_t m_commitRecords;
+		double m_commitSeconds;
+		size_t m_maxBytes;
+
+		std::mutex m_eventMutex;
+		std::vector<CwsJournalEvent> m_events;
+		std::vector<CwsJournalEvent> m_takenEvents;
+
+		int m_fd = -1;
+		uint64_t m_seq = 0;
+		size_t m_size = 0;
+		std::string m_buffer;
+		size_t m_unsynced = 0;
+		std::chrono::steady_clock::time_point m_firstUnsynced;
+		std::atomic<uint64_t> m_failed{0};
+};
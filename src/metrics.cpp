@@ -0,0 +1,165 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <appendf.h>
+#include <chrono>
+#include <clock.h>
+#include <cmath>
+#include <cstdio>
+#include <metrics.h>
+
+const double Metrics::BUCKET_BOUNDS[BUCKETS] = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+static const char *OUTCOMES[Metrics::OUTCOME_COUNT] = {"ok", "failed", "timeout", "parse_error", "cancelled"};
+
+// Exported as cws_<name>, the same fields as RAW_FLOAT
+static const struct {
+	const char *name;
+	const char *help;
+	double Reading::*value;
+} FIELDS[] = {
+	{"clouds", "Sky minus ambient temperature [C]", &Reading::clouds},
+	{"temp", "Ambient temperature [C]", &Reading::temp},
+	{"wind", "Wind [km/h]", &Reading::wind},
+	{"gust", "Gust [km/h]", &Reading::gust},
+	{"rain", "Rain sensor [a.u.]", &Reading::rain},
+	{"lightmpsas", "Sky brightness [mag/arcsec^2]", &Reading::lightmpsas},
+	{"hum", "Humidity [%]", &Reading::hum},
+	{"dewp", "Dewpoint [C]", &Reading::dewp},
+	{"rawir", "Raw IR temperature [C]", &Reading::rawir},
+	{"abspress", "Absolute pressure [mbar]", &Reading::abspress},
+	{"relpress", "Relative pressure [mbar]", &Reading::relpress}
+};
+
+void Metrics::recordFetch(Outcome outcome, double seconds) {
+	m_outcomes[outcome].fetch_add(1, std::memory_order_relaxed);
+	if ( outcome != FETCH_OK ) {
+		return;
+	}
+	size_t bucket = 0;
+	while ( bucket < BUCKETS && seconds > BUCKET_BOUNDS[bucket] ) {
+		bucket++;
+	}
+	m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	m_latencySumUs.fetch_add(static_cast<uint64_t>(seconds * 1e6), std::memory_order_relaxed);
+}
+
+void Metrics::recordSample(const SampleRecord &record) {
+	m_latest.store(record);
+	if ( record.reading.scope == DECODE_ALL ) {
+		m_full.store(record);
+	}
+	m_polls[record.reading.scope == DECODE_ALL ? 0 : 1].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::render(const std::string &device, std::string &out) const {
+	std::string label;
+	for (char c : device) {
+		if ( c == '\\' || c == '"' ) {
+			label += '\\';
+		}
+		label += c == '\n' ? ' ' : c;
+	}
+	const char *dev = label.c_str();
+	out.clear();
+
+	SampleRecord latest;
+	SampleRecord full;
+	bool haveLatest = m_latest.load(latest) > 0;
+	bool haveFull = m_full.load(full) > 0;
+	if ( haveLatest ) {
+		for (const auto &field : FIELDS) {
+			double value = latest.reading.*field.value;
+			if ( std::isnan(value) && haveFull ) {
+				value = full.reading.*field.value;
+			}
+			if ( std::isnan(value) ) {
+				continue;
+			}
+			appendf(out, "# HELP cws_%s %s\n# TYPE cws_%s gauge\ncws_%s{device=\"%s\"} %.6g\n",
+					field.name, field.help, field.name, field.name, dev, value);
+		}
+		appendf(out, "# HELP cws_safe Device considers the weather safe\n# TYPE cws_safe gauge\n"
+				"cws_safe{device=\"%s\"} %d\n", dev, latest.reading.safe ? 1 : 0);
+		if ( haveFull ) {
+			appendf(out, "# HELP cws_switch Roof switch, 1 open\n# TYPE cws_switch gauge\n"
+					"cws_switch{device=\"%s\"} %d\n", dev, full.reading.sw);
+		}
+		double now = DriverClock::get().wallTime();
+		appendf(out, "# HELP cws_data_age_seconds Age of the newest sample\n# TYPE cws_data_age_seconds gauge\n"
+				"cws_data_age_seconds{device=\"%s\"} %.3f\n", dev, std::max(0., now - latest.time));
+	}
+
+	appendf(out, "# HELP cws_fetches_total Requests to the device by outcome\n# TYPE cws_fetches_total counter\n");
+	for (int outcome = 0; outcome < OUTCOME_COUNT; outcome++) {
+		appendf(out, "cws_fetches_total{device=\"%s\",outcome=\"%s\"} %llu\n", dev, OUTCOMES[outcome],
+				static_cast<unsigned long long>(m_outcomes[outcome].load(std::memory_order_relaxed)));
+	}
+
+	appendf(out, "# HELP cws_fetch_duration_seconds Duration of successful requests\n"
+			"# TYPE cws_fetch_duration_seconds histogram\n");
+	uint64_t count = 0;
+	for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+		count += m_buckets[bucket].load(std::memory_order_relaxed);
+		appendf(out, "cws_fetch_duration_seconds_bucket{device=\"%s\",le=\"%g\"} %llu\n", dev,
+				BUCKET_BOUNDS[bucket], static_cast<unsigned long long>(count));
+	}
+	count += m_buckets[BUCKETS].load(std::memory_order_relaxed);
+	appendf(out, "cws_fetch_duration_seconds_bucket{device=\"%s\",le=\"+Inf\"} %llu\n", dev,
+			static_cast<unsigned long long>(count));
+	appendf(out, "cws_fetch_duration_seconds_sum{device=\"%s\"} %.6f\n", dev,
+			m_latencySumUs.load(std::memory_order_relaxed) / 1e6);
+	appendf(out, "cws_fetch_duration_seconds_count{device=\"%s\"} %llu\n", dev,
+			static_cast<unsigned long long>(count));
+
+	appendf(out, "# HELP cws_polls_total Samples polled by lane\n# TYPE cws_polls_total counter\n"
+			"cws_polls_total{device=\"%s\",lane=\"slow\"} %llu\n"
+			"cws_polls_total{device=\"%s\",lane=\"fast\"} %llu\n", dev,
+			static_cast<unsigned long long>(m_polls[0].load(std::memory_order_relaxed)), dev,
+			static_cast<unsigned long long>(m_polls[1].load(std::memory_order_relaxed)));
+	appendf(out, "# HELP cws_fast_poll_period_seconds Configured fast polling period, 0 off\n"
+			"# TYPE cws_fast_poll_period_seconds gauge\n"
+			"cws_fast_poll_period_seconds{device=\"%s\"} %g\n", dev, m_pollPeriod.load());
+}
+
+void MetricsFileSink::setPath(const std::string &path) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_path = path;
+}
+
+void MetricsFileSink::flush() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if ( m_path.empty() ) {
+		return;
+	}
+	m_metrics.render(m_device, m_text);
+	std::string tmp = m_path + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if ( fp == nullptr ) {
+		return;
+	}
+	bool ok = fwrite(m_text.data(), 1, m_text.size(), fp) == m_text.size();
+	ok = fclose(fp) == 0 && ok;
+	if ( ! ok || rename(tmp.c_str(), m_path.c_str()) != 0 ) {
+		remove(tmp.c_str());
+	}
+}
@@ -0,0 +1,86 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include <recorder.h>
+#include <seqlock.h>
+
+// Sensor values and fetch statistics of one device in the Prometheus text
+// format. Recording only bumps counters and stores the sample, the text is
+// rendered when it is asked for, on the thread asking.
+class Metrics {
+	public:
+		enum Outcome {
+			FETCH_OK = 0,
+			FETCH_FAILED,
+			FETCH_TIMEOUT,
+			FETCH_PARSE_ERROR,
+			FETCH_CANCELLED,
+			OUTCOME_COUNT
+		};
+
+		static constexpr size_t BUCKETS = 11;
+		static const double BUCKET_BOUNDS[BUCKETS];
+
+		// Single writer each, the fetching thread
+		void recordFetch(Outcome outcome, double seconds);
+		void recordSample(const SampleRecord &record);
+		// From any thread
+		void setPollPeriod(double seconds) { m_pollPeriod = seconds; }
+
+		// From any thread
+		void render(const std::string &device, std::string &out) const;
+
+	private:
+		std::atomic<uint64_t> m_outcomes[OUTCOME_COUNT] = {};
+		std::atomic<uint64_t> m_buckets[BUCKETS + 1] = {};
+		std::atomic<uint64_t> m_latencySumUs{0};
+		std::atomic<uint64_t> m_polls[2] = {};
+		std::atomic<double> m_pollPeriod{0};
+		// Newest sample of either lane and newest full one for the fields
+		// the fast lane does not decode
+		SeqLock<SampleRecord> m_latest;
+		SeqLock<SampleRecord> m_full;
+};
+
+// Writes the metrics for the node_exporter textfile collector each time the
+// recorder drained its queue. The file is replaced atomically.
+class MetricsFileSink : public RecordSink {
+	public:
+		MetricsFileSink(const Metrics &metrics, const std::string &device) : m_metrics(metrics), m_device(device) {}
+
+		// An empty path stops writing
+		void setPath(const std::string &path);
+		void record(const SampleRecord &) override {}
+		void flush() override;
+
+	private:
+		const Metrics &m_metrics;
+		std::string m_device;
+		std::mutex m_mutex;
+		std::string m_path;
+		std::string m_text;
+};
@@ -0,0 +1,479 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <clock.h>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <indilogger.h>
+#include <mqtt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+static void appendLength(std::string &out, size_t len) {
+	do {
+		uint8_t byte = len & 0x7f;
+		len >>= 7;
+		out += static_cast<char>(len > 0 ? byte | 0x80 : byte);
+	} while ( len > 0 );
+}
+
+static void appendString(std::string &out, const std::string &str) {
+	out += static_cast<char>(str.size() >> 8);
+	out += static_cast<char>(str.size() & 0xff);
+	out += str;
+}
+
+MqttSink::MqttSink(const std::string &device, const std::string &broker, const std::string &topic,
+		const std::string &user, const std::string &password, int qos) :
+	m_device(device), m_broker(broker), m_topic(topic), m_user(user), m_password(password),
+	m_qos(qos > 0 ? 1 : 0) {
+	while ( ! m_topic.empty() && m_topic.back() == '/' ) {
+		m_topic.pop_back();
+	}
+	for (double &value : m_values) {
+		value = NAN;
+	}
+}
+
+MqttSink::~MqttSink() {
+	// A clean disconnect suppresses the will, so say goodbye ourselves
+	if ( m_state == CONNECTED ) {
+		publish(m_topic + "/status", "offline", 0, false);
+		m_out += "\xe0";
+		m_out += '\0';
+		sendOutput();
+	}
+	close();
+}
+
+void MqttSink::record(const SampleRecord &record) {
+	const Reading &reading = record.reading;
+	for (size_t i = 0; i < sizeof(EXPORT_FIELDS) / sizeof(EXPORT_FIELDS[0]); i++) {
+		double value = reading.*EXPORT_FIELDS[i].value;
+		if ( ! std::isnan(value) && value != m_values[i] ) {
+			m_values[i] = value;
+			m_dirty[i] = true;
+		}
+	}
+	if ( m_switch != reading.sw ) {
+		m_switch = reading.sw;
+		m_switchDirty = true;
+	}
+	if ( m_safe != reading.safe ) {
+		m_safe = reading.safe;
+		if ( m_transitions.size() >= MAX_TRANSITIONS ) {
+			m_transitions.erase(m_transitions.begin());
+			m_failed++;
+		}
+		m_transitions.push_back(reading.safe);
+	}
+}
+
+void MqttSink::flush() {
+	service();
+	if ( m_state == CONNECTED ) {
+		publishState(false);
+	}
+	if ( m_fd >= 0 ) {
+		sendOutput();
+	}
+}
+
+// Without samples coming in, so pings go out and a lost broker is noticed
+// and reconnected to
+void MqttSink::tick() {
+	service();
+	if ( m_fd >= 0 ) {
+		sendOutput();
+	}
+}
+
+// An address is taken right away, a name is looked up on a thread of its
+// own as getaddrinfo() may block for seconds and the recorder thread serves
+// every sink
+bool MqttSink::open() {
+	std::string host = m_broker;
+	std::string port = "1883";
+	size_t colon = host.rfind(':');
+	if ( colon != std::string::npos && host.find(']', colon) == std::string::npos ) {
+		port = host.substr(colon + 1);
+		host.erase(colon);
+	}
+	if ( host.size() > 2 && host.front() == '[' && host.back() == ']' ) {
+		host = host.substr(1, host.size() - 2);
+	}
+	m_deadline = DriverClock::get().now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(CONNECT_TIMEOUT));
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	struct addrinfo *res = nullptr;
+	int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+	if ( rc == 0 && res != nullptr ) {
+		bool ok = connectTo(res->ai_addr, res->ai_addrlen);
+		freeaddrinfo(res);
+		return ok;
+	}
+	if ( rc != EAI_NONAME ) {
+		fail(gai_strerror(rc));
+		return false;
+	}
+
+	std::shared_ptr<Lookup> lookup = std::make_shared<Lookup>();
+	try {
+		std::thread([lookup, host, port]() {
+			struct addrinfo hints;
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			struct addrinfo *res = nullptr;
+			lookup->result = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+			if ( lookup->result == 0 && res != nullptr ) {
+				memcpy(&lookup->addr, res->ai_addr, res->ai_addrlen);
+				lookup->addrLen = res->ai_addrlen;
+			} else if ( lookup->result == 0 ) {
+				lookup->result = EAI_NONAME;
+			}
+			if ( res != nullptr ) {
+				freeaddrinfo(res);
+			}
+			lookup->done.store(true, std::memory_order_release);
+		}).detach();
+	} catch (const std::system_error &e) {
+		fail("Could not resolve", e.code().value());
+		return false;
+	}
+	m_lookup = lookup;
+	m_state = RESOLVING;
+	return true;
+}
+
+bool MqttSink::connectTo(const struct sockaddr *addr, socklen_t addrLen) {
+	m_fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if ( m_fd < 0 ) {
+		fail("Could not create socket", errno);
+		return false;
+	}
+	int one = 1;
+	setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if ( connect(m_fd, addr, addrLen) == 0 ) {
+		sendConnect();
+	} else if ( errno == EINPROGRESS ) {
+		m_state = CONNECTING;
+	} else {
+		fail("Could not connect", errno);
+		return false;
+	}
+	return true;
+}
+
+// Never waits, whatever is not ready yet is looked at again next flush
+void MqttSink::service() {
+	auto now = DriverClock::get().now();
+	if ( m_state == DISCONNECTED ) {
+		if ( now < m_retryAt || ! open() ) {
+			return;
+		}
+	}
+	if ( m_state == RESOLVING && m_lookup->done.load(std::memory_order_acquire) ) {
+		std::shared_ptr<Lookup> lookup = std::move(m_lookup);
+		if ( lookup->result != 0 ) {
+			fail(gai_strerror(lookup->result));
+			return;
+		}
+		if ( ! connectTo(reinterpret_cast<const struct sockaddr *>(&lookup->addr), lookup->addrLen) ) {
+			return;
+		}
+	}
+	if ( m_state == CONNECTING ) {
+		struct pollfd pfd = {m_fd, POLLOUT, 0};
+		if ( poll(&pfd, 1, 0) > 0 ) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if ( err != 0 ) {
+				fail("Could not connect", err);
+				return;
+			}
+			sendConnect();
+		}
+	}
+	if ( m_state == HANDSHAKE || m_state == CONNECTED ) {
+		readPackets();
+	}
+	if ( m_state != DISCONNECTED && m_state != CONNECTED && now > m_deadline ) {
+		fail(m_state == RESOLVING ? "Timed out resolving" : "Timed out connecting");
+		return;
+	}
+	if ( m_state != CONNECTED ) {
+		return;
+	}
+	if ( m_pingPending && now - m_pingSent > std::chrono::duration<double>(PING_TIMEOUT) ) {
+		fail("No answer to ping");
+		return;
+	}
+	// Also while publishing, at QoS 0 a ping is the only thing answered
+	if ( ! m_pingPending && ( now - m_lastSent > std::chrono::seconds(KEEPALIVE / 2) ||
+			now - m_lastReceived > std::chrono::seconds(KEEPALIVE / 2) ) ) {
+		m_out += "\xc0";
+		m_out += '\0';
+		m_pingPending = true;
+		m_pingSent = now;
+	}
+}
+
+void MqttSink::fail(const char *what, int err) {
+	// Once per outage, not for every retry
+	if ( m_logFailure ) {
+		if ( err != 0 ) {
+			LOGF_WARN("MQTT broker %s: %s: %s", m_broker.c_str(), what, strerror(err));
+		} else {
+			LOGF_WARN("MQTT broker %s: %s", m_broker.c_str(), what);
+		}
+		m_logFailure = false;
+	}
+	close();
+	m_retryAt = DriverClock::get().now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(m_backoff));
+	m_backoff = std::min(m_backoff * 2, MAX_BACKOFF);
+}
+
+void MqttSink::close() {
+	if ( m_fd >= 0 ) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+	m_lookup = nullptr;
+	m_state = DISCONNECTED;
+	m_out.clear();
+	m_in.clear();
+}
+
+// Clean session, the broker publishes the will when the keepalive runs out
+void MqttSink::sendConnect() {
+	std::string clientId = "cws-";
+	for (char c : m_device) {
+		clientId += isalnum(static_cast<unsigned char>(c)) ? c : '-';
+	}
+	uint8_t flags = 0x02 | 0x04 | 0x20 | (m_qos << 3);
+	if ( ! m_user.empty() ) {
+		flags |= 0x80;
+		if ( ! m_password.empty() ) {
+			flags |= 0x40;
+		}
+	}
+	std::string body;
+	appendString(body, "MQTT");
+	body += static_cast<char>(4);
+	body += static_cast<char>(flags);
+	body += static_cast<char>(KEEPALIVE >> 8);
+	body += static_cast<char>(KEEPALIVE & 0xff);
+	appendString(body, clientId);
+	appendString(body, m_topic + "/status");
+	appendString(body, "offline");
+	if ( ! m_user.empty() ) {
+		appendString(body, m_user);
+		if ( ! m_password.empty() ) {
+			appendString(body, m_password);
+		}
+	}
+	m_out += '\x10';
+	appendLength(m_out, body.size());
+	m_out += body;
+	m_state = HANDSHAKE;
+}
+
+// Everything is retained, so a new subscriber gets the current state
+void MqttSink::publish(const std::string &topic, const char *payload, int qos, bool resend) {
+	std::string packet;
+	packet += static_cast<char>(0x31 | (qos << 1));
+	size_t payloadLen = strlen(payload);
+	appendLength(packet, 2 + topic.size() + (qos > 0 ? 2 : 0) + payloadLen);
+	appendString(packet, topic);
+	uint16_t id = 0;
+	if ( qos > 0 ) {
+		id = m_nextId++;
+		if ( m_nextId == 0 ) {
+			m_nextId = 1;
+		}
+		packet += static_cast<char>(id >> 8);
+		packet += static_cast<char>(id & 0xff);
+	}
+	packet.append(payload, payloadLen);
+	if ( qos > 0 && resend ) {
+		if ( m_inflight.size() >= MAX_INFLIGHT ) {
+			m_inflight.erase(m_inflight.begin());
+			m_failed++;
+		}
+		m_inflight.push_back({id, packet});
+	}
+	m_out += packet;
+}
+
+// Only what changed since the last batch, or everything after a connect
+void MqttSink::publishState(bool all) {
+	char value[32];
+	for (size_t i = 0; i < sizeof(EXPORT_FIELDS) / sizeof(EXPORT_FIELDS[0]); i++) {
+		if ( ( m_dirty[i] || all ) && ! std::isnan(m_values[i]) ) {
+			snprintf(value, sizeof(value), "%.6g", m_values[i]);
+			publish(m_topic + "/" + EXPORT_FIELDS[i].name, value, m_qos, false);
+		}
+		m_dirty[i] = false;
+	}
+	if ( ( m_switchDirty || all ) && m_switch >= 0 ) {
+		publish(m_topic + "/switch", m_switch == OPEN ? "open" : "closed", m_qos, false);
+	}
+	m_switchDirty = false;
+	if ( all && m_transitions.empty() && m_safe >= 0 ) {
+		m_transitions.push_back(m_safe);
+	}
+	for (bool safe : m_transitions) {
+		publish(m_topic + "/safety", safe ? "safe" : "unsafe", m_qos, true);
+	}
+	m_transitions.clear();
+}
+
+void MqttSink::readPackets() {
+	char buf[4096];
+	for (;;) {
+		ssize_t n = recv(m_fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if ( n > 0 ) {
+			m_in.append(buf, n);
+			continue;
+		}
+		if ( n == 0 ) {
+			fail("Connection closed by broker");
+			return;
+		}
+		if ( errno == EINTR ) {
+			continue;
+		}
+		if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+			fail("Connection lost", errno);
+			return;
+		}
+		break;
+	}
+
+	size_t pos = 0;
+	while ( m_in.size() - pos >= 2 ) {
+		size_t len = 0;
+		size_t header = 1;
+		bool complete = false;
+		for (int shift = 0; header < 5 && pos + header < m_in.size(); shift += 7) {
+			uint8_t byte = m_in[pos + header++];
+			len |= static_cast<size_t>(byte & 0x7f) << shift;
+			if ( ( byte & 0x80 ) == 0 ) {
+				complete = true;
+				break;
+			}
+		}
+		if ( ! complete || m_in.size() - pos < header + len ) {
+			if ( header >= 5 || len > MAX_OUTPUT ) {
+				fail("Invalid packet from broker");
+				return;
+			}
+			break;
+		}
+		const uint8_t *body = reinterpret_cast<const uint8_t *>(m_in.data() + pos + header);
+		m_lastReceived = DriverClock::get().now();
+		switch (static_cast<uint8_t>(m_in[pos]) >> 4) {
+			case 2:
+				// CONNACK
+				if ( len < 2 || body[1] != 0 ) {
+					char what[64];
+					snprintf(what, sizeof(what), "Connection refused with code %d", len < 2 ? -1 : body[1]);
+					fail(what);
+					return;
+				}
+				LOGF_INFO("Publishing to MQTT broker %s below %s", m_broker.c_str(), m_topic.c_str());
+				m_state = CONNECTED;
+				m_pingPending = false;
+				m_backoff = 1;
+				m_logFailure = true;
+				for (Inflight &inflight : m_inflight) {
+					inflight.packet[0] |= 0x08;
+					m_out += inflight.packet;
+				}
+				publish(m_topic + "/status", "online", 0, false);
+				publishState(true);
+				break;
+			case 4:
+				// PUBACK
+				if ( len >= 2 ) {
+					uint16_t id = body[0] << 8 | body[1];
+					for (auto it = m_inflight.begin(); it != m_inflight.end(); ++it) {
+						if ( it->id == id ) {
+							m_inflight.erase(it);
+							break;
+						}
+					}
+				}
+				break;
+			case 13:
+				// PINGRESP
+				m_pingPending = false;
+				break;
+			default:
+				// Anything else we did not ask for
+				break;
+		}
+		pos += header + len;
+	}
+	m_in.erase(0, pos);
+}
+
+// A broker that does not keep up is dropped along with what was queued
+bool MqttSink::sendOutput() {
+	while ( ! m_out.empty() && m_state != CONNECTING ) {
+		ssize_t n = send(m_fd, m_out.data(), m_out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		if ( n > 0 ) {
+			m_out.erase(0, n);
+			m_lastSent = DriverClock::get().now();
+			continue;
+		}
+		if ( n < 0 && errno == EINTR ) {
+			continue;
+		}
+		if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+			break;
+		}
+		fail("Connection lost", errno);
+		return false;
+	}
+	if ( m_out.size() > MAX_OUTPUT ) {
+		m_failed++;
+		fail("Broker does not keep up");
+		return false;
+	}
+	return true;
+}
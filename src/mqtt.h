@@ -0,0 +1,135 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+#include <export.h>
+
+// Publishes samples to an MQTT 3.1.1 broker, one retained topic per value
+// below the topic prefix plus safety, switch and a status topic the broker
+// sets to offline when the driver goes away. Runs on the recorder thread
+// on a non-blocking socket, each flush and tick advances the connection,
+// reconnects with backoff and keeps it alive. A broker given by name is
+// looked up on a thread of its own, one that stops answering pings is
+// dropped. A flush also sends the values changed in the batch in one go.
+// Safety transitions are sent one by one, anything else only as its latest
+// value. With QoS 1 unacknowledged transitions are sent again on reconnect,
+// the latest values are sent anyway.
+class MqttSink : public RecordSink {
+	public:
+		static constexpr int KEEPALIVE = 60;
+		static constexpr double CONNECT_TIMEOUT = 10;
+		// A half-open connection still takes data, only the missing
+		// answer to a ping tells
+		static constexpr double PING_TIMEOUT = 1.5 * KEEPALIVE;
+		static constexpr double MAX_BACKOFF = 60;
+		static constexpr size_t MAX_INFLIGHT = 64;
+		static constexpr size_t MAX_TRANSITIONS = 32;
+		static constexpr size_t MAX_OUTPUT = 65536;
+
+		// broker is host[:port], the port defaults to 1883
+		MqttSink(const std::string &device, const std::string &broker, const std::string &topic,
+				const std::string &user, const std::string &password, int qos);
+		~MqttSink();
+
+		void record(const SampleRecord &record) override;
+		void flush() override;
+		void tick() override;
+		uint64_t getFailed() const override { return m_failed; }
+
+		const char *getDeviceName() {
+			return m_device.c_str();
+		}
+
+	private:
+		enum State {
+			DISCONNECTED,
+			RESOLVING,
+			CONNECTING,
+			HANDSHAKE,
+			CONNECTED
+		};
+
+		struct Inflight {
+			uint16_t id;
+			std::string packet;
+		};
+
+		// Kept alive by the lookup thread should the sink give up on it
+		struct Lookup {
+			std::atomic<bool> done{false};
+			int result = 0;
+			struct sockaddr_storage addr;
+			socklen_t addrLen = 0;
+		};
+
+		bool open();
+		bool connectTo(const struct sockaddr *addr, socklen_t addrLen);
+		void service();
+		void fail(const char *what, int err = 0);
+		void close();
+		void sendConnect();
+		// Only resent messages are kept until acknowledged
+		void publish(const std::string &topic, const char *payload, int qos, bool resend);
+		void publishState(bool all);
+		void readPackets();
+		bool sendOutput();
+
+		std::string m_device;
+		std::string m_broker;
+		std::string m_topic;
+		std::string m_user;
+		std::string m_password;
+		int m_qos;
+
+		State m_state = DISCONNECTED;
+		int m_fd = -1;
+		std::shared_ptr<Lookup> m_lookup = nullptr;
+		std::chrono::steady_clock::time_point m_deadline;
+		std::chrono::steady_clock::time_point m_retryAt;
+		std::chrono::steady_clock::time_point m_lastSent;
+		std::chrono::steady_clock::time_point m_lastReceived;
+		std::chrono::steady_clock::time_point m_pingSent;
+		bool m_pingPending = false;
+		double m_backoff = 1;
+		bool m_logFailure = true;
+		uint16_t m_nextId = 1;
+		std::string m_out;
+		std::string m_in;
+		std::vector<Inflight> m_inflight;
+
+		// Latest values, sent when dirty
+		double m_values[sizeof(EXPORT_FIELDS) / sizeof(EXPORT_FIELDS[0])];
+		bool m_dirty[sizeof(EXPORT_FIELDS) / sizeof(EXPORT_FIELDS[0])] = {};
+		int m_switch = -1;
+		bool m_switchDirty = false;
+		int m_safe = -1;
+		std::vector<bool> m_transitions;
+		std::atomic<uint64_t> m_failed{0};
+};
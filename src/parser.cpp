@@ -0,0 +1,379 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <indilogger.h>
+#include <parser.h>
+#include <probes.h>
+
+static const struct {
+	const char *name;
+	bool critical;
+	double CloudwatcherData::*value;
+} KEYS[KEY_COUNT] = {
+	{"dataGMTTime", true, nullptr},
+	{"cwinfo", false, nullptr},
+	{"clouds", true, &CloudwatcherData::clouds},
+	{"temp", false, &CloudwatcherData::temp},
+	{"wind", true, &CloudwatcherData::wind},
+	{"gust", true, &CloudwatcherData::gust},
+	{"rain", true, &CloudwatcherData::rain},
+	{"lightmpsas", false, &CloudwatcherData::lightmpsas},
+	{"switch", false, nullptr},
+	{"safe", true, nullptr},
+	{"hum", false, &CloudwatcherData::hum},
+	{"dewp", false, &CloudwatcherData::dewp},
+	{"rawir", false, &CloudwatcherData::rawir},
+	{"abspress", false, &CloudwatcherData::abspress},
+	{"relpress", false, &CloudwatcherData::relpress}
+};
+
+static int lookupKey(const char *name) {
+	for (int key = 0; key < KEY_COUNT; key++) {
+		if ( strcmp(name, KEYS[key].name) == 0 ) {
+			return key;
+		}
+	}
+	return KEY_UNKNOWN;
+}
+
+static std::string trim(const std::string &str) {
+	size_t begin = str.find_first_not_of(' ');
+	if ( begin == std::string::npos ) {
+		return "";
+	}
+	return str.substr(begin, str.find_last_not_of(' ') - begin + 1);
+}
+
+// Comma separated "Key: value" pairs, e.g. "Serial: 2180, FW: 5.89"
+DeviceInfo::DeviceInfo(const std::string &cwinfo) : cwinfo(cwinfo) {
+	size_t pos = 0;
+	while ( pos < cwinfo.size() ) {
+		size_t end = cwinfo.find(',', pos);
+		if ( end == std::string::npos ) {
+			end = cwinfo.size();
+		}
+		std::string item = cwinfo.substr(pos, end - pos);
+		size_t colon = item.find(':');
+		if ( colon != std::string::npos ) {
+			std::string key = trim(item.substr(0, colon));
+			std::string value = trim(item.substr(colon + 1));
+			if ( key == "Serial" ) {
+				serial = value;
+			} else if ( key == "FW" ) {
+				firmware = value;
+			}
+		}
+		pos = end + 1;
+	}
+}
+
+void CloudwatcherData::clear() {
+	scope = DECODE_ALL;
+	date.clear();
+	device = nullptr;
+	sw = CLOSED;
+	safe = false;
+	for (int key = 0; key < KEY_COUNT; key++) {
+		if ( KEYS[key].value != nullptr ) {
+			this->*KEYS[key].value = NAN;
+		}
+	}
+}
+
+void CloudwatcherData::snapshot(Reading &reading) const {
+	reading.scope = scope;
+	strncpy(reading.date, date.c_str(), sizeof(reading.date) - 1);
+	reading.date[sizeof(reading.date) - 1] = '\0';
+	reading.sw = sw;
+	reading.safe = safe;
+	reading.clouds = clouds;
+	reading.temp = temp;
+	reading.lightmpsas = lightmpsas;
+	reading.rawir = rawir;
+	reading.wind = wind;
+	reading.gust = gust;
+	reading.rain = rain;
+	reading.hum = hum;
+	reading.dewp = dewp;
+	reading.abspress = abspress;
+	reading.relpress = relpress;
+}
+
+void CloudwatcherParser::reset(CloudwatcherData *data, DecodeScope scope, std::string *raw,
+		PayloadSchema *schema) {
+	m_data = data;
+	m_scope = scope;
+	m_raw = raw;
+	m_schema = schema;
+	begin();
+}
+
+void CloudwatcherParser::begin() {
+	CWS_PROBE1(parse__start, getDeviceName());
+	m_data->clear();
+	m_data->scope = m_scope;
+	m_extraCount = 0;
+	m_fields = 0;
+	m_unknown = 0;
+	if ( m_raw != nullptr ) {
+		m_raw->clear();
+	}
+	m_lineLen = 0;
+	m_total = 0;
+	m_error = nullptr;
+	m_positional = m_schema != nullptr && m_schema->valid();
+	m_position = 0;
+	m_learned.clear();
+}
+
+bool CloudwatcherParser::fail(const char *error) {
+	m_error = error;
+	return false;
+}
+
+bool CloudwatcherParser::write(const char *chunk, size_t len) {
+	if ( m_error != nullptr ) {
+		return false;
+	}
+	m_total += len;
+	if ( m_total > MAX_BODY ) {
+		return fail("Payload too large");
+	}
+	if ( m_raw != nullptr ) {
+		m_raw->append(chunk, len);
+	}
+
+	while ( len > 0 ) {
+		const char *nl = static_cast<const char *>(memchr(chunk, '\n', len));
+		size_t n = nl != nullptr ? nl - chunk : len;
+		if ( m_lineLen + n > MAX_LINE ) {
+			return fail("Line too long");
+		}
+		memcpy(m_line + m_lineLen, chunk, n);
+		m_lineLen += n;
+		if ( nl == nullptr ) {
+			break;
+		}
+		parseLine(m_line, m_lineLen);
+		m_lineLen = 0;
+		chunk = nl + 1;
+		len -= n + 1;
+	}
+	return true;
+}
+
+bool CloudwatcherParser::finish() {
+	bool ok = complete();
+	CWS_PROBE4(parse__end, getDeviceName(), ok, m_fields, m_unknown);
+	return ok;
+}
+
+bool CloudwatcherParser::complete() {
+	if ( m_error != nullptr ) {
+		return false;
+	}
+	if ( m_lineLen > 0 ) {
+		parseLine(m_line, m_lineLen);
+		m_lineLen = 0;
+	}
+	m_data->extra.resize(m_extraCount);
+
+	if ( m_data->date == "" ) {
+		return fail("Required field date not found");
+	}
+	if ( std::isnan(m_data->clouds) ) {
+		return fail("Required field clouds not found");
+	}
+	if ( m_scope == DECODE_ALL ) {
+		if ( m_data->device == nullptr ) {
+			return fail("Required field cwinfo not found");
+		}
+		if ( std::isnan(m_data->lightmpsas) ) {
+			return fail("Required filed lightmpsas not found");
+		}
+		if ( std::isnan(m_data->temp) ) {
+			return fail("Required field temp not found");
+		}
+	}
+
+	if ( m_schema != nullptr ) {
+		if ( m_positional && m_position == m_schema->slots.size() ) {
+			m_schema->hits++;
+		} else if ( m_positional ) {
+			// Ended early but matched so far, nothing new to learn from it
+			m_schema->misses++;
+		} else {
+			m_schema->misses++;
+			learn();
+		}
+	}
+	return true;
+}
+
+// Only a complete payload tells the whole layout of a firmware
+void CloudwatcherParser::learn() {
+	if ( m_scope != DECODE_ALL ) {
+		return;
+	}
+	if ( ! m_schema->valid() ) {
+		LOGF_INFO("Learned payload layout of firmware %s", m_data->device->firmware.c_str());
+	}
+	for (const PayloadSchema::Slot &slot : m_learned) {
+		if ( slot.key != KEY_UNKNOWN ) {
+			continue;
+		}
+		bool known = false;
+		for (const PayloadSchema::Slot &old : m_schema->slots) {
+			known = known || old.name == slot.name;
+		}
+		if ( ! known ) {
+			LOGF_INFO("Publishing unknown key %s as raw value", slot.name.c_str());
+		}
+	}
+	m_schema->slots.swap(m_learned);
+}
+
+bool CloudwatcherParser::decodeValue(int key, const char *name, const char *value) {
+	m_fields++;
+	if ( key == KEY_UNKNOWN ) {
+		m_unknown++;
+		if ( m_scope != DECODE_ALL ) {
+			return true;
+		}
+		// Overwritten in place, a reused sample keeps its strings
+		if ( m_extraCount < m_data->extra.size() ) {
+			m_data->extra[m_extraCount].first = name;
+			m_data->extra[m_extraCount].second = value;
+		} else {
+			m_data->extra.emplace_back(name, value);
+		}
+		m_extraCount++;
+		return true;
+	}
+	if ( key == KEY_CWINFO ) {
+		return decodeDevice(value);
+	}
+	if ( m_scope == DECODE_CRITICAL && ! KEYS[key].critical ) {
+		return true;
+	}
+
+	char *end;
+	switch ( key ) {
+		case KEY_DATE:
+			if ( *value == '\0' ) {
+				return false;
+			}
+			m_data->date = value;
+			return true;
+		case KEY_SWITCH:
+		case KEY_SAFE: {
+			long valInt = strtol(value, &end, 10);
+			if ( end == value ) {
+				return false;
+			}
+			if ( key == KEY_SWITCH ) {
+				m_data->sw = static_cast<SwitchState>(valInt);
+			} else {
+				m_data->safe = valInt ? true : false;
+			}
+			return true;
+		}
+		default: {
+			double valDouble = strtod(value, &end);
+			if ( end == value ) {
+				return false;
+			}
+			m_data->*KEYS[key].value = valDouble;
+			return true;
+		}
+	}
+}
+
+// The device info is only parsed again if cwinfo changed, which is checked
+// in every scope as it invalidates the learned layout
+bool CloudwatcherParser::decodeDevice(const char *cwinfo) {
+	if ( *cwinfo == '\0' ) {
+		return false;
+	}
+	const std::shared_ptr<const DeviceInfo> &known = m_schema != nullptr ? m_schema->device : m_knownDevice;
+	if ( known != nullptr && known->cwinfo == cwinfo ) {
+		m_data->device = known;
+		return true;
+	}
+	m_data->device = std::make_shared<const DeviceInfo>(cwinfo);
+	if ( m_schema != nullptr ) {
+		if ( m_schema->device != nullptr ) {
+			LOGF_WARN("Device changed to %s, learning its payload layout again", cwinfo);
+		}
+		m_schema->device = m_data->device;
+		m_schema->slots.clear();
+	}
+	return true;
+}
+
+void CloudwatcherParser::parseLine(char *str, size_t len) {
+	if ( len > 0 && str[len - 1] == '\r' ) {
+		len--;
+	}
+	str[len] = '\0';
+	if ( len == 0 ) {
+		return;
+	}
+	char *eq = static_cast<char *>(memchr(str, '=', len));
+
+	// Fast path, the line has to carry the key the schema expects next and
+	// the firmware has to be the one the schema was learned from
+	if ( m_positional ) {
+		const PayloadSchema::Slot *slot = m_position < m_schema->slots.size() ?
+			&m_schema->slots[m_position] : nullptr;
+		if ( slot != nullptr && eq != nullptr &&
+				static_cast<size_t>(eq - str) == slot->name.size() &&
+				memcmp(str, slot->name.data(), slot->name.size()) == 0 &&
+				(slot->key != KEY_CWINFO || m_schema->device->cwinfo == eq + 1) ) {
+			*eq = '\0';
+			m_position++;
+			if ( ! decodeValue(slot->key, str, eq + 1) ) {
+				*eq = '=';
+				LOGF_WARN("Did not understand value: %s", str);
+			}
+			return;
+		}
+		// Learn the new layout from here on, keeping what did match
+		m_positional = false;
+		m_learned.assign(m_schema->slots.begin(), m_schema->slots.begin() + m_position);
+	}
+
+	if ( eq == nullptr ) {
+		LOGF_WARN("Did not understand value: %s", str);
+		return;
+	}
+	*eq = '\0';
+	int key = lookupKey(str);
+	if ( m_schema != nullptr ) {
+		m_learned.push_back({str, key});
+	}
+	if ( ! decodeValue(key, str, eq + 1) ) {
+		*eq = '=';
+		LOGF_WARN("Did not understand value: %s", str);
+	}
+}
@@ -0,0 +1,197 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <transport.h>
+
+enum SwitchState {
+	CLOSED = 0,
+	OPEN = 1
+};
+
+// How much of a payload to decode, the fast lane only needs the fields
+// feeding the critical weather parameters
+enum DecodeScope {
+	DECODE_ALL = 0,
+	DECODE_CRITICAL = 1
+};
+
+// Plain copy of the values of a sample, so it can be handed between threads
+// without sharing the sample itself
+struct Reading {
+	DecodeScope scope;
+	char date[32];
+	SwitchState sw;
+	bool safe;
+	double clouds;
+	double temp;
+	double lightmpsas;
+	double rawir;
+	double wind;
+	double gust;
+	double rain;
+	double hum;
+	double dewp;
+	double abspress;
+	double relpress;
+};
+
+// Static identity of the device, sent as cwinfo with every payload
+class DeviceInfo {
+	public:
+		explicit DeviceInfo(const std::string &cwinfo);
+		std::string cwinfo;
+		std::string serial = "";
+		std::string firmware = "";
+};
+
+class CloudwatcherData {
+	public:
+		// Unknown keys a reused sample has room for up front, so it does not
+		// grow the first time it is decoded in full
+		static constexpr size_t EXTRA_RESERVE = 16;
+
+		// Resets the values but keeps the buffers, so a reused sample does
+		// not allocate. extra is left to the parser, which overwrites it.
+		void clear();
+		void snapshot(Reading &reading) const;
+		DecodeScope scope = DECODE_ALL;
+		std::string date = "";
+		// Shared by all samples as long as cwinfo does not change
+		std::shared_ptr<const DeviceInfo> device = nullptr;
+		SwitchState sw = CLOSED;
+		bool safe = false;
+		double clouds = NAN;
+		double temp = NAN;
+		double lightmpsas = NAN;
+		double rawir = NAN;
+		double wind = NAN;
+		double gust = NAN;
+		double rain = NAN;
+		double hum = NAN;
+		double dewp = NAN;
+		double abspress = NAN;
+		double relpress = NAN;
+		// Keys the driver does not know about, in payload order
+		std::vector<std::pair<std::string, std::string>> extra;
+};
+
+enum PayloadKey {
+	KEY_UNKNOWN = -1,
+	KEY_DATE = 0,
+	KEY_CWINFO,
+	KEY_CLOUDS,
+	KEY_TEMP,
+	KEY_WIND,
+	KEY_GUST,
+	KEY_RAIN,
+	KEY_LIGHTMPSAS,
+	KEY_SWITCH,
+	KEY_SAFE,
+	KEY_HUM,
+	KEY_DEWP,
+	KEY_RAWIR,
+	KEY_ABSPRESS,
+	KEY_RELPRESS,
+	KEY_COUNT
+};
+
+// Key sequence a firmware sends, learned from its first good payload. As
+// long as payloads follow it every line is decoded by position. A
+// different cwinfo means another device or firmware and drops the layout.
+class PayloadSchema {
+	public:
+		struct Slot {
+			std::string name;
+			int key;
+		};
+
+		bool valid() const { return ! slots.empty(); }
+
+		std::shared_ptr<const DeviceInfo> device = nullptr;
+		std::vector<Slot> slots;
+		std::atomic<uint64_t> hits{0};
+		std::atomic<uint64_t> misses{0};
+};
+
+// Line oriented decoder fed with the payload as it comes off the wire.
+// Partial lines are carried over in a fixed buffer, oversize lines or
+// bodies make write() fail so the transfer is aborted right away.
+class CloudwatcherParser : public BodySink {
+	public:
+		static constexpr size_t MAX_LINE = 256;
+		static constexpr size_t MAX_BODY = 16384;
+
+		const char *getDeviceName() {
+			return m_deviceName.c_str();
+		}
+		// Messages are logged for this device
+		void setDeviceName(const std::string &name) { m_deviceName = name; }
+
+		// Decode into data from now on, begin() is called by the transport.
+		// The payload is also kept in raw and the layout is learned into
+		// or followed from schema if given.
+		void reset(CloudwatcherData *data, DecodeScope scope, std::string *raw = nullptr,
+				PayloadSchema *schema = nullptr);
+		// Reuse this device info for a matching cwinfo when there is no schema
+		void setKnownDevice(const std::shared_ptr<const DeviceInfo> &device) { m_knownDevice = device; }
+		void begin() override;
+		bool write(const char *chunk, size_t len) override;
+		// Handles a last line without newline and checks the required fields
+		bool finish();
+
+		const char *getError() const { return m_error; }
+
+	private:
+		void parseLine(char *line, size_t len);
+		bool decodeValue(int key, const char *name, const char *value);
+		bool decodeDevice(const char *cwinfo);
+		void learn();
+		bool complete();
+		bool fail(const char *error);
+
+		std::string m_deviceName = "Decoder";
+		CloudwatcherData *m_data = nullptr;
+		DecodeScope m_scope = DECODE_ALL;
+		std::string *m_raw = nullptr;
+		PayloadSchema *m_schema = nullptr;
+		std::shared_ptr<const DeviceInfo> m_knownDevice = nullptr;
+		size_t m_extraCount = 0;
+		// Lines decoded and those with keys the decoder does not know, for
+		// the parse__end probe
+		size_t m_fields = 0;
+		size_t m_unknown = 0;
+		bool m_positional = false;
+		size_t m_position = 0;
+		std::vector<PayloadSchema::Slot> m_learned;
+		char m_line[MAX_LINE + 1];
+		size_t m_lineLen = 0;
+		size_t m_total = 0;
+		const char *m_error = nullptr;
+};
@@ -0,0 +1,56 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+// Static tracepoints of provider cws for bpftrace and perf, e.g.
+//
+//   bpftrace -e 'usdt:./indi_aagcloudwatcher_solo:cws:fetch__end { @[arg2] = count(); }'
+//
+// Only built in when configured with --enable-usdt. Each probe is a single
+// nop until a tracer attaches, so its arguments must be cheap to compute.
+//
+//   fetch__start   device, scope
+//   fetch__end     device, transport, outcome, bytes, latency [us], error
+//   parse__start   device
+//   parse__end     device, ok, fields, unknown keys
+//   publish        device, property
+//   weather__state device, from, to (IPState)
+
+#ifdef CWS_USDT
+
+#include <sys/sdt.h>
+
+#define CWS_PROBE1(name, a) DTRACE_PROBE1(cws, name, a)
+#define CWS_PROBE2(name, a, b) DTRACE_PROBE2(cws, name, a, b)
+#define CWS_PROBE3(name, a, b, c) DTRACE_PROBE3(cws, name, a, b, c)
+#define CWS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(cws, name, a, b, c, d)
+#define CWS_PROBE6(name, a, b, c, d, e, f) DTRACE_PROBE6(cws, name, a, b, c, d, e, f)
+
+#else
+
+#define CWS_PROBE1(name, a) do {} while ( 0 )
+#define CWS_PROBE2(name, a, b) do {} while ( 0 )
+#define CWS_PROBE3(name, a, b, c) do {} while ( 0 )
+#define CWS_PROBE4(name, a, b, c, d) do {} while ( 0 )
+#define CWS_PROBE6(name, a, b, c, d, e, f) do {} while ( 0 )
+
+#endif
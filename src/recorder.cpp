@@ -0,0 +1,138 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <clock.h>
+#include <recorder.h>
+
+Recorder::~Recorder() {
+	stop();
+}
+
+void Recorder::addSink(std::unique_ptr<RecordSink> sink) {
+	if ( m_thread.joinable() ) {
+		return;
+	}
+	m_sinks.push_back(std::move(sink));
+}
+
+void Recorder::clearSinks() {
+	if ( m_thread.joinable() ) {
+		return;
+	}
+	m_sinks.clear();
+}
+
+void Recorder::setBatch(size_t samples, double seconds) {
+	if ( m_thread.joinable() ) {
+		return;
+	}
+	m_batchSamples = std::max<size_t>(1, std::min(samples, QUEUE_SIZE / 2));
+	m_batchSeconds = seconds;
+}
+
+uint64_t Recorder::getFailed() const {
+	uint64_t failed = 0;
+	for (const std::unique_ptr<RecordSink> &sink : m_sinks) {
+		failed += sink->getFailed();
+	}
+	return failed;
+}
+
+void Recorder::start() {
+	if ( m_thread.joinable() || m_sinks.empty() ) {
+		return;
+	}
+	m_stop = false;
+	m_unsignaled = 0;
+	m_batchFull = false;
+	m_thread = std::thread(&Recorder::run, this);
+	m_running = true;
+}
+
+void Recorder::stop() {
+	m_running = false;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+	if ( m_thread.joinable() ) {
+		m_thread.join();
+	}
+}
+
+// Without the mutex the wakeup can be missed, the consumer then picks the
+// sample up on its next timeout
+void Recorder::push(const SampleRecord &record) {
+	if ( ! m_running ) {
+		return;
+	}
+	m_ring.push(record);
+	if ( ++m_unsignaled >= m_batchSamples ) {
+		m_unsignaled = 0;
+		m_batchFull = true;
+		m_cond.notify_one();
+	}
+}
+
+void Recorder::drain() {
+	SampleRecord record;
+	bool any = false;
+	while ( m_ring.pop(record) ) {
+		for (std::unique_ptr<RecordSink> &sink : m_sinks) {
+			sink->record(record);
+		}
+		any = true;
+	}
+	if ( any ) {
+		for (std::unique_ptr<RecordSink> &sink : m_sinks) {
+			sink->flush();
+		}
+	}
+}
+
+void Recorder::run() {
+	auto batch = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(m_batchSeconds));
+	auto tick = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(TICK));
+	auto due = DriverClock::get().now();
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while ( ! m_stop ) {
+		lock.unlock();
+		auto now = DriverClock::get().now();
+		if ( m_batchFull.exchange(false) || now >= due ) {
+			drain();
+			due = now + batch;
+		}
+		for (std::unique_ptr<RecordSink> &sink : m_sinks) {
+			sink->tick();
+		}
+		lock.lock();
+		if ( ! m_stop ) {
+			DriverClock::get().waitUntil(m_cond, lock, std::min(due, DriverClock::get().now() + tick));
+		}
+	}
+	lock.unlock();
+	drain();
+}
@@ -0,0 +1,101 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <parser.h>
+#include <ring.h>
+
+// One fetched sample as it is recorded
+struct SampleRecord {
+	// Seconds since the epoch when the sample was fetched
+	double time;
+	Reading reading;
+};
+
+// Gets every recorded sample on the recorder thread
+class RecordSink {
+	public:
+		virtual ~RecordSink() = default;
+		virtual void record(const SampleRecord &record) = 0;
+		// Called once the queue is drained
+		virtual void flush() {}
+		// Called on every wakeup of the recorder, whether samples came in
+		// or not, for work that is due by time
+		virtual void tick() {}
+		// Batches that could not be written and were dropped
+		virtual uint64_t getFailed() const { return 0; }
+};
+
+// Moves samples from the polling thread to the sinks. Polling never waits
+// for the sinks, if they fall too far behind the oldest samples are
+// dropped and counted. The sinks get the samples in batches, once enough
+// are queued or the oldest has waited long enough. The recorder wakes up
+// at least every TICK seconds in between to tick the sinks.
+class Recorder {
+	public:
+		static constexpr size_t QUEUE_SIZE = 256;
+		static constexpr double TICK = 1;
+
+		~Recorder();
+
+		// Sinks and batching can only be changed while the recorder is
+		// stopped
+		void addSink(std::unique_ptr<RecordSink> sink);
+		void clearSinks();
+		bool hasSinks() const { return ! m_sinks.empty(); }
+		void setBatch(size_t samples, double seconds);
+		void start();
+		// Drains what is queued before it returns
+		void stop();
+
+		// Single producer, never blocks
+		void push(const SampleRecord &record);
+
+		uint64_t getRecorded() const { return m_ring.pushed() - m_ring.dropped(); }
+		uint64_t getDropped() const { return m_ring.dropped(); }
+		uint64_t getFailed() const;
+
+	private:
+		void run();
+		void drain();
+
+		SampleRing<SampleRecord, QUEUE_SIZE> m_ring;
+		std::vector<std::unique_ptr<RecordSink>> m_sinks;
+		std::thread m_thread;
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		bool m_stop = true;
+		std::atomic<bool> m_running{false};
+		size_t m_batchSamples = 1;
+		double m_batchSeconds = 1;
+		// Pushed since the consumer was last woken, producer only
+		size_t m_unsignaled = 0;
+		// Set by the producer when a batch is full
+		std::atomic<bool> m_batchFull{false};
+};
@@ -0,0 +1,108 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <clock.h>
+#include <transport.h>
+
+bool ReplayTransport::load(const std::string &path, std::string &error) {
+	abort();
+	m_next = 0;
+	m_started = false;
+	bool ok = m_capture.open(path, error);
+	m_size = m_capture.size();
+	return ok;
+}
+
+void ReplayTransport::setSpeed(double speed) {
+	m_speed = speed;
+	m_started = false;
+}
+
+// With a speed the clock starts at the first request, a poller slower
+// than the capture gets every payload without waiting
+bool ReplayTransport::start(const char *, BodySink &sink, std::string &error, uint64_t token) {
+	beginRequest(token);
+	if ( cancelled() ) {
+		error = "Cancelled";
+		return false;
+	}
+	if ( m_next >= m_capture.size() ) {
+		error = m_capture.size() > 0 ? "End of capture" : "No capture loaded";
+		return false;
+	}
+	m_start = DriverClock::get().now();
+	size_t next = m_next;
+	m_payload = &m_capture[next];
+	m_sink = &sink;
+	double speed = m_speed;
+	if ( speed <= 0 ) {
+		m_due = m_start;
+	} else {
+		double offset = m_payload->time - m_capture[0].time;
+		if ( ! m_started || next == 0 ) {
+			m_origin = m_start - std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					std::chrono::duration<double>(offset / speed));
+			m_started = true;
+		}
+		m_due = m_origin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>((offset + m_payload->latency) / speed));
+	}
+	m_next++;
+	return true;
+}
+
+void ReplayTransport::collect(std::vector<struct pollfd> &fds, int &timeout) {
+	collectWake(fds);
+	lowerTimeout(timeout, std::max(0.0,
+			std::chrono::duration<double, std::milli>(m_due - DriverClock::get().now()).count()));
+}
+
+bool ReplayTransport::advance(const std::vector<struct pollfd> &, bool &ok, std::string &error) {
+	drainWake();
+	if ( cancelled() ) {
+		ok = false;
+		error = "Cancelled";
+		m_payload = nullptr;
+		return true;
+	}
+	auto now = DriverClock::get().now();
+	if ( now < m_due ) {
+		return false;
+	}
+	ok = m_payload->ok;
+	if ( ok ) {
+		m_sink->begin();
+		ok = m_sink->write(m_payload->body, m_payload->length);
+		if ( ! ok ) {
+			error = "Payload rejected";
+		}
+	} else {
+		error.assign(m_payload->body, m_payload->length);
+	}
+	m_payload = nullptr;
+	finishRequest(std::chrono::duration<double>(now - m_start).count(), false);
+	return true;
+}
+
+void ReplayTransport::abort() {
+	m_payload = nullptr;
+}
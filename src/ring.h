@@ -0,0 +1,108 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Bounded single producer, single consumer ring. The producer never waits:
+// when the consumer falls more than N entries behind the oldest entries are
+// overwritten, and the consumer counts them as dropped when it gets there.
+// Every slot is guarded like a seqlock, so an entry overwritten while it is
+// read is detected and dropped as well.
+template <typename T, size_t N>
+class SampleRing {
+	static_assert(std::is_trivially_copyable<T>::value, "SampleRing needs a trivially copyable type");
+
+	public:
+		SampleRing() {
+			for (Slot &slot : m_slots) {
+				slot.seq.store(0, std::memory_order_relaxed);
+				for (std::atomic<uint64_t> &word : slot.words) {
+					word.store(0, std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// Producer side
+		void push(const T &value) {
+			uint64_t words[WORDS] = {};
+			memcpy(words, &value, sizeof(T));
+			uint64_t pos = m_head.load(std::memory_order_relaxed);
+			Slot &slot = m_slots[pos % N];
+			slot.seq.store(2 * pos + 1, std::memory_order_relaxed);
+			for (size_t i = 0; i < WORDS; i++) {
+				slot.words[i].store(words[i], std::memory_order_release);
+			}
+			slot.seq.store(2 * pos + 2, std::memory_order_release);
+			m_head.store(pos + 1, std::memory_order_release);
+		}
+
+		// Consumer side, false if there is nothing new
+		bool pop(T &value) {
+			uint64_t words[WORDS];
+			while ( true ) {
+				uint64_t head = m_head.load(std::memory_order_acquire);
+				if ( m_tail == head ) {
+					return false;
+				}
+				if ( head - m_tail > N ) {
+					m_dropped.fetch_add(head - N - m_tail, std::memory_order_relaxed);
+					m_tail = head - N;
+				}
+				Slot &slot = m_slots[m_tail % N];
+				uint64_t seq = slot.seq.load(std::memory_order_acquire);
+				if ( seq == 2 * m_tail + 2 ) {
+					for (size_t i = 0; i < WORDS; i++) {
+						words[i] = slot.words[i].load(std::memory_order_acquire);
+					}
+					if ( slot.seq.load(std::memory_order_relaxed) == seq ) {
+						memcpy(&value, words, sizeof(T));
+						m_tail++;
+						return true;
+					}
+				}
+				// Overwritten by the producer before or while it was read
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+				m_tail++;
+			}
+		}
+
+		// Both readable from any thread
+		uint64_t pushed() const { return m_head.load(std::memory_order_relaxed); }
+		uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+	private:
+		static constexpr size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+		struct Slot {
+			std::atomic<uint64_t> seq;
+			std::atomic<uint64_t> words[WORDS];
+		};
+
+		Slot m_slots[N];
+		std::atomic<uint64_t> m_head{0};
+		uint64_t m_tail = 0;
+		std::atomic<uint64_t> m_dropped{0};
+};
@@ -0,0 +1,86 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+// Latest value of a single writer for any number of readers. The writer
+// never waits, a reader retries while a store is in progress and always
+// gets a consistent copy. The value is kept in atomic words so there is no
+// data race even while a read is torn and then retried. Without fences,
+// as a reader seeing any word of a new value also sees the odd sequence
+// stored before it.
+template <typename T>
+class SeqLock {
+	static_assert(std::is_trivially_copyable<T>::value, "SeqLock needs a trivially copyable type");
+
+	public:
+		SeqLock() {
+			for (std::atomic<uint64_t> &word : m_words) {
+				word.store(0, std::memory_order_relaxed);
+			}
+		}
+
+		void store(const T &value) {
+			uint64_t words[WORDS] = {};
+			memcpy(words, &value, sizeof(T));
+			uint64_t seq = m_seq.load(std::memory_order_relaxed);
+			m_seq.store(seq + 1, std::memory_order_relaxed);
+			for (size_t i = 0; i < WORDS; i++) {
+				m_words[i].store(words[i], std::memory_order_release);
+			}
+			m_seq.store(seq + 2, std::memory_order_release);
+		}
+
+		// Returns how many values were stored so far, value is left alone
+		// while that is 0
+		uint64_t load(T &value) const {
+			uint64_t words[WORDS];
+			while ( true ) {
+				uint64_t seq = m_seq.load(std::memory_order_acquire);
+				if ( seq & 1 ) {
+					std::this_thread::yield();
+					continue;
+				}
+				if ( seq == 0 ) {
+					return 0;
+				}
+				for (size_t i = 0; i < WORDS; i++) {
+					words[i] = m_words[i].load(std::memory_order_acquire);
+				}
+				if ( m_seq.load(std::memory_order_relaxed) == seq ) {
+					memcpy(&value, words, sizeof(T));
+					return seq / 2;
+				}
+			}
+		}
+
+	private:
+		static constexpr size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+		std::atomic<uint64_t> m_seq{0};
+		std::atomic<uint64_t> m_words[WORDS];
+};
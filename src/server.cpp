@@ -0,0 +1,261 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <netinet/in.h>
+#include <server.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+PayloadServer::PayloadServer() {
+	m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+PayloadServer::~PayloadServer() {
+	stop();
+	if ( m_wakeFd >= 0 ) {
+		close(m_wakeFd);
+	}
+}
+
+bool PayloadServer::start(int port, std::string &error) {
+	stop();
+	m_listenFd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if ( m_listenFd < 0 ) {
+		error = std::string("Could not create socket: ") + strerror(errno);
+		return false;
+	}
+	// Dual stack, so IPv4 consumers are served as well
+	int off = 0;
+	int on = 1;
+	setsockopt(m_listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+	setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	struct sockaddr_in6 addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(port);
+	if ( bind(m_listenFd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+			listen(m_listenFd, MAX_CLIENTS) != 0 ) {
+		error = std::string("Could not listen on port ") + std::to_string(port) + ": " + strerror(errno);
+		close(m_listenFd);
+		m_listenFd = -1;
+		return false;
+	}
+
+	uint64_t drain;
+	while ( read(m_wakeFd, &drain, sizeof(drain)) > 0 );
+	m_running = true;
+	m_thread = std::thread(&PayloadServer::run, this);
+	return true;
+}
+
+void PayloadServer::stop() {
+	if ( ! m_thread.joinable() ) {
+		return;
+	}
+	uint64_t one = 1;
+	if ( write(m_wakeFd, &one, sizeof(one)) < 0 ) {
+		// Counter overflow only, the poll wakes up anyway
+	}
+	m_thread.join();
+	m_running = false;
+	close(m_listenFd);
+	m_listenFd = -1;
+}
+
+void PayloadServer::publish(const std::string &body) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_body.assign(body);
+	m_time = std::chrono::system_clock::now();
+	m_valid = true;
+}
+
+void PayloadServer::setMaxAge(double seconds) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_maxAge = seconds;
+}
+
+void PayloadServer::setMetrics(const Metrics *metrics, const std::string &device) {
+	if ( m_thread.joinable() ) {
+		return;
+	}
+	m_metrics = metrics;
+	m_device = device;
+}
+
+void PayloadServer::run() {
+	for (;;) {
+		m_fds.clear();
+		m_fds.push_back({m_wakeFd, POLLIN, 0});
+		m_fds.push_back({m_clients.size() < MAX_CLIENTS ? m_listenFd : -1, POLLIN, 0});
+		for (const Client &client : m_clients) {
+			m_fds.push_back({client.fd, static_cast<short>(client.out.empty() ? POLLIN : POLLOUT), 0});
+		}
+		if ( poll(m_fds.data(), m_fds.size(), 1000) < 0 && errno != EINTR ) {
+			break;
+		}
+		if ( m_fds[0].revents != 0 ) {
+			break;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < m_clients.size(); i++) {
+			Client &client = m_clients[i];
+			short revents = m_fds[i + 2].revents;
+			bool done = false;
+			if ( revents & (POLLERR | POLLNVAL) ) {
+				done = true;
+			} else if ( client.out.empty() && (revents & (POLLIN | POLLHUP)) ) {
+				done = ! readRequest(client);
+			} else if ( ! client.out.empty() && (revents & (POLLOUT | POLLHUP)) ) {
+				ssize_t n = send(client.fd, client.out.data() + client.sent, client.out.size() - client.sent, MSG_NOSIGNAL);
+				if ( n > 0 ) {
+					client.sent += n;
+				}
+				done = (n < 0 && errno != EAGAIN && errno != EINTR) || client.sent == client.out.size();
+			}
+			if ( ! done && now - client.since > std::chrono::milliseconds(CLIENT_TIMEOUT_MS) ) {
+				done = true;
+			}
+			if ( done ) {
+				close(client.fd);
+				client.fd = -1;
+			}
+		}
+		m_clients.erase(std::remove_if(m_clients.begin(), m_clients.end(), [](const Client &client) {
+			return client.fd < 0;
+		}), m_clients.end());
+
+		if ( m_fds[1].revents & POLLIN ) {
+			acceptClients();
+		}
+	}
+
+	for (Client &client : m_clients) {
+		close(client.fd);
+	}
+	m_clients.clear();
+}
+
+void PayloadServer::acceptClients() {
+	while ( m_clients.size() < MAX_CLIENTS ) {
+		int fd = accept4(m_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if ( fd < 0 ) {
+			return;
+		}
+		m_clients.push_back({fd, "", "", 0, std::chrono::steady_clock::now()});
+	}
+}
+
+// Returns false once the client is to be dropped
+bool PayloadServer::readRequest(Client &client) {
+	char buff[1024];
+	ssize_t n = recv(client.fd, buff, sizeof(buff), 0);
+	if ( n < 0 ) {
+		return errno == EAGAIN || errno == EINTR;
+	}
+	if ( n == 0 ) {
+		return false;
+	}
+	client.in.append(buff, n);
+	if ( client.in.find("\r\n\r\n") != std::string::npos || client.in.find("\n\n") != std::string::npos ) {
+		respond(client);
+		return true;
+	}
+	return client.in.size() <= MAX_REQUEST;
+}
+
+std::string PayloadServer::httpDate(std::chrono::system_clock::time_point time) {
+	time_t t = std::chrono::system_clock::to_time_t(time);
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	char buff[64];
+	strftime(buff, sizeof(buff), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return buff;
+}
+
+void PayloadServer::respond(Client &client) {
+	size_t methodEnd = client.in.find(' ');
+	std::string method = client.in.substr(0, methodEnd);
+	std::string path = methodEnd == std::string::npos ? "" :
+		client.in.substr(methodEnd + 1, client.in.find_first_of(" \r\n", methodEnd + 1) - methodEnd - 1);
+	auto now = std::chrono::system_clock::now();
+	char header[512];
+
+	if ( method != "GET" && method != "HEAD" ) {
+		snprintf(header, sizeof(header), "HTTP/1.1 405 Method Not Allowed\r\n"
+				"Allow: GET, HEAD\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: close\r\n\r\n");
+		client.out = header;
+		return;
+	}
+
+	// Rendered here, so scrapes cost the fetching thread nothing
+	if ( m_metrics != nullptr && path == "/metrics" ) {
+		m_metrics->render(m_device, m_metricsText);
+		snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %zu\r\n"
+				"Cache-Control: no-cache\r\n"
+				"Connection: close\r\n\r\n", m_metricsText.size());
+		client.out = header;
+		if ( method == "GET" ) {
+			client.out += m_metricsText;
+		}
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if ( ! m_valid ) {
+		snprintf(header, sizeof(header), "HTTP/1.1 503 Service Unavailable\r\n"
+				"Retry-After: 1\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: close\r\n\r\n");
+		client.out = header;
+		return;
+	}
+
+	// Age and max-age let consumers tell how fresh the payload is and when
+	// the driver will have fetched a new one
+	long age = std::max<long>(0, std::chrono::duration_cast<std::chrono::seconds>(now - m_time).count());
+	long maxAge = std::max<long>(0, static_cast<long>(m_maxAge) - age);
+	snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: %zu\r\n"
+			"Date: %s\r\n"
+			"Last-Modified: %s\r\n"
+			"Age: %ld\r\n"
+			"Cache-Control: max-age=%ld\r\n"
+			"Connection: close\r\n\r\n",
+			m_body.size(), httpDate(now).c_str(), httpDate(m_time).c_str(), age, maxAge);
+	client.out = header;
+	if ( method == "GET" ) {
+		client.out += m_body;
+	}
+	m_served++;
+}
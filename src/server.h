@@ -0,0 +1,92 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <metrics.h>
+#include <poll.h>
+
+// Serves the last good payload to other software on the site, byte for byte
+// as the device sent it, so they share the driver's fetches instead of
+// polling the device themselves. Any GET is answered with the payload,
+// except /metrics if metrics are set. Every response closes its connection.
+class PayloadServer {
+	public:
+		static constexpr size_t MAX_CLIENTS = 32;
+		static constexpr size_t MAX_REQUEST = 4096;
+		static constexpr int CLIENT_TIMEOUT_MS = 5000;
+
+		PayloadServer();
+		~PayloadServer();
+
+		// Listens on port on all interfaces
+		bool start(int port, std::string &error);
+		void stop();
+		bool running() const { return m_running; }
+
+		// Called with every good payload, from any thread
+		void publish(const std::string &body);
+		// How long consumers may cache a new payload, in seconds
+		void setMaxAge(double seconds);
+		// Serve these at /metrics, only while stopped
+		void setMetrics(const Metrics *metrics, const std::string &device);
+
+		uint64_t getServed() const { return m_served; }
+
+	private:
+		struct Client {
+			int fd;
+			std::string in;
+			std::string out;
+			size_t sent;
+			std::chrono::steady_clock::time_point since;
+		};
+
+		void run();
+		void acceptClients();
+		bool readRequest(Client &client);
+		void respond(Client &client);
+		static std::string httpDate(std::chrono::system_clock::time_point time);
+
+		std::mutex m_mutex;
+		std::string m_body;
+		std::chrono::system_clock::time_point m_time;
+		bool m_valid = false;
+		double m_maxAge = 0;
+		const Metrics *m_metrics = nullptr;
+		std::string m_device;
+		std::string m_metricsText;
+
+		std::thread m_thread;
+		std::atomic<bool> m_running{false};
+		std::atomic<uint64_t> m_served{0};
+		int m_listenFd = -1;
+		int m_wakeFd = -1;
+		std::vector<Client> m_clients;
+		std::vector<struct pollfd> m_fds;
+};
@@ -0,0 +1,112 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cerrno>
+#include <shmpub.h>
+
+static_assert(sizeof(CwsShmSample::date) == sizeof(Reading::date), "Date does not fit the shared sample");
+
+void toShmSample(const SampleRecord &record, CwsShmSample &sample) {
+	const Reading &reading = record.reading;
+	memset(&sample, 0, sizeof(sample));
+	sample.time = record.time;
+	sample.scope = reading.scope;
+	sample.sw = reading.sw;
+	sample.safe = reading.safe;
+	memcpy(sample.date, reading.date, sizeof(sample.date));
+	sample.clouds = reading.clouds;
+	sample.temp = reading.temp;
+	sample.lightmpsas = reading.lightmpsas;
+	sample.rawir = reading.rawir;
+	sample.wind = reading.wind;
+	sample.gust = reading.gust;
+	sample.rain = reading.rain;
+	sample.hum = reading.hum;
+	sample.dewp = reading.dewp;
+	sample.abspress = reading.abspress;
+	sample.relpress = reading.relpress;
+}
+
+ShmPublisher::~ShmPublisher() {
+	close();
+}
+
+bool ShmPublisher::open(const char *device, std::string &error) {
+	close();
+	std::string name = cwsShmName(device);
+	int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	if ( fd < 0 ) {
+		error = "Could not open " + name + ": " + strerror(errno);
+		return false;
+	}
+	void *addr = MAP_FAILED;
+	if ( ftruncate(fd, sizeof(CwsShmSegment)) == 0 ) {
+		addr = mmap(nullptr, sizeof(CwsShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	int err = errno;
+	::close(fd);
+	if ( addr == MAP_FAILED ) {
+		error = "Could not map " + name + ": " + strerror(err);
+		return false;
+	}
+
+	CwsShmSegment *segment = static_cast<CwsShmSegment *>(addr);
+	if ( segment->magic != CWS_SHM_MAGIC || segment->version != CWS_SHM_VERSION ||
+			segment->size != sizeof(CwsShmSegment) ) {
+		segment->magic = 0;
+		segment->version = CWS_SHM_VERSION;
+		segment->size = sizeof(CwsShmSegment);
+		segment->seq.store(0, std::memory_order_relaxed);
+		segment->magic = CWS_SHM_MAGIC;
+	}
+	// A previous driver may have died in the middle of a store
+	uint64_t seq = segment->seq.load(std::memory_order_relaxed);
+	if ( seq & 1 ) {
+		segment->seq.store(seq + 1, std::memory_order_release);
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_segment = segment;
+	m_name = name;
+	return true;
+}
+
+void ShmPublisher::close(bool remove) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if ( m_segment == nullptr ) {
+		return;
+	}
+	munmap(m_segment, sizeof(CwsShmSegment));
+	m_segment = nullptr;
+	if ( remove ) {
+		shm_unlink(m_name.c_str());
+	}
+}
+
+void ShmPublisher::publish(const SampleRecord &record) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if ( m_segment == nullptr ) {
+		return;
+	}
+	CwsShmSample sample;
+	toShmSample(record, sample);
+	cwsShmWrite(m_segment, sample);
+}
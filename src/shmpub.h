@@ -0,0 +1,51 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <mutex>
+#include <string>
+
+#include <cwshm.h>
+#include <recorder.h>
+
+// Fixed layout of a sample, also used by the journal
+void toShmSample(const SampleRecord &record, CwsShmSample &sample);
+
+// Publishes every sample into the shared memory segment of a device, for
+// local readers using cwshm.h. The segment is kept when publishing stops, so
+// readers survive a restart of the driver.
+class ShmPublisher {
+	public:
+		~ShmPublisher();
+
+		bool open(const char *device, std::string &error);
+		// remove also deletes the segment
+		void close(bool remove = false);
+
+		// Single writer, only waits for a concurrent open() or close()
+		void publish(const SampleRecord &record);
+
+	private:
+		std::mutex m_mutex;
+		CwsShmSegment *m_segment = nullptr;
+		std::string m_name;
+};
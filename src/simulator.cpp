@@ -0,0 +1,615 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Simulates Cloudwatcher Solos for tests and benchmarks without hardware.
+// Every virtual device listens on its own port and answers GET
+// /cgi-bin/cgiLastData like the real one. Scenarios script the weather and
+// the faults, latency and error injection come on top. One epoll loop
+// serves all devices, so thousands of them fit on one host.
+//
+//   cws_simulator -n 100 -p 18000 -s rain -l 50 -e 2
+//
+// simulates 100 devices on ports 18000-18099 in which rain sets in, each
+// answering after 50 ms with 2% of the requests failing.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <queue>
+#include <random>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+enum Scenario {
+	CLEAR,
+	RAIN,
+	DROPOUT,
+	SLOW,
+	RESET,
+	MALFORMED,
+	CLOCKJUMP,
+	SCENARIO_COUNT
+};
+
+static const char *SCENARIOS[SCENARIO_COUNT] = {
+	"clear", "rain", "dropout", "slow", "reset", "malformed", "clockjump"
+};
+
+struct Options {
+	Scenario scenario = CLEAR;
+	int devices = 1;
+	int port = 8080;
+	const char *bind = nullptr;
+	double latency = 0;
+	double jitter = 0;
+	double errors = 0;
+	double onset = 60;
+	double duration = 0;
+	unsigned seed = 1;
+	bool stamp = false;
+};
+
+struct Device {
+	int fd;
+	int index;
+	int serial;
+	// Shifts the weather of each device a little
+	double phase;
+	uint64_t requests = 0;
+};
+
+struct Connection {
+	int fd = -1;
+	uint64_t generation = 0;
+	Device *device = nullptr;
+	std::string in;
+	std::string out;
+	size_t sent = 0;
+	bool keepAlive = true;
+	bool pending = false;
+	bool notFound = false;
+};
+
+// A response due at a time, stale once the connection was closed
+struct Timer {
+	Clock::time_point due;
+	int fd;
+	uint64_t generation;
+	bool operator>(const Timer &other) const { return due > other.due; }
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int) {
+	stopRequested = 1;
+}
+
+class Simulator {
+	public:
+		explicit Simulator(const Options &options) : m_options(options), m_random(options.seed) {}
+		bool start();
+		void run();
+		void report(double seconds) const;
+
+	private:
+		void accept(Device &device);
+		void read(Connection &conn);
+		void respond(Connection &conn);
+		void write(Connection &conn);
+		void close(Connection &conn, bool reset = false);
+		void payload(const Device &device, std::string &body);
+		double uniform(double low, double high) { return std::uniform_real_distribution<double>(low, high)(m_random); }
+		bool chance(double percent) { return percent > 0 && uniform(0, 100) < percent; }
+
+		Options m_options;
+		std::mt19937 m_random;
+		int m_epoll = -1;
+		Clock::time_point m_start;
+		std::vector<Device> m_devices;
+		std::vector<Connection> m_connections;
+		std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> m_timers;
+		uint64_t m_generation = 0;
+		uint64_t m_requests = 0;
+		uint64_t m_responses = 0;
+		uint64_t m_injected = 0;
+		uint64_t m_accepted = 0;
+};
+
+bool Simulator::start() {
+	m_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if ( m_epoll < 0 ) {
+		perror("epoll_create1");
+		return false;
+	}
+	m_devices.reserve(m_options.devices);
+	for (int i = 0; i < m_options.devices; i++) {
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = m_options.bind == nullptr ? AF_INET6 : AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		char port[16];
+		snprintf(port, sizeof(port), "%d", m_options.port + i);
+		struct addrinfo *res = nullptr;
+		int rc = getaddrinfo(m_options.bind, port, &hints, &res);
+		if ( rc != 0 ) {
+			fprintf(stderr, "Could not resolve %s: %s\n", m_options.bind, gai_strerror(rc));
+			return false;
+		}
+		int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		int one = 1;
+		int off = 0;
+		if ( fd >= 0 ) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if ( res->ai_family == AF_INET6 ) {
+				setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+			}
+		}
+		if ( fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) != 0 || listen(fd, 128) != 0 ) {
+			fprintf(stderr, "Could not listen on port %s: %s\n", port, strerror(errno));
+			freeaddrinfo(res);
+			return false;
+		}
+		freeaddrinfo(res);
+		m_devices.push_back({fd, i, 2000 + i, uniform(0, 1)});
+	}
+	// Registered once the vector is complete, the events point into it
+	for (Device &device : m_devices) {
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.u64 = device.index;
+		epoll_ctl(m_epoll, EPOLL_CTL_ADD, device.fd, &event);
+	}
+	m_start = Clock::now();
+	return true;
+}
+
+// Listening sockets are told apart from connections by the top bit
+static constexpr uint64_t CONNECTION_BIT = 1ull << 63;
+
+void Simulator::run() {
+	std::vector<struct epoll_event> events(256);
+	auto lastReport = Clock::now();
+	while ( ! stopRequested ) {
+		auto now = Clock::now();
+		if ( m_options.duration > 0 && now - m_start >= std::chrono::duration<double>(m_options.duration) ) {
+			break;
+		}
+		int timeout = 1000;
+		if ( ! m_timers.empty() ) {
+			auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(m_timers.top().due - now).count();
+			timeout = std::max<int>(0, std::min<long long>(timeout, wait + 1));
+		}
+		int n = epoll_wait(m_epoll, events.data(), events.size(), timeout);
+		if ( n < 0 && errno != EINTR ) {
+			perror("epoll_wait");
+			return;
+		}
+		for (int i = 0; i < n; i++) {
+			uint64_t data = events[i].data.u64;
+			if ( ( data & CONNECTION_BIT ) == 0 ) {
+				accept(m_devices[data]);
+				continue;
+			}
+			Connection &conn = m_connections[data & ~CONNECTION_BIT];
+			if ( conn.fd < 0 ) {
+				continue;
+			}
+			if ( events[i].events & ( EPOLLERR | EPOLLHUP ) ) {
+				close(conn);
+			} else if ( events[i].events & EPOLLOUT ) {
+				write(conn);
+			} else if ( events[i].events & EPOLLIN ) {
+				read(conn);
+			}
+		}
+		now = Clock::now();
+		while ( ! m_timers.empty() && m_timers.top().due <= now ) {
+			Timer timer = m_timers.top();
+			m_timers.pop();
+			Connection &conn = m_connections[timer.fd];
+			if ( conn.fd >= 0 && conn.generation == timer.generation ) {
+				respond(conn);
+			}
+		}
+		if ( now - lastReport >= std::chrono::seconds(10) ) {
+			report(std::chrono::duration<double>(now - m_start).count());
+			lastReport = now;
+		}
+	}
+}
+
+void Simulator::report(double seconds) const {
+	fprintf(stderr, "%.0f s: %llu connections, %llu requests, %llu responses, %llu faults injected, %.0f requests/s\n",
+			seconds, static_cast<unsigned long long>(m_accepted), static_cast<unsigned long long>(m_requests),
+			static_cast<unsigned long long>(m_responses), static_cast<unsigned long long>(m_injected),
+			seconds > 0 ? m_requests / seconds : 0);
+}
+
+void Simulator::accept(Device &device) {
+	for (;;) {
+		int fd = accept4(device.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if ( fd < 0 ) {
+			return;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if ( static_cast<size_t>(fd) >= m_connections.size() ) {
+			m_connections.resize(fd + 1);
+		}
+		Connection &conn = m_connections[fd];
+		conn.fd = fd;
+		conn.generation = ++m_generation;
+		conn.device = &device;
+		conn.in.clear();
+		conn.out.clear();
+		conn.sent = 0;
+		conn.keepAlive = true;
+		conn.pending = false;
+		conn.notFound = false;
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.u64 = CONNECTION_BIT | fd;
+		epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event);
+		m_accepted++;
+	}
+}
+
+void Simulator::read(Connection &conn) {
+	char buf[4096];
+	for (;;) {
+		ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+		if ( n > 0 ) {
+			conn.in.append(buf, n);
+			continue;
+		}
+		if ( n == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) ) {
+			close(conn);
+			return;
+		}
+		break;
+	}
+	if ( conn.pending ) {
+		return;
+	}
+	size_t end = conn.in.find("\r\n\r\n");
+	if ( end == std::string::npos ) {
+		if ( conn.in.size() > 8192 ) {
+			close(conn);
+		}
+		return;
+	}
+	std::string head = conn.in.substr(0, end);
+	conn.in.erase(0, end + 4);
+	for (char &c : head) {
+		c = tolower(static_cast<unsigned char>(c));
+	}
+	conn.keepAlive = head.find("connection: close") == std::string::npos && head.find("http/1.0") == std::string::npos;
+	m_requests++;
+	conn.device->requests++;
+
+	// Latency of the device, the slow scenario takes several seconds
+	double delay = m_options.latency + uniform(0, m_options.jitter);
+	if ( m_options.scenario == SLOW && conn.device->requests % 4 == 0 ) {
+		delay += uniform(5000, 15000);
+	}
+	conn.pending = true;
+	conn.notFound = head.compare(0, 4, "get ") != 0 || head.find("/cgi-bin/cgilastdata") == std::string::npos;
+	if ( conn.notFound ) {
+		delay = 0;
+	}
+	m_timers.push({Clock::now() + std::chrono::microseconds(static_cast<long long>(delay * 1000)),
+			conn.fd, conn.generation});
+}
+
+void Simulator::respond(Connection &conn) {
+	conn.pending = false;
+	if ( conn.notFound ) {
+		conn.out = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+		conn.sent = 0;
+		write(conn);
+		return;
+	}
+	Device &device = *conn.device;
+	bool reset = m_options.scenario == RESET && device.requests % 3 == 0;
+	if ( chance(m_options.errors) ) {
+		m_injected++;
+		if ( m_random() % 2 == 0 ) {
+			reset = true;
+		} else {
+			conn.out = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+			conn.sent = 0;
+			write(conn);
+			return;
+		}
+	}
+	if ( reset ) {
+		if ( m_options.scenario == RESET ) {
+			m_injected++;
+		}
+		close(conn, true);
+		return;
+	}
+
+	std::string body;
+	payload(device, body);
+	char head[160];
+	snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n%s\r\n",
+			body.size(), conn.keepAlive ? "" : "Connection: close\r\n");
+	conn.out = head;
+	conn.out += body;
+	conn.sent = 0;
+	m_responses++;
+	write(conn);
+}
+
+void Simulator::write(Connection &conn) {
+	while ( conn.sent < conn.out.size() ) {
+		ssize_t n = send(conn.fd, conn.out.data() + conn.sent, conn.out.size() - conn.sent, MSG_NOSIGNAL);
+		if ( n < 0 && errno == EINTR ) {
+			continue;
+		}
+		if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+			struct epoll_event event;
+			event.events = EPOLLOUT;
+			event.data.u64 = CONNECTION_BIT | conn.fd;
+			epoll_ctl(m_epoll, EPOLL_CTL_MOD, conn.fd, &event);
+			return;
+		}
+		if ( n <= 0 ) {
+			close(conn);
+			return;
+		}
+		conn.sent += n;
+	}
+	conn.out.clear();
+	conn.sent = 0;
+	if ( ! conn.keepAlive ) {
+		close(conn);
+		return;
+	}
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.u64 = CONNECTION_BIT | conn.fd;
+	epoll_ctl(m_epoll, EPOLL_CTL_MOD, conn.fd, &event);
+	// A request that arrived meanwhile
+	if ( ! conn.in.empty() ) {
+		read(conn);
+	}
+}
+
+// A reset closes with an RST instead of a FIN, like a device rebooting
+void Simulator::close(Connection &conn, bool reset) {
+	if ( reset ) {
+		struct linger linger = {1, 0};
+		setsockopt(conn.fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	}
+	::close(conn.fd);
+	conn.fd = -1;
+	conn.in.clear();
+	conn.out.clear();
+}
+
+// Same keys and order as firmware 5.89
+void Simulator::payload(const Device &device, std::string &body) {
+	double elapsed = std::chrono::duration<double>(Clock::now() - m_start).count();
+	double t = elapsed + device.phase * 10;
+	Scenario scenario = m_options.scenario;
+
+	double clouds = -25 + 2 * sin(t / 60) + uniform(-0.3, 0.3);
+	double rain = 3000 + uniform(-20, 20);
+	double wind = std::max(0.0, 8 + 4 * sin(t / 40) + uniform(-1, 1));
+	double gust = wind + uniform(0, 6);
+	double temp = 8 + 3 * sin(t / 3600) + uniform(-0.1, 0.1);
+	double hum = 60 + 5 * sin(t / 1800);
+	if ( scenario == RAIN && elapsed >= m_options.onset ) {
+		// Clouds close in over a minute, then it rains
+		double progress = std::min(1.0, (elapsed - m_options.onset) / 60);
+		clouds = clouds + progress * 22;
+		hum = std::min(99.0, hum + progress * 35);
+		if ( progress >= 1 ) {
+			rain = 1500 + uniform(-100, 100);
+		}
+	}
+	if ( m_options.stamp ) {
+		// Milliseconds of the wall clock, for bench_indi to time the way
+		// through the driver and indiserver
+		rain = fmod(std::chrono::duration<double, std::milli>(
+				std::chrono::system_clock::now().time_since_epoch()).count(), 1e8);
+	}
+	bool dropout = scenario == DROPOUT && fmod(t, 30) >= 20;
+	if ( dropout ) {
+		wind = -1;
+		gust = -1;
+	}
+	double dewp = temp - (100 - hum) / 5;
+	bool cloudsSafe = clouds < -15;
+	bool rainSafe = rain > 2500;
+	bool windSafe = wind >= 0 && wind < 30;
+	bool safe = cloudsSafe && rainSafe && windSafe;
+
+	time_t now = time(nullptr);
+	if ( scenario == CLOCKJUMP ) {
+		// The device clock jumps back an hour and a day ahead in turn
+		long step = static_cast<long>(elapsed / 20) % 3;
+		now += step == 1 ? -3600 : step == 2 ? 86400 : 0;
+	}
+	struct tm tm;
+	gmtime_r(&now, &tm);
+	char line[128];
+	body.reserve(640);
+	strftime(line, sizeof(line), "dataGMTTime=%Y/%m/%d %H:%M:%S\n", &tm);
+	body += line;
+	snprintf(line, sizeof(line), "cwinfo=Serial: %d, FW: 5.89\n", device.serial);
+	body += line;
+	snprintf(line, sizeof(line), "clouds=%f\ncloudsSafe=%s\n", clouds, cloudsSafe ? "Safe" : "Unsafe");
+	body += line;
+	snprintf(line, sizeof(line), "temp=%f\ntempSafe=Safe\n", temp);
+	body += line;
+	snprintf(line, sizeof(line), "wind=%.0f\nwindSafe=%s\n", wind, windSafe ? "Safe" : "Unsafe");
+	body += line;
+	snprintf(line, sizeof(line), "gust=%.0f\ngustSafe=%s\n", gust, windSafe ? "Safe" : "Unsafe");
+	body += line;
+	snprintf(line, sizeof(line), "rain=%.*f\nrainSafe=%s\n", m_options.stamp ? 1 : 0, rain, rainSafe ? "Safe" : "Unsafe");
+	body += line;
+	snprintf(line, sizeof(line), "lightmpsas=%.2f\nlightSafe=Safe\n", 20.5 + uniform(-0.05, 0.05));
+	body += line;
+	snprintf(line, sizeof(line), "switch=%d\nsafe=%d\n", safe ? 1 : 0, safe ? 1 : 0);
+	body += line;
+	if ( ! dropout ) {
+		snprintf(line, sizeof(line), "hum=%.0f\nhumSafe=Safe\ndewp=%f\ndewpSafe=Safe\n", hum, dewp);
+		body += line;
+	}
+	snprintf(line, sizeof(line), "rawir=%f\n", clouds + temp);
+	body += line;
+	if ( ! dropout ) {
+		snprintf(line, sizeof(line), "abspress=%f\nrelpress=%f\npressureSafe=Safe\n", 957 + uniform(-0.5, 0.5),
+				1024 + uniform(-0.5, 0.5));
+		body += line;
+	}
+
+	if ( scenario == MALFORMED && device.requests % 5 == 0 ) {
+		// One of the ways a payload goes wrong on a flaky link
+		size_t pos = body.find('\n', m_random() % body.size());
+		switch ( m_random() % 4 ) {
+			case 0:
+				body.resize(m_random() % body.size());
+				break;
+			case 1:
+				body.insert(pos == std::string::npos ? body.size() : pos + 1, "clouds\n");
+				break;
+			case 2:
+				body.replace(body.find("temp=") + 5, 0, "abc");
+				break;
+			default:
+				body.insert(pos == std::string::npos ? body.size() : pos + 1, std::string(300, 'x') + "\n");
+				break;
+		}
+		m_injected++;
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-n devices] [-p port] [-b address] [-s scenario] [-l ms] [-j ms] [-e percent]\n"
+			"       [-o seconds] [-d seconds] [-S seed] [-t]\n", name);
+	fprintf(stderr, "  -n  virtual devices, on consecutive ports from -p, default 1 on 8080\n");
+	fprintf(stderr, "  -s  clear, rain, dropout, slow, reset, malformed or clockjump\n");
+	fprintf(stderr, "  -l  latency of every response, -j adds up to that much at random\n");
+	fprintf(stderr, "  -e  share of requests answered with a 500 or a reset\n");
+	fprintf(stderr, "  -o  when rain sets in, default after 60 s\n");
+	fprintf(stderr, "  -d  stop after that long, default never\n");
+	fprintf(stderr, "  -t  rain carries the time it was sent, see bench_indi\n");
+}
+
+int main(int argc, char *argv[]) {
+	Options options;
+	int opt;
+	while ( (opt = getopt(argc, argv, "n:p:b:s:l:j:e:o:d:S:t")) != -1 ) {
+		switch ( opt ) {
+			case 'n':
+				options.devices = atoi(optarg);
+				break;
+			case 'p':
+				options.port = atoi(optarg);
+				break;
+			case 'b':
+				options.bind = optarg;
+				break;
+			case 's':
+				options.scenario = SCENARIO_COUNT;
+				for (int i = 0; i < SCENARIO_COUNT; i++) {
+					if ( strcmp(optarg, SCENARIOS[i]) == 0 ) {
+						options.scenario = static_cast<Scenario>(i);
+					}
+				}
+				if ( options.scenario == SCENARIO_COUNT ) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'l':
+				options.latency = atof(optarg);
+				break;
+			case 'j':
+				options.jitter = atof(optarg);
+				break;
+			case 'e':
+				options.errors = atof(optarg);
+				break;
+			case 'o':
+				options.onset = atof(optarg);
+				break;
+			case 'd':
+				options.duration = atof(optarg);
+				break;
+			case 'S':
+				options.seed = strtoul(optarg, nullptr, 10);
+				break;
+			case 't':
+				options.stamp = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if ( optind != argc || options.devices <= 0 || options.port <= 0 || options.port + options.devices > 65536 ) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Each device needs a listening socket and a connection or two
+	struct rlimit limit;
+	if ( getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max ) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	Simulator simulator(options);
+	if ( ! simulator.start() ) {
+		return 1;
+	}
+	fprintf(stderr, "Simulating %d device%s on port %d%s, scenario %s\n", options.devices,
+			options.devices == 1 ? "" : "s", options.port, options.devices == 1 ? "" : " and up",
+			SCENARIOS[options.scenario]);
+	auto start = Clock::now();
+	simulator.run();
+	simulator.report(std::chrono::duration<double>(Clock::now() - start).count());
+	return 0;
+}
@@ -0,0 +1,122 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Trend checks shared by the soak programs. Windows of polls are sampled
+// for resources and latency, and the last third of the run is compared to
+// the first.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <malloc.h>
+#include <vector>
+
+// One window of polls
+struct SoakSample {
+	long cycles;
+	double rss;
+	double heap;
+	double allocations;
+	double fds;
+	double mean;
+	double p99;
+	long failed;
+};
+
+// Latency growth below this is noise on a fast host, whatever the share
+static constexpr double SOAK_LATENCY_FLOOR_MS = 1;
+
+inline long soakStatusKB(const char *key) {
+	FILE *fp = fopen("/proc/self/status", "r");
+	if ( fp == nullptr ) {
+		return -1;
+	}
+	char line[256];
+	long value = -1;
+	size_t len = strlen(key);
+	while ( fgets(line, sizeof(line), fp) != nullptr ) {
+		if ( strncmp(line, key, len) == 0 ) {
+			value = strtol(line + len, nullptr, 10);
+			break;
+		}
+	}
+	fclose(fp);
+	return value;
+}
+
+inline double soakHeapKB() {
+#if defined(__GLIBC__) && ( __GLIBC__ > 2 || __GLIBC_MINOR__ >= 33 )
+	return mallinfo2().uordblks / 1024.;
+#else
+	return 0;
+#endif
+}
+
+inline int soakOpenFds() {
+	DIR *dir = opendir("/proc/self/fd");
+	if ( dir == nullptr ) {
+		return -1;
+	}
+	int count = 0;
+	while ( readdir(dir) != nullptr ) {
+		count++;
+	}
+	closedir(dir);
+	// ., .. and the descriptor of the listing itself
+	return count - 3;
+}
+
+inline double soakMedian(std::vector<double> values) {
+	if ( values.empty() ) {
+		return 0;
+	}
+	std::sort(values.begin(), values.end());
+	return values[values.size() / 2];
+}
+
+// Compares the median of the first third of the windows to the last third,
+// the first windows are left out as warmup
+inline bool soakGrows(FILE *out, const std::vector<SoakSample> &samples, double SoakSample::*field, const char *name,
+		double tolerance, bool relative) {
+	size_t skip = samples.size() / 5;
+	size_t third = (samples.size() - skip) / 3;
+	if ( third == 0 ) {
+		return false;
+	}
+	std::vector<double> first;
+	std::vector<double> last;
+	for (size_t i = 0; i < third; i++) {
+		first.push_back(samples[skip + i].*field);
+		last.push_back(samples[samples.size() - third + i].*field);
+	}
+	double before = soakMedian(first);
+	double after = soakMedian(last);
+	double limit = relative ? std::max(before * (1 + tolerance / 100), before + SOAK_LATENCY_FLOOR_MS) :
+		before + tolerance;
+	bool failed = after > limit;
+	fprintf(out, "%-12s %12.3f -> %12.3f  %s\n", name, before, after, failed ? "GROWING" : "ok");
+	return failed;
+}
@@ -0,0 +1,274 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Soaks the whole driver, fetch loop, INDI loop and sinks, against
+// cws_simulator from the build directory and fails if resources or latency
+// keep growing. Every window is sampled for RSS, heap in use, open
+// descriptors and the mean fetch latency the device reports in its metrics
+// textfile. The device is disconnected and connected again at fixed
+// intervals, so the poller and recorder restarts are soaked as well.
+// Options after -- are passed to the simulator.
+//
+//   soak_driver -n 360 -- -s reset -e 1
+
+#include <checksim.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cw.h>
+#include <dirent.h>
+#include <indidevapi.h>
+#include <soak.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static const char *DEVICE = "Soak";
+
+struct Options {
+	long windows = 60;
+	double window = 10;
+	long reconnect = 6;
+	double period = 0.05;
+	const char *transport = "native";
+	// Growth tolerated from the first to the last third of the run
+	double rssKB = 1024;
+	double heapKB = 256;
+	double latency = 25;
+};
+
+// Counters of the device from its metrics textfile
+struct Counters {
+	double ok = 0;
+	double other = 0;
+	double seconds = 0;
+	double count = 0;
+};
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-n windows] [-w seconds] [-r windows] [-p seconds] [-t curl|native]\n"
+			"       [-m kB] [-h kB] [-l percent] [-- simulator options]\n", name);
+	fprintf(stderr, "  -w  seconds per sample, default 10\n");
+	fprintf(stderr, "  -r  reconnect the device every that many samples, default 6\n");
+	fprintf(stderr, "  -p  fast polling period, default 0.05 s\n");
+	fprintf(stderr, "  -m  RSS and -h heap growth tolerated, default 1024 and 256 kB\n");
+	fprintf(stderr, "  -l  latency growth tolerated, default 25%% but at least 1 ms\n");
+}
+
+static void setText(CloudwatcherSolo &device, const char *property, const char *element, const char *value) {
+	char *texts[] = {const_cast<char *>(value)};
+	char *names[] = {const_cast<char *>(element)};
+	device.ISNewText(DEVICE, property, texts, names, 1);
+}
+
+static void setNumber(CloudwatcherSolo &device, const char *property, const char *element, double value) {
+	double values[] = {value};
+	char *names[] = {const_cast<char *>(element)};
+	device.ISNewNumber(DEVICE, property, values, names, 1);
+}
+
+static void setSwitch(CloudwatcherSolo &device, const char *property, const char *element) {
+	ISState states[] = {ISS_ON};
+	char *names[] = {const_cast<char *>(element)};
+	device.ISNewSwitch(DEVICE, property, states, names, 1);
+}
+
+static void removeDir(const std::string &path) {
+	DIR *dir = opendir(path.c_str());
+	if ( dir == nullptr ) {
+		return;
+	}
+	while ( struct dirent *entry = readdir(dir) ) {
+		if ( strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 ) {
+			unlink((path + "/" + entry->d_name).c_str());
+		}
+	}
+	closedir(dir);
+	rmdir(path.c_str());
+}
+
+static bool readCounters(const std::string &path, Counters &counters) {
+	FILE *fp = fopen(path.c_str(), "r");
+	if ( fp == nullptr ) {
+		return false;
+	}
+	counters = Counters();
+	char line[512];
+	while ( fgets(line, sizeof(line), fp) != nullptr ) {
+		const char *value = strrchr(line, ' ');
+		if ( line[0] == '#' || value == nullptr ) {
+			continue;
+		}
+		double number = atof(value + 1);
+		if ( strncmp(line, "cws_fetches_total{", 18) == 0 ) {
+			if ( strstr(line, "outcome=\"ok\"") != nullptr ) {
+				counters.ok += number;
+			} else {
+				counters.other += number;
+			}
+		} else if ( strncmp(line, "cws_fetch_duration_seconds_sum{", 31) == 0 ) {
+			counters.seconds += number;
+		} else if ( strncmp(line, "cws_fetch_duration_seconds_count{", 33) == 0 ) {
+			counters.count += number;
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+// Runs the INDI loop of the device for that long
+static void pump(double seconds) {
+	auto until = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(seconds));
+	int never = 0;
+	while ( std::chrono::steady_clock::now() < until ) {
+		IEDeferLoop(10, &never);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	Options options;
+	int opt;
+	while ( (opt = getopt(argc, argv, "n:w:r:p:t:m:h:l:")) != -1 ) {
+		switch ( opt ) {
+			case 'n':
+				options.windows = atol(optarg);
+				break;
+			case 'w':
+				options.window = atof(optarg);
+				break;
+			case 'r':
+				options.reconnect = atol(optarg);
+				break;
+			case 'p':
+				options.period = atof(optarg);
+				break;
+			case 't':
+				options.transport = optarg;
+				break;
+			case 'm':
+				options.rssKB = atof(optarg);
+				break;
+			case 'h':
+				options.heapKB = atof(optarg);
+				break;
+			case 'l':
+				options.latency = atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if ( options.windows <= 0 || options.window <= 0 || options.period <= 0 ) {
+		usage(argv[0]);
+		return 1;
+	}
+	std::vector<const char *> simulatorOptions(argv + optind, argv + argc);
+
+	char tmp[] = "/tmp/soak_driver.XXXXXX";
+	if ( mkdtemp(tmp) == nullptr ) {
+		perror("mkdtemp");
+		return 1;
+	}
+	std::string dir = tmp;
+	std::string metrics = dir + "/metrics.prom";
+	std::string config = dir + "/config.xml";
+	setenv("INDICONFIG", config.c_str(), 1);
+
+	CheckSimulator simulator;
+	if ( ! simulator.start(simulatorOptions) ) {
+		removeDir(dir);
+		return 1;
+	}
+	// The property updates would fill the log, the results are reported on
+	// the original stdout
+	FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+	if ( report == nullptr || freopen("/dev/null", "w", stdout) == nullptr ) {
+		perror("/dev/null");
+		removeDir(dir);
+		return 1;
+	}
+
+	std::vector<SoakSample> samples;
+	{
+		CloudwatcherSolo device(DEVICE);
+		device.ISGetProperties(nullptr);
+		setText(device, "CWS_ADDRESS", "ADDRESS", simulator.getUrl().c_str());
+		setText(device, "CWS_METRICS", "FILE", metrics.c_str());
+		setNumber(device, "CWS_FAST_POLL", "PERIOD", options.period);
+		setNumber(device, "CWS_FETCH_CACHE", "TTL", 0);
+		setNumber(device, "WEATHER_UPDATE", "PERIOD", 10);
+		setSwitch(device, "CWS_SHM", "SHM_OFF");
+		setSwitch(device, "CWS_TRANSPORT", strcmp(options.transport, "curl") == 0 ? "CURL" : "NATIVE");
+		setSwitch(device, "CONNECTION", "CONNECT");
+
+		fprintf(report, "%10s %9s %9s %5s %9s %7s\n", "fetches", "rss[kB]", "heap[kB]", "fds", "mean[ms]",
+				"failed");
+		Counters last;
+		for (long window = 1; window <= options.windows; window++) {
+			pump(options.window);
+			Counters counters;
+			if ( ! readCounters(metrics, counters) ) {
+				fprintf(stderr, "No metrics written to %s\n", metrics.c_str());
+				break;
+			}
+			SoakSample sample;
+			sample.cycles = counters.ok + counters.other;
+			sample.rss = soakStatusKB("VmRSS:");
+			sample.heap = soakHeapKB();
+			sample.allocations = 0;
+			sample.fds = soakOpenFds();
+			double count = counters.count - last.count;
+			sample.mean = count > 0 ? (counters.seconds - last.seconds) / count * 1000 : 0;
+			sample.p99 = 0;
+			sample.failed = counters.other - last.other;
+			samples.push_back(sample);
+			fprintf(report, "%10ld %9.0f %9.0f %5.0f %9.3f %7ld\n", sample.cycles, sample.rss, sample.heap,
+					sample.fds, sample.mean, sample.failed);
+			fflush(report);
+			last = counters;
+
+			if ( options.reconnect > 0 && window % options.reconnect == 0 && window != options.windows ) {
+				setSwitch(device, "CONNECTION", "DISCONNECT");
+				setSwitch(device, "CONNECTION", "CONNECT");
+			}
+		}
+		setSwitch(device, "CONNECTION", "DISCONNECT");
+	}
+	removeDir(dir);
+
+	if ( samples.size() < 6 ) {
+		fprintf(stderr, "Too few samples to look for trends, raise -n\n");
+		return 1;
+	}
+	fprintf(report, "\n");
+	bool growing = false;
+	growing |= soakGrows(report, samples, &SoakSample::rss, "rss[kB]", options.rssKB, false);
+	growing |= soakGrows(report, samples, &SoakSample::heap, "heap[kB]", options.heapKB, false);
+	// The fetch loop may be between connections when sampled
+	growing |= soakGrows(report, samples, &SoakSample::fds, "fds", 1.5, false);
+	growing |= soakGrows(report, samples, &SoakSample::mean, "mean[ms]", options.latency, true);
+	fprintf(report, "%s\n", growing ? "FAILED" : "PASSED");
+	return growing ? 1 : 0;
+}
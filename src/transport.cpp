@@ -0,0 +1,424 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <clock.h>
+#include <cstring>
+#include <sys/eventfd.h>
+#include <transport.h>
+#include <unistd.h>
+
+Transport::Transport() {
+	m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+Transport::~Transport() {
+	if ( m_wakeFd >= 0 ) {
+		close(m_wakeFd);
+	}
+}
+
+void Transport::cancel() {
+	m_cancelGeneration++;
+	uint64_t one = 1;
+	if ( write(m_wakeFd, &one, sizeof(one)) < 0 ) {
+		// Counter overflow only, the poll wakes up anyway
+	}
+}
+
+void Transport::collectWake(std::vector<struct pollfd> &fds) {
+	fds.push_back({m_wakeFd, POLLIN, 0});
+}
+
+void Transport::drainWake() {
+	uint64_t drain;
+	while ( read(m_wakeFd, &drain, sizeof(drain)) > 0 );
+}
+
+void Transport::lowerTimeout(int &timeout, double ms) {
+	if ( ms < 0 ) {
+		return;
+	}
+	int value = static_cast<int>(std::min(ms, 1e9));
+	if ( timeout < 0 || value < timeout ) {
+		timeout = value;
+	}
+}
+
+bool Transport::get(const char *url, BodySink &sink, std::string &error, uint64_t token) {
+	if ( ! start(url, sink, error, token) ) {
+		return false;
+	}
+	bool ok = false;
+	do {
+		m_fds.clear();
+		int timeout = -1;
+		collect(m_fds, timeout);
+		if ( DriverClock::get().poll(m_fds.data(), m_fds.size(), timeout) < 0 && errno != EINTR ) {
+			error = std::string("Could not poll: ") + strerror(errno);
+			abort();
+			return false;
+		}
+	} while ( ! advance(m_fds, ok, error) );
+	return ok;
+}
+
+double Transport::beginRequest(uint64_t token) {
+	m_timedOut = false;
+	m_requestGeneration = token;
+	m_requests++;
+
+	// Every request earns a fraction of a hedge, a hedge costs a full one
+	double budget = m_hedgeBudget / 100.;
+	m_hedgeTokens = std::min(m_hedgeTokens + budget, HEDGE_BURST);
+	return budget > 0 ? m_latencyP95.load() : 0;
+}
+
+bool Transport::takeHedge() {
+	if ( m_hedgeTokens < 1 ) {
+		return false;
+	}
+	m_hedgeTokens -= 1;
+	m_hedges++;
+	return true;
+}
+
+void Transport::finishRequest(double seconds, bool hedgeWon) {
+	if ( hedgeWon ) {
+		m_hedgeWins++;
+	}
+	m_latencies[m_latencyIndex] = seconds;
+	m_latencyIndex = (m_latencyIndex + 1) % LATENCY_SAMPLES;
+	if ( m_latencyCount < LATENCY_SAMPLES ) {
+		m_latencyCount++;
+	}
+
+	// Latency below which 95% of the recent requests completed, 0 while
+	// there are too few samples to tell
+	if ( m_latencyCount < HEDGE_MIN_SAMPLES ) {
+		m_latencyP95 = 0;
+		return;
+	}
+	std::array<double, LATENCY_SAMPLES> sorted;
+	std::copy(m_latencies.begin(), m_latencies.begin() + m_latencyCount, sorted.begin());
+	size_t idx = (m_latencyCount * 95) / 100;
+	std::nth_element(sorted.begin(), sorted.begin() + idx, sorted.begin() + m_latencyCount);
+	m_latencyP95 = sorted[idx];
+}
+
+CurlTransport::~CurlTransport() {
+	reset();
+	if ( m_multi != nullptr ) {
+		curl_multi_cleanup(m_multi);
+	}
+	if ( m_initialized ) {
+		curl_global_cleanup();
+	}
+}
+
+// curl is only set up once it is actually used, so picking the native
+// transport never pays for it
+bool CurlTransport::init(std::string &error) {
+	if ( m_multi != nullptr ) {
+		return true;
+	}
+	if ( ! m_initialized ) {
+		if ( curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK ) {
+			error = "Could not initialize curl!";
+			return false;
+		}
+		m_initialized = true;
+	}
+	m_multi = curl_multi_init();
+	if ( m_multi == nullptr ) {
+		error = "Could not initialize curl!";
+		return false;
+	}
+	if ( CURLM_OK != curl_multi_setopt(m_multi, CURLMOPT_SOCKETFUNCTION, socketCB) ||
+			CURLM_OK != curl_multi_setopt(m_multi, CURLMOPT_SOCKETDATA, this) ||
+			CURLM_OK != curl_multi_setopt(m_multi, CURLMOPT_TIMERFUNCTION, timerCB) ||
+			CURLM_OK != curl_multi_setopt(m_multi, CURLMOPT_TIMERDATA, this) ) {
+		error = "Could not set curl socket callbacks!";
+		curl_multi_cleanup(m_multi);
+		m_multi = nullptr;
+		return false;
+	}
+	return true;
+}
+
+// curl tells which sockets to wait for and how long, so any number of them
+// can be polled, unlike with curl_multi_fdset() and FD_SETSIZE
+int CurlTransport::socketCB(CURL *, curl_socket_t socket, int what, void *userp, void *) {
+	std::vector<struct pollfd> &sockets = static_cast<CurlTransport *>(userp)->m_sockets;
+	auto it = std::find_if(sockets.begin(), sockets.end(), [&](const struct pollfd &fd) {
+		return fd.fd == socket;
+	});
+	if ( what == CURL_POLL_REMOVE ) {
+		if ( it != sockets.end() ) {
+			sockets.erase(it);
+		}
+		return 0;
+	}
+	short events = ((what & CURL_POLL_IN) ? POLLIN : 0) | ((what & CURL_POLL_OUT) ? POLLOUT : 0);
+	if ( it == sockets.end() ) {
+		sockets.push_back({socket, events, 0});
+	} else {
+		it->events = events;
+	}
+	return 0;
+}
+
+int CurlTransport::timerCB(CURLM *, long timeout, void *userp) {
+	CurlTransport *transport = static_cast<CurlTransport *>(userp);
+	transport->m_timerSet = timeout >= 0;
+	transport->m_timerAt = DriverClock::get().now() + std::chrono::milliseconds(timeout);
+	return 0;
+}
+
+bool CurlTransport::ownsSocket(int fd) const {
+	return std::any_of(m_sockets.begin(), m_sockets.end(), [&](const struct pollfd &socket) {
+		return socket.fd == fd;
+	});
+}
+
+void CurlTransport::reset() {
+	if ( m_curl != nullptr ) {
+		curl_easy_cleanup(m_curl);
+		m_curl = nullptr;
+	}
+	if ( m_curlHedge != nullptr ) {
+		curl_easy_cleanup(m_curlHedge);
+		m_curlHedge = nullptr;
+	}
+}
+
+size_t CurlTransport::writeCB(void *contents, size_t size, size_t nmemb, void *userp) {
+	if ( ! static_cast<BodySink *>(userp)->write(static_cast<char *>(contents), size * nmemb) ) {
+		return 0;
+	}
+	return size * nmemb;
+}
+
+int CurlTransport::progressCB(void *userp, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+	return static_cast<CurlTransport *>(userp)->cancelled() ? 1 : 0;
+}
+
+bool CurlTransport::prepareHandle(CURL *&handle, char *errorBuff, const char *url, BodySink *sink, std::string &error) {
+	if ( handle == nullptr ) {
+		handle = curl_easy_init();
+		if ( handle == NULL ) {
+			error = "Could not initialize curl!";
+			return false;
+		}
+
+		if ( CURLE_OK != curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, errorBuff) ) {
+			error = "Could not set curl error buffer!";
+			curl_easy_cleanup(handle);
+			handle = nullptr;
+			return false;
+		}
+
+		if ( CURLE_OK != curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeCB) ) {
+			error = std::string("Could not set curl write callback: ") +
+				(strlen(errorBuff) ? errorBuff : "Unknown error");
+			curl_easy_cleanup(handle);
+			handle = nullptr;
+			return false;
+		}
+
+		if ( CURLE_OK != curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, progressCB) ||
+				CURLE_OK != curl_easy_setopt(handle, CURLOPT_XFERINFODATA, this) ||
+				CURLE_OK != curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L) ) {
+			error = std::string("Could not set curl progress callback: ") +
+				(strlen(errorBuff) ? errorBuff : "Unknown error");
+			curl_easy_cleanup(handle);
+			handle = nullptr;
+			return false;
+		}
+
+		if ( CURLE_OK != curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, static_cast<long>(TIMEOUT_MS)) ) {
+			error = std::string("Could not set curl timeout: ") +
+				(strlen(errorBuff) ? errorBuff : "Unknown error");
+			curl_easy_cleanup(handle);
+			handle = nullptr;
+			return false;
+		}
+	}
+	errorBuff[0] = '\0';
+
+	if ( CURLE_OK != curl_easy_setopt(handle, CURLOPT_URL, url) ) {
+		error = std::string("Could not use specified URL: ") +
+			(strlen(errorBuff) ? errorBuff : "Unknown error");
+		return false;
+	}
+
+	sink->begin();
+	if ( CURLE_OK != curl_easy_setopt(handle, CURLOPT_WRITEDATA, sink) ) {
+		error = std::string("Could not set curl data buffer: ") +
+			(strlen(errorBuff) ? errorBuff : "Unknown error");
+		return false;
+	}
+
+	return true;
+}
+
+bool CurlTransport::start(const char *url, BodySink &sink, std::string &error, uint64_t token) {
+	drainWake();
+	m_hedgeAfter = beginRequest(token);
+	if ( cancelled() ) {
+		error = "Cancelled";
+		return false;
+	}
+
+	if ( ! init(error) ) {
+		return false;
+	}
+	if ( ! prepareHandle(m_curl, m_curlErrorBuff, url, &sink, error) ) {
+		return false;
+	}
+
+	m_url = url;
+	m_sink = &sink;
+	m_hedgeBody.clear();
+	m_winner = nullptr;
+	m_result = CURLE_OK;
+	m_errorBuff = m_curlErrorBuff;
+	m_primaryActive = true;
+	m_hedgeActive = false;
+	m_hedged = false;
+	m_start = DriverClock::get().now();
+	curl_multi_add_handle(m_multi, m_curl);
+	return true;
+}
+
+void CurlTransport::collect(std::vector<struct pollfd> &fds, int &timeout) {
+	collectWake(fds);
+	for (const struct pollfd &socket : m_sockets) {
+		fds.push_back({socket.fd, socket.events, 0});
+	}
+
+	// curl may be busy without a socket to wait for, e.g. while resolving
+	if ( m_timerSet ) {
+		lowerTimeout(timeout, std::max(0., std::ceil(std::chrono::duration<double, std::milli>(
+				m_timerAt - DriverClock::get().now()).count())));
+	}
+	if ( ! m_hedged && m_primaryActive && m_hedgeAfter > 0 ) {
+		double elapsed = std::chrono::duration<double>(DriverClock::get().now() - m_start).count();
+		lowerTimeout(timeout, std::max(0., (m_hedgeAfter - elapsed) * 1000) + 1);
+	}
+}
+
+bool CurlTransport::advance(const std::vector<struct pollfd> &fds, bool &ok, std::string &error) {
+	drainWake();
+	int running;
+	for (const struct pollfd &fd : fds) {
+		if ( fd.revents == 0 || ! ownsSocket(fd.fd) ) {
+			continue;
+		}
+		int mask = ((fd.revents & POLLIN) ? CURL_CSELECT_IN : 0) | ((fd.revents & POLLOUT) ? CURL_CSELECT_OUT : 0) |
+			((fd.revents & (POLLERR | POLLHUP)) ? CURL_CSELECT_ERR : 0);
+		curl_multi_socket_action(m_multi, fd.fd, mask, &running);
+	}
+	if ( m_timerSet && DriverClock::get().now() >= m_timerAt ) {
+		m_timerSet = false;
+		curl_multi_socket_action(m_multi, CURL_SOCKET_TIMEOUT, 0, &running);
+	}
+
+	CURLMsg *msg;
+	int left;
+	while ( (msg = curl_multi_info_read(m_multi, &left)) != nullptr ) {
+		if ( msg->msg != CURLMSG_DONE ) {
+			continue;
+		}
+		CURL *handle = msg->easy_handle;
+		CURLcode result = msg->data.result;
+		curl_multi_remove_handle(m_multi, handle);
+		if ( handle == m_curl ) {
+			m_primaryActive = false;
+		} else {
+			m_hedgeActive = false;
+		}
+		if ( m_winner != nullptr ) {
+			continue;
+		}
+		if ( result == CURLE_OK ) {
+			m_winner = handle;
+		} else {
+			m_result = result;
+			m_errorBuff = handle == m_curl ? m_curlErrorBuff : m_hedgeErrorBuff;
+		}
+	}
+
+	if ( m_winner == nullptr && (m_primaryActive || m_hedgeActive) && ! cancelled() ) {
+		if ( ! m_hedged && m_primaryActive && m_hedgeAfter > 0 ) {
+			double elapsed = std::chrono::duration<double>(DriverClock::get().now() - m_start).count();
+			if ( elapsed >= m_hedgeAfter ) {
+				m_hedged = true;
+				std::string hedgeError;
+				if ( takeHedge() && prepareHandle(m_curlHedge, m_hedgeErrorBuff, m_url.c_str(), &m_hedgeSink, hedgeError) ) {
+					// The primary connection is busy, so curl opens a second one
+					curl_multi_add_handle(m_multi, m_curlHedge);
+					m_hedgeActive = true;
+				}
+			}
+		}
+		return false;
+	}
+
+	// Whichever request is still running lost, removing it aborts it
+	abort();
+
+	ok = false;
+	if ( m_winner == nullptr && cancelled() ) {
+		error = "Cancelled";
+		return true;
+	}
+	if ( m_winner == nullptr ) {
+		m_timedOut = m_result == CURLE_OPERATION_TIMEDOUT;
+		error = strlen(m_errorBuff) ? m_errorBuff : curl_easy_strerror(m_result);
+		return true;
+	}
+
+	if ( m_winner == m_curlHedge ) {
+		m_sink->begin();
+		if ( ! m_sink->write(m_hedgeBody.data(), m_hedgeBody.size()) ) {
+			error = "Payload rejected";
+			return true;
+		}
+	}
+	finishRequest(std::chrono::duration<double>(DriverClock::get().now() - m_start).count(),
+			m_winner == m_curlHedge);
+	ok = true;
+	return true;
+}
+
+void CurlTransport::abort() {
+	if ( m_primaryActive ) {
+		curl_multi_remove_handle(m_multi, m_curl);
+		m_primaryActive = false;
+	}
+	if ( m_hedgeActive ) {
+		curl_multi_remove_handle(m_multi, m_curlHedge);
+		m_hedgeActive = false;
+	}
+}
@@ -0,0 +1,311 @@
+/*
+  This file is part of the Pollux Astro Cloudwatcher software
+ 
+  Created by Philipp Weber
+  Copyright (c) 2023 Philipp Weber
+  All rights reserved.
+ 
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+ 
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <capture.h>
+#include <curl/curl.h>
+#include <netdb.h>
+#include <poll.h>
+
+// Receives the payload while it is transferred. begin() starts a new
+// response, returning false from write() aborts the transfer.
+class BodySink {
+	public:
+		virtual ~BodySink() = default;
+		virtual void begin() = 0;
+		virtual bool write(const char *data, size_t len) = 0;
+};
+
+// Collects the payload into a string
+class StringSink : public BodySink {
+	public:
+		explicit StringSink(std::string &body) : m_body(body) {}
+		void begin() override { m_body.clear(); }
+		bool write(const char *data, size_t len) override { m_body.append(data, len); return true; }
+
+	private:
+		std::string &m_body;
+};
+
+// A way of getting the payload from the device. A request is run by one
+// thread at a time, cancel() may be called from any thread and aborts every
+// request whose token was taken before it.
+class Transport {
+	public:
+		Transport();
+		virtual ~Transport();
+		virtual const char *getName() const = 0;
+
+		uint64_t cancelToken() const { return m_cancelGeneration; }
+		bool cancelled() const { return m_cancelGeneration != m_requestGeneration; }
+		void cancel();
+		// Drop open connections, the next request starts from scratch
+		virtual void reset() = 0;
+
+		// Blocking request, drives the non-blocking interface below
+		bool get(const char *url, BodySink &sink, std::string &error, uint64_t token);
+
+		// Non-blocking use, so many transports can share one poll() loop.
+		// Once start() succeeded add the descriptors from collect() to every
+		// poll() and hand the results to advance(), until that returns true
+		// with the outcome in ok and error. abort() drops a started request.
+		virtual bool start(const char *url, BodySink &sink, std::string &error, uint64_t token) = 0;
+		virtual void collect(std::vector<struct pollfd> &fds, int &timeout) = 0;
+		virtual bool advance(const std::vector<struct pollfd> &fds, bool &ok, std::string &error) = 0;
+		virtual void abort() = 0;
+
+		// Share of requests in percent that may be duplicated on a second
+		// connection once they run longer than the recent p95 latency
+		void setHedgeBudget(double percent) { m_hedgeBudget = percent; }
+
+		// Whether the last request failed by running out of time
+		bool timedOut() const { return m_timedOut; }
+		double getLatencyP95() const { return m_latencyP95; }
+		uint64_t getRequests() const { return m_requests; }
+		uint64_t getHedges() const { return m_hedges; }
+		uint64_t getHedgeWins() const { return m_hedgeWins; }
+
+	protected:
+		static constexpr int TIMEOUT_MS = 30000;
+		static constexpr size_t LATENCY_SAMPLES = 64;
+		static constexpr size_t HEDGE_MIN_SAMPLES = 20;
+		static constexpr double HEDGE_BURST = 3.0;
+
+		// Called at the start of a request, returns after how many seconds
+		// it should be hedged, 0 for never
+		double beginRequest(uint64_t token);
+		bool takeHedge();
+		void finishRequest(double seconds, bool hedgeWon);
+
+		// Woken by cancel(), so a poll() it is part of returns right away
+		void collectWake(std::vector<struct pollfd> &fds);
+		void drainWake();
+		// Lowers a poll() timeout in ms, negative means none
+		static void lowerTimeout(int &timeout, double ms);
+
+		std::atomic<uint64_t> m_cancelGeneration{0};
+		uint64_t m_requestGeneration = 0;
+		bool m_timedOut = false;
+
+	private:
+		int m_wakeFd = -1;
+		std::vector<struct pollfd> m_fds;
+		std::array<double, LATENCY_SAMPLES> m_latencies;
+		size_t m_latencyIndex = 0;
+		size_t m_latencyCount = 0;
+		double m_hedgeTokens = 0;
+		std::atomic<double> m_hedgeBudget{0};
+		std::atomic<double> m_latencyP95{0};
+		std::atomic<uint64_t> m_requests{0};
+		std::atomic<uint64_t> m_hedges{0};
+		std::atomic<uint64_t> m_hedgeWins{0};
+};
+
+// libcurl based transport, handles anything curl can talk to
+class CurlTransport : public Transport {
+	public:
+		CurlTransport() = default;
+		virtual ~CurlTransport();
+		const char *getName() const override { return "curl"; }
+
+		void reset() override;
+		bool start(const char *url, BodySink &sink, std::string &error, uint64_t token) override;
+		void collect(std::vector<struct pollfd> &fds, int &timeout) override;
+		bool advance(const std::vector<struct pollfd> &fds, bool &ok, std::string &error) override;
+		void abort() override;
+
+	private:
+		bool init(std::string &error);
+		bool prepareHandle(CURL *&handle, char *errorBuff, const char *url, BodySink *sink, std::string &error);
+		static size_t writeCB(void *contents, size_t size, size_t nmemb, void *userp);
+		static int progressCB(void *userp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+		static int socketCB(CURL *easy, curl_socket_t socket, int what, void *userp, void *socketp);
+		static int timerCB(CURLM *multi, long timeout, void *userp);
+		bool ownsSocket(int fd) const;
+
+		bool m_initialized = false;
+		CURLM *m_multi = nullptr;
+		CURL *m_curl = nullptr;
+		CURL *m_curlHedge = nullptr;
+		char m_curlErrorBuff[CURL_ERROR_SIZE] = "";
+		char m_hedgeErrorBuff[CURL_ERROR_SIZE] = "";
+		// Sockets and timeout curl waits for, kept up to date by its
+		// callbacks
+		std::vector<struct pollfd> m_sockets;
+		bool m_timerSet = false;
+		std::chrono::steady_clock::time_point m_timerAt;
+
+		// The request in progress
+		std::string m_url;
+		BodySink *m_sink = nullptr;
+		// Only the primary request streams into the sink, a hedge is
+		// collected and replayed into it should it win
+		std::string m_hedgeBody;
+		StringSink m_hedgeSink{m_hedgeBody};
+		CURL *m_winner = nullptr;
+		CURLcode m_result = CURLE_OK;
+		const char *m_errorBuff = m_curlErrorBuff;
+		bool m_primaryActive = false;
+		bool m_hedgeActive = false;
+		bool m_hedged = false;
+		double m_hedgeAfter = 0;
+		std::chrono::steady_clock::time_point m_start;
+};
+
+// Minimal HTTP/1.1 client for the one GET the driver needs. Non-blocking
+// sockets, keep-alive, Content-Length and chunked bodies, plain http only.
+class HttpTransport : public Transport {
+	public:
+		HttpTransport();
+		virtual ~HttpTransport();
+		const char *getName() const override { return "native"; }
+
+		void reset() override;
+		bool start(const char *url, BodySink &sink, std::string &error, uint64_t token) override;
+		void collect(std::vector<struct pollfd> &fds, int &timeout) override;
+		bool advance(const std::vector<struct pollfd> &fds, bool &ok, std::string &error) override;
+		void abort() override;
+
+	private:
+		static constexpr size_t MAX_HEADER = 8192;
+		static constexpr size_t MAX_BODY = 1 << 20;
+
+		// One connection to the device and the response being read on it
+		struct Connection {
+			enum State {
+				IDLE,
+				CONNECTING,
+				SENDING,
+				HEADERS,
+				BODY,
+				DONE,
+				FAILED
+			};
+			int fd = -1;
+			State state = IDLE;
+			bool reused = false;
+			bool keepAlive = false;
+			bool chunked = false;
+			long contentLength = -1;
+			size_t chunkLeft = 0;
+			size_t chunkSkip = 0;
+			bool chunkTrailer = false;
+			size_t sent = 0;
+			size_t received = 0;
+			std::string in;
+			BodySink *sink = nullptr;
+			std::string error;
+
+			void close();
+			short events() const;
+		};
+
+		// Name lookup on its own thread, which keeps it alive should the
+		// request be dropped meanwhile. fd becomes readable once done.
+		struct Lookup {
+			Lookup();
+			~Lookup();
+			int fd = -1;
+			std::atomic<bool> done{false};
+			int result = 0;
+			struct sockaddr_storage addr;
+			socklen_t addrLen = 0;
+		};
+
+		bool parseUrl(const char *url, std::string &error);
+		bool resolve(std::string &error);
+		bool lookedUp(bool &ok, std::string &error);
+		bool open(Connection &conn, BodySink *sink);
+		void deliver(Connection &conn, const char *data, size_t len);
+		void step(Connection &conn, short revents);
+		void fail(Connection &conn, const char *what, int err = 0);
+		void parseHeaders(Connection &conn);
+		void parseBody(Connection &conn);
+
+		std::string m_url;
+		std::string m_host;
+		std::string m_port;
+		std::string m_request;
+		struct sockaddr_storage m_addr;
+		socklen_t m_addrLen = 0;
+		std::shared_ptr<Lookup> m_lookup = nullptr;
+		Connection m_conn;
+		Connection m_hedge;
+
+		// The request in progress
+		BodySink *m_sink = nullptr;
+		// Only the primary request streams into the sink, a hedge is
+		// collected and replayed into it should it win
+		std::string m_hedgeBody;
+		StringSink m_hedgeSink{m_hedgeBody};
+		bool m_retried = false;
+		bool m_hedged = false;
+		double m_hedgeAfter = 0;
+		std::chrono::steady_clock::time_point m_start;
+		std::chrono::steady_clock::time_point m_deadline;
+		// Where collect() put the descriptors of both connections
+		size_t m_fdIndex = 0;
+};
+
+// Plays the payloads of a capture back instead of asking a device, one per
+// request in the order they were captured. speed 1 keeps the original
+// timing, 10 plays ten times as fast and 0 answers right away. The url is
+// ignored.
+class ReplayTransport : public Transport {
+	public:
+		const char *getName() const override { return "replay"; }
+
+		// Starts over from the first payload
+		bool load(const std::string &path, std::string &error);
+		void setSpeed(double speed);
+		double getSpeed() const { return m_speed; }
+		size_t getPosition() const { return m_next; }
+		size_t getSize() const { return m_size; }
+
+		void reset() override {}
+		bool start(const char *url, BodySink &sink, std::string &error, uint64_t token) override;
+		void collect(std::vector<struct pollfd> &fds, int &timeout) override;
+		bool advance(const std::vector<struct pollfd> &fds, bool &ok, std::string &error) override;
+		void abort() override;
+
+	private:
+		CaptureReader m_capture;
+		std::atomic<double> m_speed{1};
+		std::atomic<size_t> m_next{0};
+		std::atomic<size_t> m_size{0};
+		bool m_started = false;
+		// Where the first payload would have been requested
+		std::chrono::steady_clock::time_point m_origin;
+
+		// The request in progress
+		BodySink *m_sink = nullptr;
+		const CaptureReader::Payload *m_payload = nullptr;
+		std::chrono::steady_clock::time_point m_start;
+		std::chrono::steady_clock::time_point m_due;
+};